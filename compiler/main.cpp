@@ -18,47 +18,249 @@
  * Date: April 7th 2025
  */
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <sstream>
+#include <thread>
 #include "../Token.hpp"
 
 #include "../Lexer/Lexer.hpp"
 #include "../Parser/Parser.hpp"
+#include "../ir/IRBuilder.hpp"
+#include "../ir/PassManager.hpp"
+#include "../ir/StackLowering.hpp"
+#include "../stackMachine/Peephole.hpp"
+#include "../stackMachine/StackCodeGen.hpp"
 #include "../stackMachine/StackMachine.hpp"
+#include "../registerMachine/RegisterCodeGen.hpp"
 
-int main(int argc, char **argv) {
-    if(argc == 1) {
-        std::cerr << "Compile Error: no input files\n";
-        exit(1);
+enum class Backend { STACK, REGISTER };
+
+// Functions share nothing during code generation, so each one is generated on
+// whichever thread is free into its own StackCodeGen; linking in source order
+// keeps the result identical to a serial run. With passes, functions go
+// through the SSA middle end instead; dumpIR prints their optimized IR.
+bool generateStackCode(const std::vector<ASTPtr> &program, Program &result, const PassManager *passes, bool dumpIR) {
+    std::vector<StackCodeGen> units;
+    units.reserve(program.size());
+    for (const auto& func : program) {
+        auto function = dynamic_cast<const FunctionNode*>(func.get());
+        units.emplace_back(function ? function->functionName() : "");
     }
 
-    Lexer lexer(argv[1]);
-    Parser parser(lexer);
+    std::vector<std::string> errors(program.size());
+    std::vector<std::string> dumps(program.size());
+    std::atomic<size_t> nextUnit{0};
+    auto generate = [&]() {
+        for (size_t unit = nextUnit++; unit < program.size(); unit = nextUnit++) {
+            try {
+                if (passes && dynamic_cast<const FunctionNode*>(program[unit].get())) {
+                    IRFunction function;
+                    IRBuilder builder(function);
+                    program[unit]->emitIR(builder);
+                    passes->run(function);
+                    if (dumpIR) {
+                        std::ostringstream dump;
+                        print(function, dump);
+                        dumps[unit] = dump.str();
+                    }
+                    lowerToStackCode(function, units[unit]);
+                } else {
+                    program[unit]->emitStackCode(units[unit]);
+                }
+            } catch (const std::exception& e) {
+                errors[unit] = e.what();
+            }
+        }
+    };
 
-    std::ofstream outputFile("out.vsm");
-    AST::setOutputStream(&outputFile);
+    const size_t threadCount = std::min<size_t>(program.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; i++) threads.emplace_back(generate);
+    generate();
+    for (auto& thread : threads) thread.join();
 
-    try {
+    for (const std::string &dump : dumps) std::cerr << dump;
+    for (const std::string &error : errors) {
+        if (error.empty()) continue;
+        std::cerr << "Compile Error: " << error << std::endl;
+        return false;
+    }
 
-        outputFile << "jump _main:\n";
+    StackCodeGen linked;
+    linked.emitBranch(Opcode::JUMP, "_main:");
+    for (StackCodeGen &unit : units) {
+        linked.append(std::move(unit));
+    }
+    return linked.finish(result);
+}
 
-        std::vector<ASTPtr> program = parser.parseProgram();
+int main(int argc, char **argv) {
+    std::string sourceFile;
+    DispatchMode dispatchMode = DispatchMode::SWITCH;
+    size_t stackSlots = StackRegion::DEFAULT_SLOTS;
+    uint64_t fuelLimit = UINT64_MAX;
+    bool profile = false;
+    bool lineBuffered = false;
+    std::string sampleFile;
+    std::string assemblyFile;
+    Backend backend = Backend::STACK;
+    bool foldEnabled = true;
+    bool peepholeEnabled = true;
+    bool peepholeReport = false;
+    bool ssaEnabled = false;
+    bool dumpIR = false;
+    std::string pipeline = PassManager::DEFAULT_PIPELINE;
 
-        for (const auto& func : program) {
-            func->emitStackCode();
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--dispatch=switch") {
+            dispatchMode = DispatchMode::SWITCH;
+        } else if(arg == "--dispatch=threaded") {
+            dispatchMode = DispatchMode::THREADED;
+        } else if(arg == "--jit") {
+            dispatchMode = DispatchMode::JIT;
+        } else if(arg == "--profile") {
+            profile = true;
+        } else if(arg == "--line-buffered") {
+            lineBuffered = true;
+        } else if(arg.starts_with("--sample=")) {
+            sampleFile = arg.substr(std::string("--sample=").size());
+        } else if(arg.starts_with("--fuel=")) {
+            try {
+                fuelLimit = std::stoull(arg.substr(std::string("--fuel=").size()));
+            } catch(const std::exception &) {
+                fuelLimit = 0;
+            }
+            if(fuelLimit == 0) {
+                std::cerr << "Compile Error: invalid fuel limit " << arg << "\n";
+                exit(1);
+            }
+        } else if(arg.starts_with("--stack-size=")) {
+            try {
+                stackSlots = std::stoul(arg.substr(std::string("--stack-size=").size()));
+            } catch(const std::exception &) {
+                stackSlots = 0;
+            }
+            if(stackSlots == 0) {
+                std::cerr << "Compile Error: invalid stack size " << arg << "\n";
+                exit(1);
+            }
+        } else if(arg == "--backend=stack") {
+            backend = Backend::STACK;
+        } else if(arg == "--backend=register") {
+            backend = Backend::REGISTER;
+        } else if(arg == "--no-fold") {
+            foldEnabled = false;
+        } else if(arg == "--no-peephole") {
+            peepholeEnabled = false;
+        } else if(arg == "--peephole-report") {
+            peepholeReport = true;
+        } else if(arg == "--ssa") {
+            ssaEnabled = true;
+        } else if(arg.starts_with("--passes=")) {
+            ssaEnabled = true;
+            pipeline = arg.substr(std::string("--passes=").size());
+        } else if(arg == "--dump-ir") {
+            ssaEnabled = true;
+            dumpIR = true;
+        } else if(arg == "-o") {
+            if(i + 1 >= argc) {
+                std::cerr << "Compile Error: -o requires a file name\n";
+                exit(1);
+            }
+            assemblyFile = argv[++i];
+        } else if(arg.starts_with("--")) {
+            std::cerr << "Compile Error: unknown option " << arg << "\n";
+            exit(1);
+        } else {
+            sourceFile = arg;
         }
+    }
 
+    if(sourceFile.empty()) {
+        std::cerr << "Compile Error: no input files\n";
+        exit(1);
+    }
+
+    PassManager passes;
+    std::string pipelineError;
+    if(ssaEnabled && !passes.addPipeline(pipeline, pipelineError)) {
+        std::cerr << "Compile Error: " << pipelineError << "\n";
+        exit(1);
+    }
+
+    Lexer lexer(sourceFile);
+    Parser parser(lexer);
+
+    std::vector<ASTPtr> program;
+    try {
+        program = parser.parseProgram();
     } catch (const std::exception& e) {
         std::cerr << "Compile Error: " << e.what() << std::endl;
         return 1;
     }
+    if(foldEnabled) foldConstants(program);
+
+    if(backend == Backend::REGISTER) {
+        if(!assemblyFile.empty()) {
+            std::cerr << "Compile Error: -o writes stack machine code and needs --backend=stack\n";
+            return 1;
+        }
+        if(ssaEnabled) {
+            std::cerr << "Compile Error: the SSA middle end lowers to stack machine code and needs --backend=stack\n";
+            return 1;
+        }
+
+        RegisterCodeGen codeGen;
+        RegisterProgram registerProgram;
+        try {
+            for (const auto& func : program) {
+                func->emitRegisterCode(codeGen, -1);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Compile Error: " << e.what() << std::endl;
+            return 1;
+        }
 
-    outputFile.close();
+        if(!codeGen.finish(registerProgram)) return 1;
+
+        RegisterMachine registerMachine(std::move(registerProgram));
+        return registerMachine.runProgram();
+    }
+
+    // Code goes straight from the AST into an in-memory program; -o also writes it out as .vsm
+    Program stackProgram;
+    if(!generateStackCode(program, stackProgram, ssaEnabled ? &passes : nullptr, dumpIR)) return 1;
+    if(peepholeEnabled) {
+        const size_t generated = stackProgram.code.size();
+        const size_t eliminated = optimizePeephole(stackProgram);
+        if(peepholeReport) {
+            std::cerr << "Peephole: eliminated " << eliminated << " of " << generated << " instructions" << std::endl;
+        }
+    }
+
+    if(!assemblyFile.empty()) {
+        std::ofstream outputFile(assemblyFile);
+        if(!outputFile.is_open()) {
+            std::cerr << "Compile Error: unable to open " << assemblyFile << "\n";
+            return 1;
+        }
+        writeAssembly(stackProgram, outputFile);
+    }
 
-    StackMachine stackMachine;
-    stackMachine.loadProgramFromFile("out.vsm");
-    stackMachine.runProgram();
+    std::shared_ptr<ProgramImage> image = StackMachine::loadImage(stackProgram);
+    if(!image) return 1;
 
-    return 0;
+    StackMachine stackMachine(stackSlots);
+    stackMachine.setProgram(std::move(image));
+    stackMachine.setFuelLimit(fuelLimit);
+    if(lineBuffered) stackMachine.setLineBuffered(true);
+    if(profile) stackMachine.enableProfiling();
+    if(!sampleFile.empty()) stackMachine.enableSampling(sampleFile);
+    const RunResult result = stackMachine.runProgram(dispatchMode);
+    return result.exitValue;
 }
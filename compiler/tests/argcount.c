@@ -0,0 +1,8 @@
+int f(int a) {
+    return a;
+}
+
+int main() {
+    print(f(1, 2));
+    return 0;
+}
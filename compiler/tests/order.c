@@ -0,0 +1,16 @@
+int main() {
+    int x = 0;
+    read(x);
+    print(x + read(x));
+    print(x - read(x));
+    if (x < read(x)) {
+        print(1);
+    } else {
+        print(0);
+    }
+    print(read(x) * read(x));
+    int i = 0;
+    while (i < 3) { i = i + 1; }
+    print(i + x);
+    return 0;
+}
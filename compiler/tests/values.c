@@ -0,0 +1,11 @@
+int main() {
+    int x = 0;
+    int y = 0;
+    y = read(x);
+    print(y);
+    y = print(x * 2);
+    print(y + 1);
+    print(read(x) + 1);
+    print(print(x) - 1);
+    return 0;
+}
@@ -0,0 +1,312 @@
+#include "IR.hpp"
+
+#include <algorithm>
+
+#include "../stackMachine/Bytecode.hpp"
+
+std::string toString(IROpcode opcode) {
+    switch(opcode) {
+        case IROpcode::CONST: return "const";
+        case IROpcode::PARAM: return "param";
+        case IROpcode::PHI: return "phi";
+        case IROpcode::COPY: return "copy";
+        case IROpcode::NEG: return "neg";
+        case IROpcode::ADD: return "add";
+        case IROpcode::SUB: return "sub";
+        case IROpcode::MUL: return "mul";
+        case IROpcode::DIV: return "div";
+        case IROpcode::MOD: return "mod";
+        case IROpcode::EQ: return "eq";
+        case IROpcode::NEQ: return "neq";
+        case IROpcode::LT: return "lt";
+        case IROpcode::LTE: return "lte";
+        case IROpcode::GT: return "gt";
+        case IROpcode::GTE: return "gte";
+        case IROpcode::CALL: return "call";
+        case IROpcode::READ: return "read";
+        case IROpcode::PRINT: return "print";
+        case IROpcode::PRINT_STR: return "print_str";
+        case IROpcode::JUMP: return "jump";
+        case IROpcode::BRANCH: return "branch";
+        case IROpcode::RETURN: return "return";
+    }
+    return "unknown";
+}
+
+bool isTerminator(IROpcode opcode) {
+    return opcode == IROpcode::JUMP || opcode == IROpcode::BRANCH || opcode == IROpcode::RETURN;
+}
+
+bool isComparison(IROpcode opcode) {
+    switch(opcode) {
+        case IROpcode::EQ:
+        case IROpcode::NEQ:
+        case IROpcode::LT:
+        case IROpcode::LTE:
+        case IROpcode::GT:
+        case IROpcode::GTE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool hasSideEffects(IROpcode opcode) {
+    switch(opcode) {
+        case IROpcode::DIV:
+        case IROpcode::MOD:
+        case IROpcode::CALL:
+        case IROpcode::READ:
+        case IROpcode::PRINT:
+        case IROpcode::PRINT_STR:
+            return true;
+        default:
+            return isTerminator(opcode);
+    }
+}
+
+std::vector<int> successors(const BasicBlock &block) {
+    if(block.instructions.empty() || !isTerminator(block.instructions.back().opcode)) return {};
+    return block.instructions.back().targets;
+}
+
+std::vector<int> reversePostorder(const IRFunction &function) {
+    std::vector<int> order;
+    std::vector<bool> visited(function.blocks.size(), false);
+
+    // Iterative depth-first search: each entry is a block and the next successor to visit.
+    // Successors are taken last first, so a branch is followed by the block taken when it is nonzero.
+    std::vector<std::pair<int, size_t>> stack = {{0, 0}};
+    visited[0] = true;
+    while(!stack.empty()) {
+        auto &[block, next] = stack.back();
+        const std::vector<int> targets = successors(function.blocks[block]);
+        if(next < targets.size()) {
+            const int successor = targets[targets.size() - 1 - next++];
+            if(!visited[successor]) {
+                visited[successor] = true;
+                stack.emplace_back(successor, 0);
+            }
+        } else {
+            order.push_back(block);
+            stack.pop_back();
+        }
+    }
+
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+// Cooper, Harvey and Kennedy's iterative algorithm over the reverse postorder
+std::vector<int> immediateDominators(const IRFunction &function) {
+    const std::vector<int> order = reversePostorder(function);
+    std::vector<int> position(function.blocks.size(), -1);
+    for(size_t i = 0; i < order.size(); i++) position[order[i]] = static_cast<int>(i);
+
+    std::vector<int> idom(function.blocks.size(), -1);
+    idom[0] = 0;
+
+    auto intersect = [&](int a, int b) {
+        while(a != b) {
+            while(position[a] > position[b]) a = idom[a];
+            while(position[b] > position[a]) b = idom[b];
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(size_t i = 1; i < order.size(); i++) {
+            const int block = order[i];
+            int dominator = -1;
+            for(int predecessor : function.blocks[block].predecessors) {
+                if(position[predecessor] < 0 || idom[predecessor] < 0) continue;
+                dominator = dominator < 0 ? predecessor : intersect(predecessor, dominator);
+            }
+            if(dominator != idom[block]) {
+                idom[block] = dominator;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+void removePredecessor(BasicBlock &block, int predecessor) {
+    const auto edge = std::find(block.predecessors.begin(), block.predecessors.end(), predecessor);
+    if(edge == block.predecessors.end()) return;
+
+    const auto index = edge - block.predecessors.begin();
+    block.predecessors.erase(edge);
+    for(IRInstruction &instruction : block.instructions) {
+        if(instruction.opcode != IROpcode::PHI) break;
+        instruction.operands.erase(instruction.operands.begin() + index);
+    }
+}
+
+bool removeUnreachableBlocks(IRFunction &function) {
+    std::vector<bool> reachable(function.blocks.size(), false);
+    for(int block : reversePostorder(function)) reachable[block] = true;
+    if(std::all_of(reachable.begin(), reachable.end(), [](bool r) { return r; })) return false;
+
+    for(size_t block = 0; block < function.blocks.size(); block++) {
+        if(reachable[block]) continue;
+        for(int successor : successors(function.blocks[block])) {
+            BasicBlock &target = function.blocks[successor];
+            while(std::find(target.predecessors.begin(), target.predecessors.end(), block) != target.predecessors.end()) {
+                removePredecessor(target, static_cast<int>(block));
+            }
+        }
+    }
+
+    std::vector<int> newIndex(function.blocks.size(), -1);
+    std::vector<BasicBlock> kept;
+    for(size_t block = 0; block < function.blocks.size(); block++) {
+        if(!reachable[block]) continue;
+        newIndex[block] = static_cast<int>(kept.size());
+        kept.push_back(std::move(function.blocks[block]));
+    }
+    for(BasicBlock &block : kept) {
+        for(int &predecessor : block.predecessors) predecessor = newIndex[predecessor];
+        for(int &target : block.instructions.back().targets) target = newIndex[target];
+    }
+    function.blocks = std::move(kept);
+    return true;
+}
+
+void splitCriticalEdges(IRFunction &function) {
+    const size_t blockCount = function.blocks.size();
+    for(size_t block = 0; block < blockCount; block++) {
+        if(function.blocks[block].instructions.back().targets.size() < 2) continue;
+
+        for(size_t edge = 0; edge < function.blocks[block].instructions.back().targets.size(); edge++) {
+            const int successor = function.blocks[block].instructions.back().targets[edge];
+            const std::vector<IRInstruction> &instructions = function.blocks[successor].instructions;
+            if(instructions.front().opcode != IROpcode::PHI) continue;
+
+            const int split = static_cast<int>(function.blocks.size());
+            IRInstruction jump{IROpcode::JUMP};
+            jump.targets = {successor};
+            function.blocks.push_back({{jump}, {static_cast<int>(block)}});
+
+            // The new block takes over the edge's slot, so the phi operands stay lined up
+            std::vector<int> &predecessors = function.blocks[successor].predecessors;
+            *std::find(predecessors.begin(), predecessors.end(), static_cast<int>(block)) = split;
+            function.blocks[block].instructions.back().targets[edge] = split;
+        }
+    }
+}
+
+void replaceValues(IRFunction &function, const std::vector<int> &replacement) {
+    auto resolve = [&](int value) {
+        // Bounded, in case a pass ever produced a cycle
+        for(size_t hops = 0; value >= 0 && value < static_cast<int>(replacement.size()) &&
+                             replacement[value] >= 0 && hops < replacement.size(); hops++) {
+            value = replacement[value];
+        }
+        return value;
+    };
+
+    for(BasicBlock &block : function.blocks) {
+        for(IRInstruction &instruction : block.instructions) {
+            for(int &operand : instruction.operands) operand = resolve(operand);
+        }
+    }
+}
+
+bool verify(const IRFunction &function, std::string &error) {
+    auto fail = [&](size_t block, const std::string &message) {
+        error = function.name + " bb" + std::to_string(block) + ": " + message;
+        return false;
+    };
+
+    if(function.blocks.empty()) return fail(0, "no entry block");
+
+    std::vector<int> definitions(function.valueCount, 0);
+    std::vector<std::vector<int>> incoming(function.blocks.size());
+    for(size_t block = 0; block < function.blocks.size(); block++) {
+        const std::vector<IRInstruction> &instructions = function.blocks[block].instructions;
+        if(instructions.empty() || !isTerminator(instructions.back().opcode)) return fail(block, "does not end in a terminator");
+
+        bool pastPhis = false;
+        for(size_t i = 0; i < instructions.size(); i++) {
+            const IRInstruction &instruction = instructions[i];
+            if(isTerminator(instruction.opcode) && i + 1 != instructions.size()) return fail(block, "terminator before the end");
+            if(instruction.opcode == IROpcode::PHI) {
+                if(pastPhis) return fail(block, "phi after other instructions");
+                if(instruction.operands.size() != function.blocks[block].predecessors.size()) {
+                    return fail(block, "phi %" + std::to_string(instruction.result) + " does not match the predecessors");
+                }
+            } else {
+                pastPhis = true;
+            }
+            if(instruction.result >= function.valueCount) return fail(block, "value out of range");
+            if(instruction.result >= 0 && definitions[instruction.result]++ > 0) {
+                return fail(block, "value %" + std::to_string(instruction.result) + " is defined twice");
+            }
+        }
+
+        for(int successor : successors(function.blocks[block])) {
+            if(successor < 0 || successor >= static_cast<int>(function.blocks.size())) return fail(block, "branch out of range");
+            incoming[successor].push_back(static_cast<int>(block));
+        }
+    }
+
+    for(size_t block = 0; block < function.blocks.size(); block++) {
+        std::vector<int> expected = function.blocks[block].predecessors;
+        std::sort(expected.begin(), expected.end());
+        std::sort(incoming[block].begin(), incoming[block].end());
+        if(expected != incoming[block]) return fail(block, "predecessors do not match the edges");
+
+        for(const IRInstruction &instruction : function.blocks[block].instructions) {
+            for(int operand : instruction.operands) {
+                if(operand < 0 || operand >= function.valueCount || definitions[operand] == 0) {
+                    return fail(block, "use of undefined %" + std::to_string(operand));
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void print(const IRFunction &function, std::ostream &output) {
+    output << "function " << function.name << " (" << function.paramCount << " params)\n";
+    for(size_t block = 0; block < function.blocks.size(); block++) {
+        output << "bb" << block << ":";
+        if(!function.blocks[block].predecessors.empty()) {
+            output << " ; preds";
+            for(int predecessor : function.blocks[block].predecessors) output << " bb" << predecessor;
+        }
+        output << "\n";
+
+        for(const IRInstruction &instruction : function.blocks[block].instructions) {
+            output << "    ";
+            if(instruction.result >= 0) output << "%" << instruction.result << " = ";
+            output << toString(instruction.opcode);
+
+            if(instruction.opcode == IROpcode::CONST) {
+                output << " " << (instruction.constant.isInt() ? std::to_string(instruction.constant.asInt())
+                                                               : formatFloat(instruction.constant.asFloat()));
+            } else if(instruction.opcode == IROpcode::PARAM) {
+                output << " " << instruction.index;
+            } else if(instruction.opcode == IROpcode::CALL) {
+                output << " " << instruction.text;
+            } else if(instruction.opcode == IROpcode::PRINT_STR) {
+                output << " \"" << instruction.text << "\"";
+            }
+
+            // Operands follow the opcode's own argument, if it has one, after a comma
+            bool first = instruction.opcode != IROpcode::CALL;
+            for(int operand : instruction.operands) {
+                output << (first ? " " : ", ") << "%" << operand;
+                first = false;
+            }
+            for(int target : instruction.targets) {
+                output << (first ? " " : ", ") << "bb" << target;
+                first = false;
+            }
+            output << "\n";
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef IR_HPP
+#define IR_HPP
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "../stackMachine/Value.hpp"
+
+// SSA form of one function: a control-flow graph of basic blocks whose
+// instructions each define at most one value. Values are numbered per
+// function, and a source local exists only as the values assigned to it.
+enum class IROpcode : uint8_t {
+    CONST, PARAM, PHI, COPY,
+
+    // Operators, with the VM's int/float semantics
+    NEG, ADD, SUB, MUL, DIV, MOD,
+    EQ, NEQ, LT, LTE, GT, GTE,
+
+    CALL, READ, PRINT, PRINT_STR, // PRINT's value is the one it printed, as print() leaves it
+
+    // Terminators
+    JUMP, BRANCH, RETURN,
+};
+
+std::string toString(IROpcode opcode);
+bool isTerminator(IROpcode opcode);
+bool isComparison(IROpcode opcode);
+// Whether the instruction has to run even when nothing uses its value:
+// calls and I/O, and division, which can trap or print an error
+bool hasSideEffects(IROpcode opcode);
+
+struct IRInstruction {
+    IROpcode opcode;
+    int result = -1;             // Value defined, -1 when there is none
+    std::vector<int> operands{}; // A phi's operands line up with its block's predecessors
+    std::vector<int> targets{};  // JUMP: {target}; BRANCH: {taken when nonzero, taken when zero}
+    Value constant{};            // CONST
+    int index = 0;               // PARAM: argument number
+    std::string text{};          // CALL: callee; PRINT_STR: text between the quotes
+    int line = 0;                // Source line, 0 when unknown
+};
+
+struct BasicBlock {
+    std::vector<IRInstruction> instructions; // Phis first, one terminator last
+    std::vector<int> predecessors;           // One entry per incoming edge
+};
+
+struct IRFunction {
+    std::string name;
+    int paramCount = 0;
+    int line = 0;
+    int valueCount = 0;
+    std::vector<BasicBlock> blocks; // blocks[0] is the entry
+
+    int newValue() { return valueCount++; }
+};
+
+std::vector<int> successors(const BasicBlock &block);
+std::vector<int> reversePostorder(const IRFunction &function);
+// Immediate dominator of every block; the entry is its own, unreachable blocks get -1
+std::vector<int> immediateDominators(const IRFunction &function);
+
+// Drops one incoming edge from predecessor together with its phi operands
+void removePredecessor(BasicBlock &block, int predecessor);
+// Deletes blocks the entry cannot reach and renumbers the rest
+bool removeUnreachableBlocks(IRFunction &function);
+// Gives every edge from a block with several successors into a block with
+// phis its own block, so the phi copies of that edge have a place to go
+void splitCriticalEdges(IRFunction &function);
+// Rewrites every operand through replacement (value -> value, -1 to keep it), following chains
+void replaceValues(IRFunction &function, const std::vector<int> &replacement);
+
+// Checks the structural invariants above; on failure describes the first problem in error
+bool verify(const IRFunction &function, std::string &error);
+void print(const IRFunction &function, std::ostream &output);
+
+#endif //IR_HPP
@@ -0,0 +1,182 @@
+#include "IRBuilder.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+    void checkOperands(const std::vector<int> &operands) {
+        if(std::any_of(operands.begin(), operands.end(), [](int operand) { return operand < 0; })) {
+            throw std::runtime_error("Statement used as a value");
+        }
+    }
+}
+
+void IRBuilder::beginFunction(const std::string &name, int paramCount, int line) {
+    function.name = name;
+    function.paramCount = paramCount;
+    function.line = line;
+    sourceLine = line;
+
+    setBlock(newBlock());
+    sealBlock(current);
+    for(int param = 0; param < paramCount; param++) {
+        IRInstruction instruction{IROpcode::PARAM};
+        instruction.index = param;
+        writeVariable(param, append(std::move(instruction)).result);
+    }
+}
+
+void IRBuilder::endFunction() {
+    if(!isTerminated()) emitReturn(emitConstant(Value(0)));
+    for(size_t block = 0; block < function.blocks.size(); block++) {
+        if(!sealed[block]) sealBlock(static_cast<int>(block));
+    }
+    removeUnreachableBlocks(function);
+}
+
+int IRBuilder::newBlock() {
+    function.blocks.emplace_back();
+    definitions.emplace_back();
+    incompletePhis.emplace_back();
+    sealed.push_back(false);
+    return static_cast<int>(function.blocks.size()) - 1;
+}
+
+void IRBuilder::sealBlock(int block) {
+    for(const auto &[slot, phi] : incompletePhis[block]) completePhi(block, slot, phi);
+    incompletePhis[block].clear();
+    sealed[block] = true;
+}
+
+bool IRBuilder::isTerminated() const {
+    const std::vector<IRInstruction> &instructions = function.blocks[current].instructions;
+    return !instructions.empty() && isTerminator(instructions.back().opcode);
+}
+
+// Code after a return lands in a fresh block with no predecessors, dropped at the end
+IRInstruction &IRBuilder::append(IRInstruction instruction) {
+    if(isTerminated()) {
+        setBlock(newBlock());
+        sealBlock(current);
+    }
+
+    if(!isTerminator(instruction.opcode) && instruction.opcode != IROpcode::PRINT_STR) {
+        instruction.result = function.newValue();
+    }
+    instruction.line = sourceLine;
+    function.blocks[current].instructions.push_back(std::move(instruction));
+    return function.blocks[current].instructions.back();
+}
+
+// Phis and the implicit zeros of unassigned locals go after the block's existing phis
+int IRBuilder::insertAtTop(int block, IRInstruction instruction) {
+    std::vector<IRInstruction> &instructions = function.blocks[block].instructions;
+    const auto position = std::find_if(instructions.begin(), instructions.end(), [](const IRInstruction &existing) {
+        return existing.opcode != IROpcode::PHI;
+    });
+    instruction.result = function.newValue();
+    return instructions.insert(position, std::move(instruction))->result;
+}
+
+void IRBuilder::writeVariable(int slot, int value) {
+    checkOperands({value});
+    definitions[current][slot] = value;
+}
+
+int IRBuilder::readVariable(int slot, int block) {
+    const auto definition = definitions[block].find(slot);
+    if(definition != definitions[block].end()) return definition->second;
+    return readVariableRecursive(slot, block);
+}
+
+int IRBuilder::readVariableRecursive(int slot, int block) {
+    const std::vector<int> &predecessors = function.blocks[block].predecessors;
+    int value;
+    if(!sealed[block]) {
+        value = insertAtTop(block, IRInstruction{IROpcode::PHI});
+        incompletePhis[block][slot] = value;
+    } else if(predecessors.empty()) {
+        IRInstruction zero{IROpcode::CONST};
+        zero.constant = Value(0);
+        value = insertAtTop(block, std::move(zero));
+    } else if(predecessors.size() == 1) {
+        value = readVariable(slot, predecessors.front());
+    } else {
+        // Recorded before the operands are read, so a loop back to this block finds the phi
+        value = insertAtTop(block, IRInstruction{IROpcode::PHI});
+        definitions[block][slot] = value;
+        completePhi(block, slot, value);
+    }
+    definitions[block][slot] = value;
+    return value;
+}
+
+void IRBuilder::completePhi(int block, int slot, int phi) {
+    std::vector<int> operands;
+    for(int predecessor : function.blocks[block].predecessors) {
+        operands.push_back(readVariable(slot, predecessor));
+    }
+
+    for(IRInstruction &instruction : function.blocks[block].instructions) {
+        if(instruction.result == phi) {
+            instruction.operands = std::move(operands);
+            return;
+        }
+    }
+}
+
+void IRBuilder::addEdge(int from, int to) {
+    function.blocks[to].predecessors.push_back(from);
+}
+
+int IRBuilder::emit(IROpcode opcode, std::vector<int> operands) {
+    checkOperands(operands);
+    IRInstruction instruction{opcode};
+    instruction.operands = std::move(operands);
+    return append(std::move(instruction)).result;
+}
+
+int IRBuilder::emitConstant(Value value) {
+    IRInstruction instruction{IROpcode::CONST};
+    instruction.constant = value;
+    return append(std::move(instruction)).result;
+}
+
+int IRBuilder::emitCall(const std::string &name, std::vector<int> arguments) {
+    checkOperands(arguments);
+    IRInstruction instruction{IROpcode::CALL};
+    instruction.operands = std::move(arguments);
+    instruction.text = name;
+    return append(std::move(instruction)).result;
+}
+
+void IRBuilder::emitPrintString(const std::string &text) {
+    IRInstruction instruction{IROpcode::PRINT_STR};
+    instruction.text = text;
+    append(std::move(instruction));
+}
+
+void IRBuilder::emitJump(int target) {
+    IRInstruction instruction{IROpcode::JUMP};
+    instruction.targets = {target};
+    append(std::move(instruction));
+    addEdge(current, target);
+}
+
+void IRBuilder::emitBranch(int condition, int ifTrue, int ifFalse) {
+    checkOperands({condition});
+    IRInstruction instruction{IROpcode::BRANCH};
+    instruction.operands = {condition};
+    instruction.targets = {ifTrue, ifFalse};
+    append(std::move(instruction));
+    addEdge(current, ifTrue);
+    addEdge(current, ifFalse);
+}
+
+void IRBuilder::emitReturn(int value) {
+    checkOperands({value});
+    IRInstruction instruction{IROpcode::RETURN};
+    instruction.operands = {value};
+    append(std::move(instruction));
+}
@@ -0,0 +1,58 @@
+#ifndef IRBUILDER_HPP
+#define IRBUILDER_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "IR.hpp"
+
+// Builds one function's SSA form while its AST is walked, with the algorithm
+// of Braun et al. A read of a local looks backwards through the predecessors
+// for the value that reaches it, placing phis at joins. A block is sealed once
+// all its predecessors are known; a read in an unsealed block (a loop header)
+// gets a phi whose operands are filled in when it is sealed. Locals that are
+// never assigned read as 0, as the VM's enter leaves them.
+class IRBuilder {
+private:
+    IRFunction &function;
+    int current = 0;
+    int sourceLine = 0;
+    std::vector<std::map<int, int>> definitions;    // Per block: local slot -> value
+    std::vector<std::map<int, int>> incompletePhis; // Per block: local slot -> phi
+    std::vector<bool> sealed;
+
+    IRInstruction &append(IRInstruction instruction);
+    int insertAtTop(int block, IRInstruction instruction);
+    int readVariable(int slot, int block);
+    int readVariableRecursive(int slot, int block);
+    void completePhi(int block, int slot, int phi);
+    void addEdge(int from, int to);
+
+public:
+    explicit IRBuilder(IRFunction &function) : function(function) {}
+
+    void beginFunction(const std::string &name, int paramCount, int line);
+    // Returns 0 if control can fall off the end, then drops unreachable blocks
+    void endFunction();
+
+    int newBlock();
+    void setBlock(int block) { current = block; }
+    void sealBlock(int block);
+    bool isTerminated() const;
+    void setSourceLine(int line) { sourceLine = line; }
+
+    void writeVariable(int slot, int value);
+    int readVariable(int slot) { return readVariable(slot, current); }
+
+    // Each returns the value defined; operands of -1 (a statement used as a value) throw
+    int emit(IROpcode opcode, std::vector<int> operands = {});
+    int emitConstant(Value value);
+    int emitCall(const std::string &name, std::vector<int> arguments);
+    void emitPrintString(const std::string &text);
+    void emitJump(int target);
+    void emitBranch(int condition, int ifTrue, int ifFalse);
+    void emitReturn(int value);
+};
+
+#endif //IRBUILDER_HPP
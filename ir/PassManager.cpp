@@ -0,0 +1,30 @@
+#include "PassManager.hpp"
+#include "Passes.hpp"
+
+#include <sstream>
+#include <stdexcept>
+
+bool PassManager::addPipeline(const std::string &pipeline, std::string &error) {
+    std::istringstream names(pipeline);
+    std::string name;
+    while(std::getline(names, name, ',')) {
+        if(name.empty()) continue;
+        std::unique_ptr<Pass> pass = createPass(name);
+        if(!pass) {
+            error = "unknown pass " + name;
+            return false;
+        }
+        add(std::move(pass));
+    }
+    return true;
+}
+
+void PassManager::run(IRFunction &function) const {
+    std::string error;
+    if(!verify(function, error)) throw std::runtime_error("Invalid IR from the AST: " + error);
+
+    for(const auto &pass : passes) {
+        pass->run(function);
+        if(!verify(function, error)) throw std::runtime_error(std::string("Invalid IR after ") + pass->name() + ": " + error);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef PASSMANAGER_HPP
+#define PASSMANAGER_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "IR.hpp"
+
+// A transformation of one function's IR. Passes keep no state between runs,
+// so one pipeline can optimize many functions on many threads at once.
+class Pass {
+public:
+    virtual ~Pass() = default;
+    [[nodiscard]] virtual const char *name() const = 0;
+    // Returns whether the function changed
+    virtual bool run(IRFunction &function) const = 0;
+};
+
+// Runs a pipeline of passes over a function, verifying the IR after each one
+// so a broken pass is reported as a compile error instead of miscompiling.
+class PassManager {
+private:
+    std::vector<std::unique_ptr<Pass>> passes;
+
+public:
+    static constexpr const char *DEFAULT_PIPELINE = "sccp,copyprop,cse,copyprop,dce";
+
+    void add(std::unique_ptr<Pass> pass) { passes.push_back(std::move(pass)); }
+    // Adds the passes of a comma-separated list, e.g. "sccp,dce"; an unknown name is reported in error
+    bool addPipeline(const std::string &pipeline, std::string &error);
+
+    void run(IRFunction &function) const;
+};
+
+#endif //PASSMANAGER_HPP
@@ -0,0 +1,451 @@
+#include "Passes.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <optional>
+#include <set>
+#include <tuple>
+#include <utility>
+
+namespace {
+    bool sameConstant(const Value &a, const Value &b) {
+        if(a.getType() != b.getType()) return false;
+        if(a.isInt()) return a.asInt() == b.asInt();
+        return std::bit_cast<uint32_t>(a.asFloat()) == std::bit_cast<uint32_t>(b.asFloat());
+    }
+
+    std::optional<Value> compare(IROpcode opcode, auto a, auto b) {
+        switch(opcode) {
+            case IROpcode::EQ: return Value(static_cast<int>(a == b));
+            case IROpcode::NEQ: return Value(static_cast<int>(a != b));
+            case IROpcode::LT: return Value(static_cast<int>(a < b));
+            case IROpcode::LTE: return Value(static_cast<int>(a <= b));
+            case IROpcode::GT: return Value(static_cast<int>(a > b));
+            case IROpcode::GTE: return Value(static_cast<int>(a >= b));
+            default: return std::nullopt;
+        }
+    }
+
+    // What the VM computes for constant operands: int/int in wrapping 32-bit
+    // arithmetic, anything else promoted to float
+    std::optional<Value> evaluate(IROpcode opcode, const std::vector<Value> &operands) {
+        if(opcode == IROpcode::COPY) return operands[0];
+        if(opcode == IROpcode::NEG) {
+            const Value &operand = operands[0];
+            if(operand.isInt()) return Value(static_cast<int>(0u - static_cast<uint32_t>(operand.asInt())));
+            return Value(-operand.asFloat());
+        }
+        if(operands.size() != 2) return std::nullopt;
+
+        const Value &lhs = operands[0];
+        const Value &rhs = operands[1];
+        if(Value::bothInt(lhs, rhs)) {
+            const int a = lhs.asInt();
+            const int b = rhs.asInt();
+            const auto ua = static_cast<uint32_t>(a);
+            const auto ub = static_cast<uint32_t>(b);
+            switch(opcode) {
+                case IROpcode::ADD: return Value(static_cast<int>(ua + ub));
+                case IROpcode::SUB: return Value(static_cast<int>(ua - ub));
+                case IROpcode::MUL: return Value(static_cast<int>(ua * ub));
+                case IROpcode::DIV:
+                case IROpcode::MOD:
+                    if(b == 0 || (a == std::numeric_limits<int>::min() && b == -1)) return std::nullopt;
+                    return Value(opcode == IROpcode::DIV ? a / b : a % b);
+                default: return compare(opcode, a, b);
+            }
+        }
+
+        const float a = lhs.toFloat();
+        const float b = rhs.toFloat();
+        float result;
+        switch(opcode) {
+            case IROpcode::ADD: result = a + b; break;
+            case IROpcode::SUB: result = a - b; break;
+            case IROpcode::MUL: result = a * b; break;
+            case IROpcode::DIV: result = a / b; break;
+            case IROpcode::MOD: return std::nullopt; // An error at run time
+            default: return compare(opcode, a, b);
+        }
+        if(!std::isfinite(result)) return std::nullopt;
+        return Value(result);
+    }
+
+    struct LatticeValue {
+        enum State : uint8_t { UNDEFINED, CONSTANT, OVERDEFINED };
+
+        State state = UNDEFINED;
+        Value constant;
+
+        static LatticeValue overdefined() { return {OVERDEFINED, Value()}; }
+
+        // Meet: undefined is the identity, two different constants are overdefined
+        void meet(const LatticeValue &other) {
+            if(other.state == UNDEFINED || state == OVERDEFINED) return;
+            if(state == UNDEFINED) {
+                *this = other;
+            } else if(other.state == OVERDEFINED || !sameConstant(constant, other.constant)) {
+                *this = overdefined();
+            }
+        }
+    };
+
+    class ConstantPropagationSolver {
+    private:
+        IRFunction &function;
+        std::vector<LatticeValue> lattice;
+        std::vector<std::vector<std::pair<int, int>>> users; // Value -> (block, instruction)
+        std::vector<bool> executable;
+        std::set<std::pair<int, int>> executableEdges;
+        std::vector<std::pair<int, int>> edgeWorklist;
+        std::vector<int> valueWorklist;
+
+        void markEdge(int from, int to) {
+            if(executableEdges.insert({from, to}).second) edgeWorklist.emplace_back(from, to);
+        }
+
+        // Values only ever move down the lattice, so the solver terminates
+        void update(int value, LatticeValue next) {
+            LatticeValue merged = lattice[value];
+            merged.meet(next);
+            if(merged.state == lattice[value].state) return;
+            lattice[value] = merged;
+            valueWorklist.push_back(value);
+        }
+
+        void visit(int block, size_t index);
+        void rewrite(bool &changed);
+
+    public:
+        explicit ConstantPropagationSolver(IRFunction &function);
+        bool solve();
+    };
+
+    ConstantPropagationSolver::ConstantPropagationSolver(IRFunction &function) : function(function),
+            lattice(function.valueCount), users(function.valueCount), executable(function.blocks.size(), false) {
+        for(size_t block = 0; block < function.blocks.size(); block++) {
+            const std::vector<IRInstruction> &instructions = function.blocks[block].instructions;
+            for(size_t index = 0; index < instructions.size(); index++) {
+                for(int operand : instructions[index].operands) {
+                    users[operand].emplace_back(static_cast<int>(block), static_cast<int>(index));
+                }
+            }
+        }
+    }
+
+    void ConstantPropagationSolver::visit(int block, size_t index) {
+        const IRInstruction &instruction = function.blocks[block].instructions[index];
+        switch(instruction.opcode) {
+            case IROpcode::PHI: {
+                LatticeValue merged;
+                const std::vector<int> &predecessors = function.blocks[block].predecessors;
+                for(size_t i = 0; i < predecessors.size(); i++) {
+                    if(executableEdges.contains({predecessors[i], block})) merged.meet(lattice[instruction.operands[i]]);
+                }
+                update(instruction.result, merged);
+                return;
+            }
+            case IROpcode::CONST:
+                update(instruction.result, {LatticeValue::CONSTANT, instruction.constant});
+                return;
+            case IROpcode::PARAM:
+            case IROpcode::CALL:
+            case IROpcode::READ:
+            case IROpcode::PRINT:
+                update(instruction.result, LatticeValue::overdefined());
+                return;
+            case IROpcode::PRINT_STR:
+            case IROpcode::RETURN:
+                return;
+            case IROpcode::JUMP:
+                markEdge(block, instruction.targets[0]);
+                return;
+            case IROpcode::BRANCH: {
+                // A float condition is left to run, so the VM still warns about converting it
+                const LatticeValue &condition = lattice[instruction.operands[0]];
+                if(condition.state == LatticeValue::UNDEFINED) return;
+                if(condition.state == LatticeValue::CONSTANT && condition.constant.isInt()) {
+                    markEdge(block, instruction.targets[condition.constant.asInt() != 0 ? 0 : 1]);
+                } else {
+                    markEdge(block, instruction.targets[0]);
+                    markEdge(block, instruction.targets[1]);
+                }
+                return;
+            }
+            default:
+                break;
+        }
+
+        std::vector<Value> operands;
+        for(int operand : instruction.operands) {
+            const LatticeValue &value = lattice[operand];
+            if(value.state == LatticeValue::OVERDEFINED) {
+                update(instruction.result, LatticeValue::overdefined());
+                return;
+            }
+            if(value.state == LatticeValue::UNDEFINED) return;
+            operands.push_back(value.constant);
+        }
+
+        const std::optional<Value> result = evaluate(instruction.opcode, operands);
+        update(instruction.result, result ? LatticeValue{LatticeValue::CONSTANT, *result} : LatticeValue::overdefined());
+    }
+
+    bool ConstantPropagationSolver::solve() {
+        edgeWorklist.emplace_back(-1, 0);
+        while(!edgeWorklist.empty() || !valueWorklist.empty()) {
+            if(!edgeWorklist.empty()) {
+                const auto [from, to] = edgeWorklist.back();
+                edgeWorklist.pop_back();
+
+                // A block runs in full the first time it is reached; later edges only change its phis
+                const std::vector<IRInstruction> &instructions = function.blocks[to].instructions;
+                const bool firstVisit = !executable[to];
+                executable[to] = true;
+                for(size_t index = 0; index < instructions.size(); index++) {
+                    if(!firstVisit && instructions[index].opcode != IROpcode::PHI) break;
+                    visit(to, index);
+                }
+                continue;
+            }
+
+            const int value = valueWorklist.back();
+            valueWorklist.pop_back();
+            for(const auto &[block, index] : users[value]) {
+                if(executable[block]) visit(block, index);
+            }
+        }
+
+        bool changed = false;
+        rewrite(changed);
+        return changed;
+    }
+
+    void ConstantPropagationSolver::rewrite(bool &changed) {
+        for(size_t block = 0; block < function.blocks.size(); block++) {
+            if(!executable[block]) continue;
+            std::vector<IRInstruction> &instructions = function.blocks[block].instructions;
+
+            // Constant phis turn into constants, which belong after the remaining phis
+            std::vector<IRInstruction> constants;
+            for(auto instruction = instructions.begin(); instruction != instructions.end();) {
+                if(instruction->result < 0 || instruction->opcode == IROpcode::CONST ||
+                   lattice[instruction->result].state != LatticeValue::CONSTANT) {
+                    ++instruction;
+                    continue;
+                }
+
+                IRInstruction constant{IROpcode::CONST};
+                constant.result = instruction->result;
+                constant.constant = lattice[instruction->result].constant;
+                constant.line = instruction->line;
+                changed = true;
+                if(instruction->opcode == IROpcode::PHI) {
+                    constants.push_back(std::move(constant));
+                    instruction = instructions.erase(instruction);
+                } else {
+                    *instruction++ = std::move(constant);
+                }
+            }
+            const auto firstNonPhi = std::find_if(instructions.begin(), instructions.end(), [](const IRInstruction &instruction) {
+                return instruction.opcode != IROpcode::PHI;
+            });
+            instructions.insert(firstNonPhi, constants.begin(), constants.end());
+
+            IRInstruction &terminator = instructions.back();
+            if(terminator.opcode != IROpcode::BRANCH) continue;
+            const LatticeValue &condition = lattice[terminator.operands[0]];
+            if(condition.state != LatticeValue::CONSTANT || !condition.constant.isInt()) continue;
+
+            const int taken = terminator.targets[condition.constant.asInt() != 0 ? 0 : 1];
+            const int notTaken = terminator.targets[condition.constant.asInt() != 0 ? 1 : 0];
+            removePredecessor(function.blocks[notTaken], static_cast<int>(block));
+            terminator.opcode = IROpcode::JUMP;
+            terminator.operands.clear();
+            terminator.targets = {taken};
+            changed = true;
+        }
+
+        if(removeUnreachableBlocks(function)) changed = true;
+    }
+
+    // Removes every instruction defining a value marked in replaced
+    void eraseReplaced(IRFunction &function, const std::vector<int> &replacement) {
+        for(BasicBlock &block : function.blocks) {
+            std::erase_if(block.instructions, [&](const IRInstruction &instruction) {
+                return instruction.result >= 0 && replacement[instruction.result] >= 0;
+            });
+        }
+    }
+
+    // Key of an operator application; commutative operators sort their operands,
+    // and a constant is keyed by its type and bits
+    using Expression = std::tuple<IROpcode, std::vector<int>>;
+
+    bool isCommutative(IROpcode opcode) {
+        return opcode == IROpcode::ADD || opcode == IROpcode::MUL || opcode == IROpcode::EQ || opcode == IROpcode::NEQ;
+    }
+
+    bool isNumberable(IROpcode opcode) {
+        switch(opcode) {
+            case IROpcode::CONST:
+            case IROpcode::NEG:
+            case IROpcode::ADD:
+            case IROpcode::SUB:
+            case IROpcode::MUL:
+                return true;
+            default:
+                return isComparison(opcode);
+        }
+    }
+
+    class ValueNumbering {
+    private:
+        IRFunction &function;
+        std::vector<std::vector<int>> children; // Dominator tree
+        std::map<Expression, int> available;
+        std::vector<int> copyOf;
+        bool changed = false;
+
+        int resolve(int value) const {
+            while(copyOf[value] >= 0) value = copyOf[value];
+            return value;
+        }
+
+        void visit(int block);
+
+    public:
+        explicit ValueNumbering(IRFunction &function);
+        bool run() {
+            visit(0);
+            return changed;
+        }
+    };
+
+    ValueNumbering::ValueNumbering(IRFunction &function) : function(function), children(function.blocks.size()),
+                                                           copyOf(function.valueCount, -1) {
+        const std::vector<int> idom = immediateDominators(function);
+        for(size_t block = 1; block < function.blocks.size(); block++) {
+            if(idom[block] >= 0) children[idom[block]].push_back(static_cast<int>(block));
+        }
+    }
+
+    // An expression is available in every block its first occurrence dominates
+    void ValueNumbering::visit(int block) {
+        std::vector<Expression> added;
+        for(IRInstruction &instruction : function.blocks[block].instructions) {
+            if(!isNumberable(instruction.opcode)) continue;
+
+            std::vector<int> operands;
+            if(instruction.opcode == IROpcode::CONST) {
+                const Value &constant = instruction.constant;
+                operands = {static_cast<int>(constant.getType()),
+                            constant.isInt() ? constant.asInt() : std::bit_cast<int>(constant.asFloat())};
+            }
+            for(int operand : instruction.operands) operands.push_back(resolve(operand));
+            if(isCommutative(instruction.opcode)) std::sort(operands.begin(), operands.end());
+            Expression expression{instruction.opcode, std::move(operands)};
+
+            const auto existing = available.find(expression);
+            if(existing != available.end()) {
+                copyOf[instruction.result] = existing->second;
+                instruction.opcode = IROpcode::COPY;
+                instruction.operands = {existing->second};
+                changed = true;
+            } else {
+                available.emplace(expression, instruction.result);
+                added.push_back(std::move(expression));
+            }
+        }
+
+        for(int child : children[block]) visit(child);
+        for(const Expression &expression : added) available.erase(expression);
+    }
+}
+
+bool ConstantPropagation::run(IRFunction &function) const {
+    ConstantPropagationSolver solver(function);
+    return solver.solve();
+}
+
+bool CopyPropagation::run(IRFunction &function) const {
+    bool changed = false;
+    while(true) {
+        // A value whose source is itself replaced this round waits for the next,
+        // so chains are followed one link at a time and cycles never form
+        std::vector<int> replacement(function.valueCount, -1);
+        bool found = false;
+        for(const BasicBlock &block : function.blocks) {
+            for(const IRInstruction &instruction : block.instructions) {
+                int source = -1;
+                if(instruction.opcode == IROpcode::COPY) {
+                    source = instruction.operands[0];
+                } else if(instruction.opcode == IROpcode::PHI) {
+                    for(int operand : instruction.operands) {
+                        if(operand == instruction.result || operand == source) continue;
+                        if(source >= 0) {
+                            source = -1;
+                            break;
+                        }
+                        source = operand;
+                    }
+                }
+
+                if(source < 0 || replacement[source] >= 0) continue;
+                replacement[instruction.result] = source;
+                found = true;
+            }
+        }
+        if(!found) return changed;
+
+        replaceValues(function, replacement);
+        eraseReplaced(function, replacement);
+        changed = true;
+    }
+}
+
+bool CommonSubexpressionElimination::run(IRFunction &function) const {
+    ValueNumbering numbering(function);
+    return numbering.run();
+}
+
+bool DeadCodeElimination::run(IRFunction &function) const {
+    std::vector<const IRInstruction *> definition(function.valueCount, nullptr);
+    std::vector<int> worklist;
+    for(const BasicBlock &block : function.blocks) {
+        for(const IRInstruction &instruction : block.instructions) {
+            if(instruction.result >= 0) definition[instruction.result] = &instruction;
+            if(hasSideEffects(instruction.opcode)) {
+                worklist.insert(worklist.end(), instruction.operands.begin(), instruction.operands.end());
+            }
+        }
+    }
+
+    std::vector<bool> live(function.valueCount, false);
+    while(!worklist.empty()) {
+        const int value = worklist.back();
+        worklist.pop_back();
+        if(live[value]) continue;
+        live[value] = true;
+        worklist.insert(worklist.end(), definition[value]->operands.begin(), definition[value]->operands.end());
+    }
+
+    bool changed = false;
+    for(BasicBlock &block : function.blocks) {
+        changed |= std::erase_if(block.instructions, [&](const IRInstruction &instruction) {
+            return instruction.result >= 0 && !live[instruction.result] && !hasSideEffects(instruction.opcode);
+        }) > 0;
+    }
+    return changed;
+}
+
+std::unique_ptr<Pass> createPass(const std::string &name) {
+    if(name == "sccp") return std::make_unique<ConstantPropagation>();
+    if(name == "copyprop") return std::make_unique<CopyPropagation>();
+    if(name == "cse") return std::make_unique<CommonSubexpressionElimination>();
+    if(name == "dce") return std::make_unique<DeadCodeElimination>();
+    return nullptr;
+}
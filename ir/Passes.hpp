@@ -0,0 +1,49 @@
+#ifndef PASSES_HPP
+#define PASSES_HPP
+
+#include <memory>
+#include <string>
+
+#include "PassManager.hpp"
+
+// Sparse conditional constant propagation (Wegman and Zadeck): values and
+// CFG edges are only considered once something executable reaches them, so
+// constants flow through phis whose other inputs sit on dead paths. Constant
+// values become CONST, branches on constant ints become jumps, and blocks
+// that never execute are deleted. Folding follows the VM exactly, and leaves
+// alone anything that would trap, print an error or not be a finite float.
+class ConstantPropagation : public Pass {
+public:
+    [[nodiscard]] const char *name() const override { return "sccp"; }
+    bool run(IRFunction &function) const override;
+};
+
+// Forwards the source of every copy, and of every phi that only ever merges
+// one value (apart from itself), to their users and deletes them
+class CopyPropagation : public Pass {
+public:
+    [[nodiscard]] const char *name() const override { return "copyprop"; }
+    bool run(IRFunction &function) const override;
+};
+
+// Dominator-based value numbering: a constant, or an operator applied to the
+// same operands, that repeats one in a dominating position becomes a copy of
+// it. Only side-effect free operators take part, so division and calls are
+// never merged.
+class CommonSubexpressionElimination : public Pass {
+public:
+    [[nodiscard]] const char *name() const override { return "cse"; }
+    bool run(IRFunction &function) const override;
+};
+
+// Deletes every instruction whose value no side effect depends on
+class DeadCodeElimination : public Pass {
+public:
+    [[nodiscard]] const char *name() const override { return "dce"; }
+    bool run(IRFunction &function) const override;
+};
+
+// The pass called name in a pipeline, or nullptr
+std::unique_ptr<Pass> createPass(const std::string &name);
+
+#endif //PASSES_HPP
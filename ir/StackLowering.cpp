@@ -0,0 +1,445 @@
+#include "StackLowering.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+    constexpr int EDGE_COPY = -1; // Node that writes the successor's phis
+
+    Opcode stackOpcode(IROpcode opcode) {
+        switch(opcode) {
+            case IROpcode::NEG: return Opcode::NEG;
+            case IROpcode::ADD: return Opcode::ADD;
+            case IROpcode::SUB: return Opcode::SUB;
+            case IROpcode::MUL: return Opcode::MUL;
+            case IROpcode::DIV: return Opcode::DIV;
+            case IROpcode::MOD: return Opcode::MOD;
+            case IROpcode::EQ: return Opcode::EQ;
+            case IROpcode::NEQ: return Opcode::NEQ;
+            case IROpcode::LT: return Opcode::LT;
+            case IROpcode::LTE: return Opcode::LTE;
+            case IROpcode::GT: return Opcode::GT;
+            case IROpcode::GTE: return Opcode::GTE;
+            case IROpcode::PRINT: return Opcode::PRINT;
+            case IROpcode::READ: return Opcode::READ;
+            default: throw std::runtime_error("No stack opcode for " + toString(opcode));
+        }
+    }
+
+    Opcode fusedBranch(IROpcode opcode) {
+        switch(opcode) {
+            case IROpcode::EQ: return Opcode::EQ_BRZ;
+            case IROpcode::NEQ: return Opcode::NEQ_BRZ;
+            case IROpcode::LT: return Opcode::LT_BRZ;
+            case IROpcode::LTE: return Opcode::LTE_BRZ;
+            case IROpcode::GT: return Opcode::GT_BRZ;
+            default: return Opcode::GTE_BRZ;
+        }
+    }
+
+    class StackLowering {
+    private:
+        IRFunction &function;
+        StackCodeGen &gen;
+        std::vector<int> uses;
+        std::vector<int> definitionBlock;
+        std::vector<const IRInstruction *> definition;
+        std::vector<bool> inlined;
+        std::vector<int> slots;
+        std::vector<std::vector<int>> nodes; // Per block: instruction indexes in emission order
+        std::vector<std::set<int>> interference;
+        std::vector<std::string> labels;
+        int lastLine = 0;
+
+        const IRInstruction &node(int block, int index) const { return function.blocks[block].instructions[index]; }
+
+        bool isInlinable(int value, int block) const;
+        bool canMove(const std::vector<int> &order, int block, int from, int to, const IRInstruction &moved) const;
+        int stackify(std::vector<int> &order, int block, int position);
+
+        bool isSlotValue(int value) const;
+        void liveAcross(int block, std::set<int> &live, bool record);
+        int assignSlots(const std::vector<int> &layout);
+
+        void setLine(int line);
+        void emitValue(int value);
+        void emitTree(const IRInstruction &instruction);
+        void emitEdgeCopies(int block);
+        void emitTerminator(const IRInstruction &terminator, int next);
+
+    public:
+        StackLowering(IRFunction &function, StackCodeGen &gen);
+        void run();
+    };
+
+    StackLowering::StackLowering(IRFunction &function, StackCodeGen &gen) : function(function), gen(gen) {
+        splitCriticalEdges(function);
+
+        uses.assign(function.valueCount, 0);
+        definitionBlock.assign(function.valueCount, -1);
+        definition.assign(function.valueCount, nullptr);
+        inlined.assign(function.valueCount, false);
+        slots.assign(function.valueCount, -1);
+        interference.resize(function.valueCount);
+        nodes.resize(function.blocks.size());
+
+        for(size_t block = 0; block < function.blocks.size(); block++) {
+            const std::vector<IRInstruction> &instructions = function.blocks[block].instructions;
+            for(size_t index = 0; index < instructions.size(); index++) {
+                const IRInstruction &instruction = instructions[index];
+                for(int operand : instruction.operands) uses[operand]++;
+                if(instruction.result >= 0) {
+                    definitionBlock[instruction.result] = static_cast<int>(block);
+                    definition[instruction.result] = &instruction;
+                }
+
+                if(instruction.opcode == IROpcode::PHI) continue;
+                if(instruction.opcode == IROpcode::JUMP) {
+                    const std::vector<IRInstruction> &target = function.blocks[instruction.targets[0]].instructions;
+                    if(target.front().opcode == IROpcode::PHI) nodes[block].push_back(EDGE_COPY);
+                }
+                nodes[block].push_back(static_cast<int>(index));
+            }
+        }
+    }
+
+    // Constants are pushed and parameters loaded at every use instead
+    bool StackLowering::isInlinable(int value, int block) const {
+        const IROpcode opcode = definition[value]->opcode;
+        return uses[value] == 1 && definitionBlock[value] == block &&
+               opcode != IROpcode::CONST && opcode != IROpcode::PARAM && opcode != IROpcode::PHI;
+    }
+
+    // Whether moved can run later, just before order[to]: only past nodes
+    // without side effects if it has any itself, and never past the phi copies
+    bool StackLowering::canMove(const std::vector<int> &order, int block, int from, int to, const IRInstruction &moved) const {
+        for(int position = from + 1; position < to; position++) {
+            if(order[position] == EDGE_COPY) return false;
+            if(hasSideEffects(moved.opcode) && hasSideEffects(node(block, order[position]).opcode)) return false;
+        }
+        return true;
+    }
+
+    // Pulls the operands of order[position] in front of it, last operand
+    // first, so they are left on the stack in order. Returns where the
+    // resulting tree starts.
+    int StackLowering::stackify(std::vector<int> &order, int block, int position) {
+        const int user = position;
+        int start = position;
+        const std::vector<int> &operands = node(block, order[user]).operands;
+        for(auto operand = operands.rbegin(); operand != operands.rend(); ++operand) {
+            if(!isInlinable(*operand, block)) continue;
+
+            const auto found = std::find_if(order.begin(), order.begin() + start, [&](int index) {
+                return index != EDGE_COPY && node(block, index).result == *operand;
+            });
+            if(found == order.begin() + start) continue;
+            const int from = static_cast<int>(found - order.begin());
+
+            // It lands in front of the operands already pulled in, which could
+            // only pass it if one of the two is free of side effects
+            if(!canMove(order, block, from, start, *definition[*operand])) continue;
+
+            const int index = order[from];
+            order.erase(order.begin() + from);
+            start--;
+            order.insert(order.begin() + start, index);
+            inlined[*operand] = true;
+            start = stackify(order, block, start);
+        }
+        return start;
+    }
+
+    // Values that live in the frame: parameters, phis, and results used somewhere other than on the stack
+    bool StackLowering::isSlotValue(int value) const {
+        const IRInstruction *instruction = definition[value];
+        if(!instruction || inlined[value] || instruction->opcode == IROpcode::CONST) return false;
+        return instruction->opcode == IROpcode::PARAM || instruction->opcode == IROpcode::PHI || uses[value] > 0;
+    }
+
+    // Walks a block backwards in emission order from the values live at its
+    // end to those live at its top, after its phis. A value written while
+    // another is live interferes with it, so the two need different slots;
+    // nothing in the frame is written inside an expression tree, so its loads
+    // can all be taken to happen where its nodes are.
+    void StackLowering::liveAcross(int block, std::set<int> &live, bool record) {
+        auto define = [&](int value) {
+            if(record) {
+                for(int other : live) {
+                    if(other == value) continue;
+                    interference[value].insert(other);
+                    interference[other].insert(value);
+                }
+            }
+            live.erase(value);
+        };
+
+        const std::vector<int> &order = nodes[block];
+        for(auto position = order.rbegin(); position != order.rend(); ++position) {
+            if(*position != EDGE_COPY) {
+                const IRInstruction &instruction = node(block, *position);
+                if(instruction.result >= 0 && isSlotValue(instruction.result)) define(instruction.result);
+                for(int operand : instruction.operands) {
+                    if(isSlotValue(operand)) live.insert(operand);
+                }
+                continue;
+            }
+
+            // The phis are written together once all their inputs are loaded
+            const int successor = function.blocks[block].instructions.back().targets[0];
+            const BasicBlock &target = function.blocks[successor];
+            const size_t edge = std::find(target.predecessors.begin(), target.predecessors.end(), block) - target.predecessors.begin();
+            std::vector<int> phis;
+            for(const IRInstruction &instruction : target.instructions) {
+                if(instruction.opcode != IROpcode::PHI) break;
+                phis.push_back(instruction.result);
+            }
+            live.insert(phis.begin(), phis.end());
+            for(int phi : phis) define(phi);
+            for(const IRInstruction &instruction : target.instructions) {
+                if(instruction.opcode != IROpcode::PHI) break;
+                if(isSlotValue(instruction.operands[edge])) live.insert(instruction.operands[edge]);
+            }
+        }
+    }
+
+    // Gives a phi the slot of its inputs wherever their lifetimes allow, so
+    // most edge copies disappear, then packs the slots by greedy coloring.
+    // Returns the frame size.
+    int StackLowering::assignSlots(const std::vector<int> &layout) {
+        std::vector<std::set<int>> liveTop(function.blocks.size());
+        auto liveOut = [&](int block) {
+            std::set<int> live;
+            for(int successor : successors(function.blocks[block])) live.insert(liveTop[successor].begin(), liveTop[successor].end());
+            return live;
+        };
+
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(auto block = layout.rbegin(); block != layout.rend(); ++block) {
+                std::set<int> live = liveOut(*block);
+                liveAcross(*block, live, false);
+                if(live != liveTop[*block]) {
+                    liveTop[*block] = std::move(live);
+                    changed = true;
+                }
+            }
+        }
+        for(int block : layout) {
+            std::set<int> live = liveOut(block);
+            liveAcross(block, live, true);
+        }
+
+        // Coalescing works on classes of values; a class holds at most one parameter
+        std::vector<int> parent(function.valueCount);
+        std::iota(parent.begin(), parent.end(), 0);
+        std::vector<std::vector<int>> members(function.valueCount);
+        std::vector<int> param(function.valueCount, -1);
+        for(int value = 0; value < function.valueCount; value++) {
+            members[value] = {value};
+            if(definition[value] && definition[value]->opcode == IROpcode::PARAM) param[value] = definition[value]->index;
+        }
+        auto find = [&](int value) {
+            while(parent[value] != value) value = parent[value] = parent[parent[value]];
+            return value;
+        };
+        auto interferes = [&](int a, int b) {
+            for(int member : members[a]) {
+                for(int other : interference[member]) {
+                    if(find(other) == b) return true;
+                }
+            }
+            return false;
+        };
+
+        for(const BasicBlock &block : function.blocks) {
+            for(const IRInstruction &instruction : block.instructions) {
+                if(instruction.opcode != IROpcode::PHI) break;
+                for(int operand : instruction.operands) {
+                    if(!isSlotValue(operand)) continue;
+                    const int a = find(instruction.result);
+                    const int b = find(operand);
+                    if(a == b || (param[a] >= 0 && param[b] >= 0) || interferes(a, b)) continue;
+
+                    parent[b] = a;
+                    members[a].insert(members[a].end(), members[b].begin(), members[b].end());
+                    if(param[a] < 0) param[a] = param[b];
+                }
+            }
+        }
+
+        // Parameters keep their argument slots; every other class takes the lowest slot its neighbours leave free
+        std::vector<int> color(function.valueCount, -1);
+        int frameSize = function.paramCount;
+        for(int pass = 0; pass < 2; pass++) {
+            for(int value = 0; value < function.valueCount; value++) {
+                if(find(value) != value || !isSlotValue(value) || color[value] >= 0) continue;
+                if(pass == 0) {
+                    if(param[value] >= 0) color[value] = param[value];
+                    continue;
+                }
+
+                std::set<int> taken;
+                for(int member : members[value]) {
+                    for(int other : interference[member]) taken.insert(color[find(other)]);
+                }
+                int slot = 0;
+                while(taken.contains(slot)) slot++;
+                color[value] = slot;
+                frameSize = std::max(frameSize, slot + 1);
+            }
+        }
+
+        for(int value = 0; value < function.valueCount; value++) {
+            if(isSlotValue(value)) slots[value] = color[find(value)];
+        }
+        return frameSize;
+    }
+
+    void StackLowering::setLine(int line) {
+        if(line <= 0 || line == lastLine) return;
+        gen.setSourceLine(line);
+        lastLine = line;
+    }
+
+    void StackLowering::emitValue(int value) {
+        const IRInstruction &instruction = *definition[value];
+        if(instruction.opcode == IROpcode::CONST) {
+            if(instruction.constant.isInt()) {
+                gen.emit(Opcode::PUSH_INT, instruction.constant.asInt());
+            } else {
+                gen.emitFloat(Opcode::PUSH_FLOAT, instruction.constant.asFloat());
+            }
+        } else if(instruction.opcode == IROpcode::PARAM) {
+            gen.emit(Opcode::LOAD_LOCAL, instruction.index);
+        } else if(inlined[value]) {
+            emitTree(instruction);
+        } else {
+            gen.emit(Opcode::LOAD_LOCAL, slots[value]);
+        }
+    }
+
+    void StackLowering::emitTree(const IRInstruction &instruction) {
+        setLine(instruction.line);
+        for(int operand : instruction.operands) emitValue(operand);
+
+        switch(instruction.opcode) {
+            case IROpcode::COPY:
+                break;
+            case IROpcode::CALL:
+                gen.emitCall(instruction.text, static_cast<int>(instruction.operands.size()));
+                break;
+            case IROpcode::PRINT_STR:
+                gen.emitString(Opcode::PRINT_STR, instruction.text);
+                break;
+            default:
+                gen.emit(stackOpcode(instruction.opcode));
+                break;
+        }
+    }
+
+    // All inputs are loaded before any phi is written, as the phis of a block read
+    // at once; a phi sharing its input's slot needs no copy
+    void StackLowering::emitEdgeCopies(int block) {
+        const int successor = function.blocks[block].instructions.back().targets[0];
+        const BasicBlock &target = function.blocks[successor];
+        const size_t edge = std::find(target.predecessors.begin(), target.predecessors.end(), block) - target.predecessors.begin();
+
+        std::vector<int> phis;
+        for(const IRInstruction &instruction : target.instructions) {
+            if(instruction.opcode != IROpcode::PHI) break;
+            const int input = instruction.operands[edge];
+            if(isSlotValue(input) && slots[input] == slots[instruction.result]) continue;
+            emitValue(input);
+            phis.push_back(instruction.result);
+        }
+        for(auto phi = phis.rbegin(); phi != phis.rend(); ++phi) {
+            gen.emit(Opcode::STORE_LOCAL, slots[*phi]);
+            gen.emit(Opcode::POP);
+        }
+    }
+
+    void StackLowering::emitTerminator(const IRInstruction &terminator, int next) {
+        setLine(terminator.line);
+        switch(terminator.opcode) {
+            case IROpcode::JUMP:
+                if(terminator.targets[0] != next) gen.emitBranch(Opcode::JUMP, labels[terminator.targets[0]]);
+                break;
+            case IROpcode::RETURN:
+                emitValue(terminator.operands[0]);
+                gen.emit(Opcode::RETV);
+                break;
+            case IROpcode::BRANCH: {
+                const int condition = terminator.operands[0];
+                const IRInstruction &compare = *definition[condition];
+                const std::string &ifFalse = labels[terminator.targets[1]];
+                if(inlined[condition] && isComparison(compare.opcode)) {
+                    setLine(compare.line);
+                    emitValue(compare.operands[0]);
+                    emitValue(compare.operands[1]);
+                    gen.emitBranch(fusedBranch(compare.opcode), ifFalse);
+                } else {
+                    emitValue(condition);
+                    gen.emitBranch(Opcode::BRZ, ifFalse);
+                }
+                if(terminator.targets[0] != next) gen.emitBranch(Opcode::JUMP, labels[terminator.targets[0]]);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    void StackLowering::run() {
+        for(size_t block = 0; block < function.blocks.size(); block++) {
+            std::vector<int> &order = nodes[block];
+            for(int position = static_cast<int>(order.size()) - 1; position >= 0; position--) {
+                if(order[position] != EDGE_COPY) position = stackify(order, static_cast<int>(block), position);
+            }
+        }
+
+        // Blocks follow the order of the source, each branch falling through into its nonzero side
+        const std::vector<int> layout = reversePostorder(function);
+        const int frameSize = assignSlots(layout);
+        for(size_t block = 0; block < function.blocks.size(); block++) labels.push_back(gen.newLabel("bb"));
+
+        setLine(function.line);
+        gen.beginFunction(function.name, function.paramCount, frameSize);
+        for(size_t position = 0; position < layout.size(); position++) {
+            const int block = layout[position];
+            const int next = position + 1 < layout.size() ? layout[position + 1] : -1;
+            gen.placeLabel(labels[block]);
+
+            for(int index : nodes[block]) {
+                if(index == EDGE_COPY) {
+                    emitEdgeCopies(block);
+                    continue;
+                }
+
+                const IRInstruction &instruction = node(block, index);
+                if(isTerminator(instruction.opcode)) {
+                    emitTerminator(instruction, next);
+                    continue;
+                }
+                if(instruction.result >= 0 && inlined[instruction.result]) continue;
+                if(instruction.opcode == IROpcode::CONST || instruction.opcode == IROpcode::PARAM) continue;
+
+                emitTree(instruction);
+                if(instruction.result < 0) continue;
+                if(slots[instruction.result] >= 0) gen.emit(Opcode::STORE_LOCAL, slots[instruction.result]);
+                gen.emit(Opcode::POP);
+            }
+        }
+        gen.endFunction();
+    }
+}
+
+void lowerToStackCode(IRFunction &function, StackCodeGen &gen) {
+    StackLowering lowering(function, gen);
+    lowering.run();
+}
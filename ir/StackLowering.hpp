@@ -0,0 +1,15 @@
+#ifndef STACKLOWERING_HPP
+#define STACKLOWERING_HPP
+
+#include "IR.hpp"
+#include "../stackMachine/StackCodeGen.hpp"
+
+// Turns one function's SSA form back into stack code. A value used once, in
+// its own block, is computed right where it is used and stays on the stack,
+// so expressions come out as trees the way the AST emits them; every other
+// value is spilled to a frame slot of its own. Phis become copies at the end
+// of each incoming edge (critical edges are split first), and a branch on a
+// comparison becomes one fused compare-brz.
+void lowerToStackCode(IRFunction &function, StackCodeGen &gen);
+
+#endif //STACKLOWERING_HPP
@@ -1,13 +1,132 @@
 #include "AST.hpp"
+#include "../stackMachine/StackCodeGen.hpp"
+#include "../registerMachine/RegisterCodeGen.hpp"
+#include "../ir/IRBuilder.hpp"
 
+#include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <limits>
+#include <optional>
 #include <utility>
 
-std::ostream* AST::out = &std::cout;
+namespace {
+    // Strips the quotes from a string literal lexeme and expands the escapes print understands
+    std::string unquote(const std::string &lexeme) {
+        const std::string text = lexeme.size() >= 2 ? lexeme.substr(1, lexeme.size() - 2) : lexeme;
 
-void AST::setOutputStream(std::ostream *stream) {
-    out = stream;
+        std::string result;
+        for (size_t i = 0; i < text.length(); ++i) {
+            if (text[i] == '\\' && i + 1 < text.length() && (text[i + 1] == 'n' || text[i + 1] == 't')) {
+                result += text[i + 1] == 'n' ? '\n' : '\t';
+                ++i;
+            } else {
+                result += text[i];
+            }
+        }
+        return result;
+    }
+
+    // Replaces node with its folded form, which inherits the node's source line
+    void foldChild(ASTPtr &node) {
+        if (!node) return;
+        if (ASTPtr folded = node->fold()) {
+            if (folded->line == 0) folded->line = node->line;
+            node = std::move(folded);
+        }
+    }
+
+    const LiteralExprNode *numericLiteral(const ASTPtr &node) {
+        auto literal = dynamic_cast<const LiteralExprNode*>(node.get());
+        return literal && !std::holds_alternative<std::string>(literal->value) ? literal : nullptr;
+    }
+
+    bool isIntLiteral(const ASTPtr &node, int expected) {
+        auto literal = numericLiteral(node);
+        return literal && std::holds_alternative<int>(literal->value) && std::get<int>(literal->value) == expected;
+    }
 
+    // A local on the left is read straight from its register, which only happens once the right
+    // operand has run; when that may write the local, as read(x) does, copy the old value first
+    int holdLeftOperand(RegisterCodeGen &gen, int lhs, int mark, const AST &right) {
+        if (lhs >= mark || right.isPure()) return lhs;
+        const int copy = gen.allocateTemp();
+        gen.emit(RegisterOpcode::MOVE, copy, lhs);
+        return copy;
+    }
+
+    ASTPtr emptyBlock() {
+        return std::make_unique<BlockNode>(std::vector<ASTPtr>{});
+    }
+
+    float toFloat(const LiteralExprNode::Value &value) {
+        return std::holds_alternative<int>(value) ? static_cast<float>(std::get<int>(value)) : std::get<float>(value);
+    }
+
+    // What the VM computes for two constants: int/int in wrapping 32-bit
+    // arithmetic, anything else in float. Nothing when the VM would trap or
+    // print an error, or when the result is not a finite float literal.
+    std::optional<LiteralExprNode::Value> evaluate(TokenType oper, const LiteralExprNode::Value &lhs, const LiteralExprNode::Value &rhs) {
+        if (std::holds_alternative<int>(lhs) && std::holds_alternative<int>(rhs)) {
+            const int a = std::get<int>(lhs);
+            const int b = std::get<int>(rhs);
+            const auto ua = static_cast<uint32_t>(a);
+            const auto ub = static_cast<uint32_t>(b);
+            switch (oper) {
+                case TokenType::PLUS: return static_cast<int>(ua + ub);
+                case TokenType::MINUS: return static_cast<int>(ua - ub);
+                case TokenType::ASTERISK: return static_cast<int>(ua * ub);
+                case TokenType::FORWARD_SLASH:
+                case TokenType::PERCENT:
+                    if (b == 0 || (a == std::numeric_limits<int>::min() && b == -1)) return std::nullopt;
+                    return oper == TokenType::FORWARD_SLASH ? a / b : a % b;
+                case TokenType::EQUALS: return static_cast<int>(a == b);
+                case TokenType::NOT_EQUALS: return static_cast<int>(a != b);
+                case TokenType::LESS: return static_cast<int>(a < b);
+                case TokenType::GREATER: return static_cast<int>(a > b);
+                case TokenType::GREATER_EQUALS: return static_cast<int>(a >= b);
+                case TokenType::LESS_EQUALS: return static_cast<int>(a <= b);
+                default: return std::nullopt;
+            }
+        }
+
+        const float a = toFloat(lhs);
+        const float b = toFloat(rhs);
+        float result;
+        switch (oper) {
+            case TokenType::PLUS: result = a + b; break;
+            case TokenType::MINUS: result = a - b; break;
+            case TokenType::ASTERISK: result = a * b; break;
+            case TokenType::FORWARD_SLASH: result = a / b; break;
+            case TokenType::EQUALS: return static_cast<int>(a == b);
+            case TokenType::NOT_EQUALS: return static_cast<int>(a != b);
+            case TokenType::LESS: return static_cast<int>(a < b);
+            case TokenType::GREATER: return static_cast<int>(a > b);
+            case TokenType::GREATER_EQUALS: return static_cast<int>(a >= b);
+            case TokenType::LESS_EQUALS: return static_cast<int>(a <= b);
+            default: return std::nullopt; // % of a float is an error at run time
+        }
+        if (!std::isfinite(result)) return std::nullopt;
+        return result;
+    }
+}
+
+void foldConstants(std::vector<ASTPtr> &program) {
+    for (auto& node : program) {
+        foldChild(node);
+    }
+}
+
+void AST::emitBranchIfFalse(StackCodeGen &gen, const std::string &label) const {
+    emitStackCode(gen);
+    gen.emitBranch(Opcode::BRZ, label);
+}
+
+void AST::emitRegisterBranchIfFalse(RegisterCodeGen &gen, int label) const {
+    const int mark = gen.tempMark();
+    const int condition = emitRegisterCode(gen, -1);
+    gen.releaseTemps(mark);
+    gen.emitBranch(RegisterOpcode::BRZ, condition, 0, label);
 }
 
 BinExprNode::BinExprNode(TokenType op, ASTPtr l, ASTPtr r) : oper(op), left(std::move(l)), right(std::move(r)) {}
@@ -20,26 +139,165 @@ void BinExprNode::emit() const {
     std::cout << ")";
 }
 
-void BinExprNode::emitStackCode() const {
-    left->emitStackCode();
-    right->emitStackCode();
+void BinExprNode::emitStackCode(StackCodeGen &gen) const {
+    left->emitStackCode(gen);
+    right->emitStackCode(gen);
+
+    switch(oper) {
+        case TokenType::PLUS: gen.emit(Opcode::ADD); break;
+        case TokenType::MINUS: gen.emit(Opcode::SUB); break;
+        case TokenType::ASTERISK: gen.emit(Opcode::MUL); break;
+        case TokenType::FORWARD_SLASH: gen.emit(Opcode::DIV); break;
+        case TokenType::PERCENT: gen.emit(Opcode::MOD); break;
+        case TokenType::EQUALS: gen.emit(Opcode::EQ); break;
+        case TokenType::NOT_EQUALS: gen.emit(Opcode::NEQ); break;
+        case TokenType::LESS: gen.emit(Opcode::LT); break;
+        case TokenType::GREATER: gen.emit(Opcode::GT); break;
+        case TokenType::GREATER_EQUALS: gen.emit(Opcode::GTE); break;
+        case TokenType::LESS_EQUALS: gen.emit(Opcode::LTE); break;
+        default: throw std::runtime_error("Unknown Operator: " + toString(oper));
+    }
+}
+
+int BinExprNode::emitRegisterCode(RegisterCodeGen &gen, int target) const {
+    const int mark = gen.tempMark();
+    const int lhs = holdLeftOperand(gen, left->emitRegisterCode(gen, -1), mark, *right);
+    const int rhs = right->emitRegisterCode(gen, -1);
+    gen.releaseTemps(mark);
+
+    RegisterOpcode opcode;
+    switch(oper) {
+        case TokenType::PLUS: opcode = RegisterOpcode::ADD; break;
+        case TokenType::MINUS: opcode = RegisterOpcode::SUB; break;
+        case TokenType::ASTERISK: opcode = RegisterOpcode::MUL; break;
+        case TokenType::FORWARD_SLASH: opcode = RegisterOpcode::DIV; break;
+        case TokenType::PERCENT: opcode = RegisterOpcode::MOD; break;
+        case TokenType::EQUALS: opcode = RegisterOpcode::EQ; break;
+        case TokenType::NOT_EQUALS: opcode = RegisterOpcode::NEQ; break;
+        case TokenType::LESS: opcode = RegisterOpcode::LT; break;
+        case TokenType::GREATER: opcode = RegisterOpcode::GT; break;
+        case TokenType::GREATER_EQUALS: opcode = RegisterOpcode::GTE; break;
+        case TokenType::LESS_EQUALS: opcode = RegisterOpcode::LTE; break;
+        default: throw std::runtime_error("Unknown Operator: " + toString(oper));
+    }
+
+    // Operands are read before the result is written, so the result may reuse their temporaries
+    const int result = target >= 0 ? target : gen.allocateTemp();
+    gen.emit(opcode, result, lhs, rhs);
+    return result;
+}
+
+int BinExprNode::emitIR(IRBuilder &builder) const {
+    const int lhs = left->emitIR(builder);
+    const int rhs = right->emitIR(builder);
 
     switch(oper) {
-        case TokenType::PLUS: *out << "add\n"; break;
-        case TokenType::MINUS: *out << "sub\n"; break;
-        case TokenType::ASTERISK: *out << "mul\n"; break;
-        case TokenType::FORWARD_SLASH: *out << "div\n"; break;
-        case TokenType::PERCENT: *out << "mod\n"; break;
-        case TokenType::EQUALS: *out << "eq\n"; break;
-        case TokenType::NOT_EQUALS: *out << "neq\n"; break;
-        case TokenType::LESS: *out << "lt\n"; break;
-        case TokenType::GREATER: *out << "gt\n"; break;
-        case TokenType::GREATER_EQUALS: *out << "gte\n"; break;
-        case TokenType::LESS_EQUALS: *out << "lte\n"; break;
+        case TokenType::PLUS: return builder.emit(IROpcode::ADD, {lhs, rhs});
+        case TokenType::MINUS: return builder.emit(IROpcode::SUB, {lhs, rhs});
+        case TokenType::ASTERISK: return builder.emit(IROpcode::MUL, {lhs, rhs});
+        case TokenType::FORWARD_SLASH: return builder.emit(IROpcode::DIV, {lhs, rhs});
+        case TokenType::PERCENT: return builder.emit(IROpcode::MOD, {lhs, rhs});
+        case TokenType::EQUALS: return builder.emit(IROpcode::EQ, {lhs, rhs});
+        case TokenType::NOT_EQUALS: return builder.emit(IROpcode::NEQ, {lhs, rhs});
+        case TokenType::LESS: return builder.emit(IROpcode::LT, {lhs, rhs});
+        case TokenType::GREATER: return builder.emit(IROpcode::GT, {lhs, rhs});
+        case TokenType::GREATER_EQUALS: return builder.emit(IROpcode::GTE, {lhs, rhs});
+        case TokenType::LESS_EQUALS: return builder.emit(IROpcode::LTE, {lhs, rhs});
         default: throw std::runtime_error("Unknown Operator: " + toString(oper));
     }
 }
 
+void BinExprNode::emitRegisterBranchIfFalse(RegisterCodeGen &gen, int label) const {
+    RegisterOpcode fused;
+    switch(oper) {
+        case TokenType::EQUALS: fused = RegisterOpcode::EQ_BRZ; break;
+        case TokenType::NOT_EQUALS: fused = RegisterOpcode::NEQ_BRZ; break;
+        case TokenType::LESS: fused = RegisterOpcode::LT_BRZ; break;
+        case TokenType::GREATER: fused = RegisterOpcode::GT_BRZ; break;
+        case TokenType::GREATER_EQUALS: fused = RegisterOpcode::GTE_BRZ; break;
+        case TokenType::LESS_EQUALS: fused = RegisterOpcode::LTE_BRZ; break;
+        default: AST::emitRegisterBranchIfFalse(gen, label); return;
+    }
+
+    const int mark = gen.tempMark();
+    const int lhs = holdLeftOperand(gen, left->emitRegisterCode(gen, -1), mark, *right);
+    const int rhs = right->emitRegisterCode(gen, -1);
+    gen.releaseTemps(mark);
+    gen.emitBranch(fused, lhs, rhs, label);
+}
+
+void BinExprNode::emitBranchIfFalse(StackCodeGen &gen, const std::string &label) const {
+    Opcode fused;
+    switch(oper) {
+        case TokenType::EQUALS: fused = Opcode::EQ_BRZ; break;
+        case TokenType::NOT_EQUALS: fused = Opcode::NEQ_BRZ; break;
+        case TokenType::LESS: fused = Opcode::LT_BRZ; break;
+        case TokenType::GREATER: fused = Opcode::GT_BRZ; break;
+        case TokenType::GREATER_EQUALS: fused = Opcode::GTE_BRZ; break;
+        case TokenType::LESS_EQUALS: fused = Opcode::LTE_BRZ; break;
+        default: AST::emitBranchIfFalse(gen, label); return;
+    }
+
+    left->emitStackCode(gen);
+    right->emitStackCode(gen);
+    gen.emitBranch(fused, label);
+}
+
+ASTPtr BinExprNode::fold() {
+    foldChild(left);
+    foldChild(right);
+
+    const LiteralExprNode *lhs = numericLiteral(left);
+    const LiteralExprNode *rhs = numericLiteral(right);
+    if (lhs && rhs) {
+        if (auto value = evaluate(oper, lhs->value, rhs->value)) {
+            return std::visit([](auto folded) -> ASTPtr { return std::make_unique<LiteralExprNode>(folded); }, *value);
+        }
+        return nullptr;
+    }
+
+    // x * 1, x / 1 and x - 0 hold for floats too: 1 and 0 convert exactly, and -0.0 - 0 stays -0.0.
+    // x + 0 does not (-0.0 + 0 is 0.0), and x * 0 can be -0.0 or NaN, so those need ints.
+    switch (oper) {
+        case TokenType::ASTERISK:
+            if (isIntLiteral(right, 1)) return std::move(left);
+            if (isIntLiteral(left, 1)) return std::move(right);
+            if (isIntLiteral(right, 0) && left->isPure() && left->isAlwaysInt()) return std::move(right);
+            if (isIntLiteral(left, 0) && right->isPure() && right->isAlwaysInt()) return std::move(left);
+            break;
+        case TokenType::FORWARD_SLASH:
+            if (isIntLiteral(right, 1)) return std::move(left);
+            break;
+        case TokenType::PLUS:
+            if (isIntLiteral(right, 0) && left->isAlwaysInt()) return std::move(left);
+            if (isIntLiteral(left, 0) && right->isAlwaysInt()) return std::move(right);
+            break;
+        case TokenType::MINUS:
+            if (isIntLiteral(right, 0)) return std::move(left);
+            break;
+        default:
+            break;
+    }
+    return nullptr;
+}
+
+// Division and modulus can trap or print an error, so they are never skipped
+bool BinExprNode::isPure() const {
+    return oper != TokenType::FORWARD_SLASH && oper != TokenType::PERCENT && left->isPure() && right->isPure();
+}
+
+bool BinExprNode::isAlwaysInt() const {
+    switch(oper) {
+        case TokenType::PLUS:
+        case TokenType::MINUS:
+        case TokenType::ASTERISK:
+        case TokenType::FORWARD_SLASH:
+            return left->isAlwaysInt() && right->isAlwaysInt();
+        default:
+            return true; // Comparisons give 0 or 1, and % gives an int even when it fails
+    }
+}
+
 LiteralExprNode::LiteralExprNode(int val) : value(val) {}
 
 LiteralExprNode::LiteralExprNode(float val) : value(val) {}
@@ -56,12 +314,45 @@ void LiteralExprNode::emit() const {
     }
 }
 
-void LiteralExprNode::emitStackCode() const {
+void LiteralExprNode::emitStackCode(StackCodeGen &gen) const {
     if (std::holds_alternative<int>(value)) {
-        *out << "push " << std::get<int>(value) << "\n";
+        gen.emit(Opcode::PUSH_INT, std::get<int>(value));
     } else if(std::holds_alternative<float>(value)) {
-        *out << "push " << std::get<float>(value) << "\n";
+        gen.emitFloat(Opcode::PUSH_FLOAT, std::get<float>(value));
+    }
+}
+
+int LiteralExprNode::emitRegisterCode(RegisterCodeGen &gen, int target) const {
+    const int result = target >= 0 ? target : gen.allocateTemp();
+    if (std::holds_alternative<int>(value)) {
+        gen.emit(RegisterOpcode::LOAD_INT, result, 0, 0, std::get<int>(value));
+    } else if(std::holds_alternative<float>(value)) {
+        gen.emitFloat(RegisterOpcode::LOAD_FLOAT, result, std::get<float>(value));
+    }
+    return result;
+}
+
+int LiteralExprNode::emitIR(IRBuilder &builder) const {
+    if (std::holds_alternative<int>(value)) return builder.emitConstant(::Value(std::get<int>(value)));
+    if (std::holds_alternative<float>(value)) return builder.emitConstant(::Value(std::get<float>(value)));
+    throw std::runtime_error("String literal used as a value");
+}
+
+// A constant condition that survived folding, e.g. while (1), tests nothing at run time
+void LiteralExprNode::emitBranchIfFalse(StackCodeGen &gen, const std::string &label) const {
+    if (!std::holds_alternative<int>(value)) {
+        AST::emitBranchIfFalse(gen, label);
+        return;
+    }
+    if (std::get<int>(value) == 0) gen.emitBranch(Opcode::JUMP, label);
+}
+
+void LiteralExprNode::emitRegisterBranchIfFalse(RegisterCodeGen &gen, int label) const {
+    if (!std::holds_alternative<int>(value)) {
+        AST::emitRegisterBranchIfFalse(gen, label);
+        return;
     }
+    if (std::get<int>(value) == 0) gen.emitBranch(RegisterOpcode::JUMP, 0, 0, label);
 }
 
 ExprStmtNode::ExprStmtNode(ASTPtr expr) : expr(std::move(expr)) {};
@@ -70,8 +361,28 @@ void ExprStmtNode::emit() const {
     expr->emit();
 }
 
-void ExprStmtNode::emitStackCode() const {
-    expr->emitStackCode();
+// Statements leave the operand stack as they found it
+void ExprStmtNode::emitStackCode(StackCodeGen &gen) const {
+    expr->emitStackCode(gen);
+    if (expr->leavesValue()) gen.emit(Opcode::POP);
+}
+
+int ExprStmtNode::emitRegisterCode(RegisterCodeGen &gen, int) const {
+    const int mark = gen.tempMark();
+    expr->emitRegisterCode(gen, -1);
+    gen.releaseTemps(mark);
+    return -1;
+}
+
+int ExprStmtNode::emitIR(IRBuilder &builder) const {
+    expr->emitIR(builder);
+    return -1;
+}
+
+// A pure expression statement computes a value only to drop it
+ASTPtr ExprStmtNode::fold() {
+    foldChild(expr);
+    return expr->isPure() ? emptyBlock() : nullptr;
 }
 
 BlockNode::BlockNode(std::vector<ASTPtr> stmts) : stmts(std::move(stmts)) {}
@@ -86,10 +397,34 @@ void BlockNode::emit() const {
 
 }
 
-void BlockNode::emitStackCode() const {
+void BlockNode::emitStackCode(StackCodeGen &gen) const {
+    for (const auto& stmt : stmts) {
+        // Debug info for the VM: the following instructions belong to this source line
+        if (stmt->line > 0) gen.setSourceLine(stmt->line);
+        stmt->emitStackCode(gen);
+    }
+}
+
+int BlockNode::emitRegisterCode(RegisterCodeGen &gen, int) const {
     for (const auto& stmt : stmts) {
-        stmt->emitStackCode();
+        stmt->emitRegisterCode(gen, -1);
     }
+    return -1;
+}
+
+int BlockNode::emitIR(IRBuilder &builder) const {
+    for (const auto& stmt : stmts) {
+        if (stmt->line > 0) builder.setSourceLine(stmt->line);
+        stmt->emitIR(builder);
+    }
+    return -1;
+}
+
+ASTPtr BlockNode::fold() {
+    for (auto& stmt : stmts) {
+        foldChild(stmt);
+    }
+    return nullptr;
 }
 
 IfNode::IfNode(ASTPtr cond, ASTPtr thenBranch, ASTPtr elseBranch) : cond(std::move(cond)), thenBranch(std::move(thenBranch)), elseBranch(std::move(elseBranch)) {}
@@ -105,26 +440,75 @@ void IfNode::emit() const {
     }
 }
 
-void IfNode::emitStackCode() const {
-    static int ifCounter = 0;
-    int ifId = ifCounter++;
+void IfNode::emitStackCode(StackCodeGen &gen) const {
+    const std::string elseLabel = gen.newLabel("else");
+    const std::string endLabel = gen.newLabel("endif");
+
+    cond->emitBranchIfFalse(gen, elseLabel);
+    thenBranch->emitStackCode(gen);
 
-    std::string elseLabel = "else_" + std::to_string(ifId) + ":";
-    std::string endLabel = "endif_" + std::to_string(ifId) + ":";
+    if(elseBranch) {
+        gen.emitBranch(Opcode::JUMP, endLabel);
+        gen.placeLabel(elseLabel);
+        elseBranch->emitStackCode(gen);
+        gen.emitBranch(Opcode::JUMP, endLabel);
+        gen.placeLabel(endLabel);
+    } else {
+        gen.placeLabel(elseLabel);
+    }
+}
 
-    cond->emitStackCode();
-    *out << "brz " << elseLabel << "\n";
-    thenBranch->emitStackCode();
+int IfNode::emitRegisterCode(RegisterCodeGen &gen, int) const {
+    const int elseLabel = gen.newLabel();
+    cond->emitRegisterBranchIfFalse(gen, elseLabel);
+    thenBranch->emitRegisterCode(gen, -1);
 
     if(elseBranch) {
-        *out << "jump " << endLabel << "\n";
-        *out << elseLabel << "\n";
-        elseBranch->emitStackCode();
-        *out << "jump " << endLabel << "\n";
-        *out << endLabel << "\n";
+        const int endLabel = gen.newLabel();
+        gen.emitBranch(RegisterOpcode::JUMP, 0, 0, endLabel);
+        gen.placeLabel(elseLabel);
+        elseBranch->emitRegisterCode(gen, -1);
+        gen.placeLabel(endLabel);
     } else {
-        *out << elseLabel << "\n";
+        gen.placeLabel(elseLabel);
+    }
+    return -1;
+}
+
+int IfNode::emitIR(IRBuilder &builder) const {
+    const int condition = cond->emitIR(builder);
+    const int thenBlock = builder.newBlock();
+    const int elseBlock = elseBranch ? builder.newBlock() : -1;
+    const int endBlock = builder.newBlock();
+
+    builder.emitBranch(condition, thenBlock, elseBranch ? elseBlock : endBlock);
+    builder.sealBlock(thenBlock);
+    builder.setBlock(thenBlock);
+    thenBranch->emitIR(builder);
+    builder.emitJump(endBlock);
+
+    if(elseBranch) {
+        builder.sealBlock(elseBlock);
+        builder.setBlock(elseBlock);
+        elseBranch->emitIR(builder);
+        builder.emitJump(endBlock);
     }
+
+    builder.sealBlock(endBlock);
+    builder.setBlock(endBlock);
+    return -1;
+}
+
+// Float conditions are left alone so the VM still warns about converting them
+ASTPtr IfNode::fold() {
+    foldChild(cond);
+    foldChild(thenBranch);
+    foldChild(elseBranch);
+
+    const LiteralExprNode *literal = numericLiteral(cond);
+    if (!literal || !std::holds_alternative<int>(literal->value)) return nullptr;
+    if (std::get<int>(literal->value) != 0) return std::move(thenBranch);
+    return elseBranch ? std::move(elseBranch) : emptyBlock();
 }
 
 WhileNode::WhileNode(ASTPtr cond, ASTPtr body) : cond(std::move(cond)), body(std::move(body)) {}
@@ -136,20 +520,54 @@ void WhileNode::emit() const {
     body->emit();
 }
 
-void WhileNode::emitStackCode() const {
-    static int whileCounter = 0;
-    int whileId = whileCounter++;
+void WhileNode::emitStackCode(StackCodeGen &gen) const {
+    const std::string startLabel = gen.newLabel("while_start");
+    const std::string endLabel = gen.newLabel("while_end");
+
+    gen.emitBranch(Opcode::JUMP, startLabel);
+    gen.placeLabel(startLabel);
+    cond->emitBranchIfFalse(gen, endLabel);
+    body->emitStackCode(gen);
+    gen.emitBranch(Opcode::JUMP, startLabel);
+    gen.placeLabel(endLabel);
+}
+
+int WhileNode::emitRegisterCode(RegisterCodeGen &gen, int) const {
+    const int startLabel = gen.newLabel();
+    const int endLabel = gen.newLabel();
 
-    std::string startLabel = "while_start_" + std::to_string(whileId) + ":";
-    std::string endLabel = "while_end_" + std::to_string(whileId) + ":";
+    gen.placeLabel(startLabel);
+    cond->emitRegisterBranchIfFalse(gen, endLabel);
+    body->emitRegisterCode(gen, -1);
+    gen.emitBranch(RegisterOpcode::JUMP, 0, 0, startLabel);
+    gen.placeLabel(endLabel);
+    return -1;
+}
 
-    *out << "jump " << startLabel << "\n";
-    *out << startLabel << "\n";
-    cond->emitStackCode();
-    *out << "brz " << endLabel << "\n";
-    body->emitStackCode();
-    *out << "jump " << startLabel << "\n";
-    *out << endLabel << "\n";
+int WhileNode::emitIR(IRBuilder &builder) const {
+    const int startBlock = builder.newBlock();
+    const int bodyBlock = builder.newBlock();
+    const int endBlock = builder.newBlock();
+
+    builder.emitJump(startBlock);
+    builder.setBlock(startBlock);
+    builder.emitBranch(cond->emitIR(builder), bodyBlock, endBlock);
+    builder.sealBlock(bodyBlock);
+    builder.setBlock(bodyBlock);
+    body->emitIR(builder);
+    builder.emitJump(startBlock);
+
+    // The back edge is known now
+    builder.sealBlock(startBlock);
+    builder.sealBlock(endBlock);
+    builder.setBlock(endBlock);
+    return -1;
+}
+
+ASTPtr WhileNode::fold() {
+    foldChild(cond);
+    foldChild(body);
+    return isIntLiteral(cond, 0) ? emptyBlock() : nullptr;
 }
 
 VarDeclNode::VarDeclNode(std::string varName, ASTPtr initializer, int offset) : name(std::move(varName)), initializer(std::move(initializer)), offset(offset) {}
@@ -159,11 +577,27 @@ void VarDeclNode::emit() const {
     initializer->emit();
 }
 
-void VarDeclNode::emitStackCode() const {
-    initializer->emitStackCode();
-    *out << "push " << offset << "\n";
-    *out << "store bp" << "\n";
+void VarDeclNode::emitStackCode(StackCodeGen &gen) const {
+    initializer->emitStackCode(gen);
+    gen.emit(Opcode::STORE_LOCAL, offset);
+    gen.emit(Opcode::POP);
+}
+
+int VarDeclNode::emitRegisterCode(RegisterCodeGen &gen, int) const {
+    const int mark = gen.tempMark();
+    initializer->emitRegisterCode(gen, offset);
+    gen.releaseTemps(mark);
+    return -1;
+}
 
+int VarDeclNode::emitIR(IRBuilder &builder) const {
+    builder.writeVariable(offset, initializer->emitIR(builder));
+    return -1;
+}
+
+ASTPtr VarDeclNode::fold() {
+    foldChild(initializer);
+    return nullptr;
 }
 
 VarExprNode::VarExprNode(std::string varName, int offset) : offset(offset), name(std::move(varName)) {}
@@ -172,9 +606,21 @@ void VarExprNode::emit() const {
     std::cout << "Var " << name << "\n";
 }
 
-void VarExprNode::emitStackCode() const {
-    *out << "push " << offset << "\n";
-    *out << "load bp\n";
+void VarExprNode::emitStackCode(StackCodeGen &gen) const {
+    gen.emit(Opcode::LOAD_LOCAL, offset);
+}
+
+int VarExprNode::emitRegisterCode(RegisterCodeGen &gen, int target) const {
+    // Locals live in registers, so reading one is free unless it must be copied
+    if(target >= 0 && target != offset) {
+        gen.emit(RegisterOpcode::MOVE, target, offset);
+        return target;
+    }
+    return offset;
+}
+
+int VarExprNode::emitIR(IRBuilder &builder) const {
+    return builder.readVariable(offset);
 }
 
 AssignNode::AssignNode(int offset, ASTPtr expr) : offset(offset), expr(std::move(expr)) {}
@@ -184,10 +630,27 @@ void AssignNode::emit() const {
     expr->emit();
 }
 
-void AssignNode::emitStackCode() const {
-    expr->emitStackCode();           // evaluate RHS and leave result on stack
-    *out << "push " << offset << "\n";  // push the variable offset
-    *out << "store bp\n";        // store the result into bp + offset
+void AssignNode::emitStackCode(StackCodeGen &gen) const {
+    expr->emitStackCode(gen);                  // evaluate RHS and leave result on stack
+    gen.emit(Opcode::STORE_LOCAL, offset); // store the result into bp + offset
+    gen.emit(Opcode::POP);
+}
+
+int AssignNode::emitRegisterCode(RegisterCodeGen &gen, int) const {
+    const int mark = gen.tempMark();
+    expr->emitRegisterCode(gen, offset);
+    gen.releaseTemps(mark);
+    return -1;
+}
+
+int AssignNode::emitIR(IRBuilder &builder) const {
+    builder.writeVariable(offset, expr->emitIR(builder));
+    return -1;
+}
+
+ASTPtr AssignNode::fold() {
+    foldChild(expr);
+    return nullptr;
 }
 
 ReturnNode::ReturnNode(ASTPtr expr) : expr(std::move(expr)) {}
@@ -201,25 +664,69 @@ void ReturnNode::emit() const {
     }
 }
 
-void ReturnNode::emitStackCode() const {
+// Every call yields a value, so a bare return gives back 0
+void ReturnNode::emitStackCode(StackCodeGen &gen) const {
     if(expr) {
-        expr->emitStackCode();
-        *out << "retv\n";
+        expr->emitStackCode(gen);
     } else {
-        *out << "ret\n";
+        gen.emit(Opcode::PUSH_INT, 0);
     }
+    gen.emit(Opcode::RETV);
+}
+
+int ReturnNode::emitRegisterCode(RegisterCodeGen &gen, int) const {
+    if(expr) {
+        const int mark = gen.tempMark();
+        const int result = expr->emitRegisterCode(gen, -1);
+        gen.releaseTemps(mark);
+        gen.emit(RegisterOpcode::RETV, result);
+    } else {
+        gen.emit(RegisterOpcode::RET);
+    }
+    return -1;
+}
+
+int ReturnNode::emitIR(IRBuilder &builder) const {
+    builder.emitReturn(expr ? expr->emitIR(builder) : builder.emitConstant(Value(0)));
+    return -1;
+}
+
+ASTPtr ReturnNode::fold() {
+    foldChild(expr);
+    return nullptr;
 }
 
-FunctionNode::FunctionNode(std::string returnType, std::string name, std::vector<std::string> parameters, ASTPtr body) : returnType(std::move(returnType)), name(std::move(name)), params(std::move(parameters)), body(std::move(body)) {}
+FunctionNode::FunctionNode(std::string returnType, std::string name, std::vector<std::string> parameters, int localCount, ASTPtr body) : returnType(std::move(returnType)), name(std::move(name)), params(std::move(parameters)), localCount(localCount), body(std::move(body)) {}
 
 void FunctionNode::emit() const {
     std::cout << "Function: " << name << "\n";
     body->emit();
 }
 
-void FunctionNode::emitStackCode() const {
-    *AST::out << "_" << name << ":\n";
-    body->emitStackCode();
+void FunctionNode::emitStackCode(StackCodeGen &gen) const {
+    if (line > 0) gen.setSourceLine(line);
+    gen.beginFunction(name, static_cast<int>(params.size()), localCount);
+    body->emitStackCode(gen);
+    gen.endFunction();
+}
+
+int FunctionNode::emitRegisterCode(RegisterCodeGen &gen, int) const {
+    gen.beginFunction(name, static_cast<int>(params.size()), localCount);
+    body->emitRegisterCode(gen, -1);
+    gen.endFunction();
+    return -1;
+}
+
+int FunctionNode::emitIR(IRBuilder &builder) const {
+    builder.beginFunction(name, static_cast<int>(params.size()), line);
+    body->emitIR(builder);
+    builder.endFunction();
+    return -1;
+}
+
+ASTPtr FunctionNode::fold() {
+    foldChild(body);
+    return nullptr;
 }
 
 FunctionCallNode::FunctionCallNode(std::string name, std::vector<ASTPtr> arguments) : name(name), args(std::move(arguments)) {}
@@ -228,12 +735,42 @@ void FunctionCallNode::emit() const {
     std::cout << "Function Call: " << name << " with " << args.size() << " args\n";
 }
 
-void FunctionCallNode::emitStackCode() const {
+void FunctionCallNode::emitStackCode(StackCodeGen &gen) const {
+    for (const auto& arg : args) {
+        arg->emitStackCode(gen);
+    }
+    gen.emitCall(name, static_cast<int>(args.size()));
+}
+
+int FunctionCallNode::emitRegisterCode(RegisterCodeGen &gen, int target) const {
+    // Arguments go into consecutive temporaries that become the callee's first registers
+    const int mark = gen.tempMark();
+    for (const auto& arg : args) {
+        const int slot = gen.allocateTemp();
+        const int argMark = gen.tempMark();
+        arg->emitRegisterCode(gen, slot);
+        gen.releaseTemps(argMark);
+    }
+    gen.releaseTemps(mark);
+
+    const int result = target >= 0 ? target : gen.allocateTemp();
+    gen.emitCall(result, mark, static_cast<int>(args.size()), name);
+    return result;
+}
+
+int FunctionCallNode::emitIR(IRBuilder &builder) const {
+    std::vector<int> arguments;
     for (const auto& arg : args) {
-        arg->emitStackCode();
+        arguments.push_back(arg->emitIR(builder));
     }
-    *AST::out << "push " << args.size() << "\n";
-    *AST::out << "call " << "_" << name << ":\n";
+    return builder.emitCall(name, std::move(arguments));
+}
+
+ASTPtr FunctionCallNode::fold() {
+    for (auto& arg : args) {
+        foldChild(arg);
+    }
+    return nullptr;
 }
 
 PrintStmtNode::PrintStmtNode(ASTPtr expr) : expr(std::move(expr)) {}
@@ -244,21 +781,55 @@ void PrintStmtNode::emit() const {
     std::cout << std::endl;
 }
 
-void PrintStmtNode::emitStackCode() const {
+// print leaves a printed value on the stack; a string comes from the pool instead
+bool PrintStmtNode::leavesValue() const {
+    auto lit = dynamic_cast<LiteralExprNode*>(expr.get());
+    return !lit || !std::holds_alternative<std::string>(lit->value);
+}
+
+void PrintStmtNode::emitStackCode(StackCodeGen &gen) const {
     if (auto lit = dynamic_cast<LiteralExprNode*>(expr.get())) {
         std::visit([&](auto&& val) {
             using T = std::decay_t<decltype(val)>;
             if constexpr (std::is_same_v<T, std::string>) {
-                *out << "print " << val << "\n";
+                // The assembler decodes the escapes, as it would for print "..." in .vsm text
+                gen.emitString(Opcode::PRINT_STR, val.size() >= 2 ? val.substr(1, val.size() - 2) : val);
             } else {
-                expr->emitStackCode();
-                *out << "print\n";
+                expr->emitStackCode(gen);
+                gen.emit(Opcode::PRINT);
             }
         }, lit->value);
     } else {
-        expr->emitStackCode();
-        *out << "print\n";
+        expr->emitStackCode(gen);
+        gen.emit(Opcode::PRINT);
+    }
+}
+
+int PrintStmtNode::emitRegisterCode(RegisterCodeGen &gen, int target) const {
+    if (auto lit = dynamic_cast<LiteralExprNode*>(expr.get()); lit && std::holds_alternative<std::string>(lit->value)) {
+        gen.emitString(RegisterOpcode::PRINT_STR, unquote(std::get<std::string>(lit->value)));
+        return -1;
+    }
+
+    // Like the stack code, print evaluates to the value it printed; a temporary holding it stays reserved
+    const int mark = gen.tempMark();
+    const int value = expr->emitRegisterCode(gen, target);
+    gen.emit(RegisterOpcode::PRINT, value);
+    gen.releaseTemps(value >= mark ? value + 1 : mark);
+    return value;
+}
+
+int PrintStmtNode::emitIR(IRBuilder &builder) const {
+    if (auto lit = dynamic_cast<LiteralExprNode*>(expr.get()); lit && std::holds_alternative<std::string>(lit->value)) {
+        builder.emitPrintString(unquote(std::get<std::string>(lit->value)));
+        return -1;
     }
+    return builder.emit(IROpcode::PRINT, {expr->emitIR(builder)});
+}
+
+ASTPtr PrintStmtNode::fold() {
+    foldChild(expr);
+    return nullptr;
 }
 
 ReadStmtNode::ReadStmtNode(ASTPtr var, int offset) : var(std::move(var)), varOffset(offset) {};
@@ -267,10 +838,25 @@ void ReadStmtNode::emit() const {
     std::cout << "read into " << varOffset << std::endl;
 }
 
-void ReadStmtNode::emitStackCode() const {
-    *out << "read\n";
-    *out << "push " << varOffset << "\n";
-    *out << "store bp\n";
+void ReadStmtNode::emitStackCode(StackCodeGen &gen) const {
+    gen.emit(Opcode::READ);
+    gen.emit(Opcode::STORE_LOCAL, varOffset);
+}
+
+int ReadStmtNode::emitRegisterCode(RegisterCodeGen &gen, int target) const {
+    gen.emit(RegisterOpcode::READ, varOffset);
+    if (target >= 0 && target != varOffset) {
+        gen.emit(RegisterOpcode::MOVE, target, varOffset);
+        return target;
+    }
+    return varOffset;
+}
+
+// read() stores into its variable and, like the stack code, also evaluates to the value read
+int ReadStmtNode::emitIR(IRBuilder &builder) const {
+    const int value = builder.emit(IROpcode::READ);
+    builder.writeVariable(varOffset, value);
+    return value;
 }
 
 UnaryMinusNode::UnaryMinusNode(ASTPtr expr) : expr(std::move(expr)) {}
@@ -281,7 +867,36 @@ void UnaryMinusNode::emit() const {
     std::cout << ")";
 }
 
-void UnaryMinusNode::emitStackCode() const {
-    expr->emitStackCode();
-    *out << "neg\n";
+void UnaryMinusNode::emitStackCode(StackCodeGen &gen) const {
+    expr->emitStackCode(gen);
+    gen.emit(Opcode::NEG);
+}
+
+int UnaryMinusNode::emitRegisterCode(RegisterCodeGen &gen, int target) const {
+    const int mark = gen.tempMark();
+    const int operand = expr->emitRegisterCode(gen, -1);
+    gen.releaseTemps(mark);
+
+    const int result = target >= 0 ? target : gen.allocateTemp();
+    gen.emit(RegisterOpcode::NEG, result, operand);
+    return result;
+}
+
+int UnaryMinusNode::emitIR(IRBuilder &builder) const {
+    return builder.emit(IROpcode::NEG, {expr->emitIR(builder)});
+}
+
+ASTPtr UnaryMinusNode::fold() {
+    foldChild(expr);
+
+    if (const LiteralExprNode *literal = numericLiteral(expr)) {
+        if (std::holds_alternative<int>(literal->value)) {
+            return std::make_unique<LiteralExprNode>(static_cast<int>(0u - static_cast<uint32_t>(std::get<int>(literal->value))));
+        }
+        return std::make_unique<LiteralExprNode>(-std::get<float>(literal->value));
+    }
+
+    // -(-x) is x for every int, INT_MIN included, and every float
+    if (auto inner = dynamic_cast<UnaryMinusNode*>(expr.get())) return std::move(inner->expr);
+    return nullptr;
 }
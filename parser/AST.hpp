@@ -8,15 +8,35 @@
 
 #include "../Token.hpp"
 
+class IRBuilder;
+class RegisterCodeGen;
+class StackCodeGen;
+
 class AST {
 public:
     virtual ~AST() = default;
     virtual void emit() const = 0;
-    virtual void emitStackCode() const = 0;
-
-    static std::ostream *out;
-    static void setOutputStream(std::ostream* stream);
-
+    virtual void emitStackCode(StackCodeGen &gen) const = 0;
+    virtual void emitBranchIfFalse(StackCodeGen &gen, const std::string &label) const;
+    // Stack backend: whether emitStackCode leaves a value behind for an expression statement to drop
+    virtual bool leavesValue() const { return true; }
+
+    // Register backend: returns the register holding the result (-1 for statements).
+    // A target >= 0 asks for the result in that register.
+    virtual int emitRegisterCode(RegisterCodeGen &gen, int target) const = 0;
+    virtual void emitRegisterBranchIfFalse(RegisterCodeGen &gen, int label) const;
+
+    // SSA middle end: returns the value an expression computes, -1 for statements
+    virtual int emitIR(IRBuilder &builder) const = 0;
+
+    // Constant folding: folds the children, then returns a simpler node to
+    // take this one's place, or nullptr to keep it
+    virtual std::unique_ptr<AST> fold() { return nullptr; }
+    // Whether evaluating the node does nothing but produce its value, and whether that value is always an int
+    virtual bool isPure() const { return false; }
+    virtual bool isAlwaysInt() const { return false; }
+
+    int line = 0; // Source line the node starts on, 0 when unknown
 };
 
 using ASTPtr = std::unique_ptr<AST>;
@@ -29,7 +49,14 @@ private:
 public:
     BinExprNode(TokenType op, ASTPtr l, ASTPtr r);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    void emitBranchIfFalse(StackCodeGen &gen, const std::string &label) const override;
+    void emitRegisterBranchIfFalse(RegisterCodeGen &gen, int label) const override;
+    ASTPtr fold() override;
+    bool isPure() const override;
+    bool isAlwaysInt() const override;
 };
 
 class LiteralExprNode : public AST {
@@ -43,7 +70,13 @@ public:
     explicit LiteralExprNode(std::string val);
 
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    void emitBranchIfFalse(StackCodeGen &gen, const std::string &label) const override;
+    void emitRegisterBranchIfFalse(RegisterCodeGen &gen, int label) const override;
+    bool isPure() const override { return true; }
+    bool isAlwaysInt() const override { return std::holds_alternative<int>(value); }
 };
 
 class ExprStmtNode : public AST {
@@ -53,7 +86,10 @@ private:
 public:
     explicit ExprStmtNode(ASTPtr expr);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
 };
 
 class BlockNode : public AST {
@@ -63,7 +99,10 @@ private:
 public:
     explicit BlockNode(std::vector<ASTPtr> stmts);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
 };
 
 class IfNode : public AST {
@@ -74,7 +113,10 @@ private:
 public:
     IfNode(ASTPtr cond, ASTPtr thenBranch, ASTPtr elseBranch);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
 };
 
 class WhileNode : public AST {
@@ -85,7 +127,10 @@ private:
 public:
     WhileNode(ASTPtr cond, ASTPtr body);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
 };
 
 class VarDeclNode : public AST {
@@ -97,7 +142,10 @@ private:
 public:
     VarDeclNode(std::string varName, ASTPtr initializer, int offset);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
 };
 
 class VarExprNode : public AST {
@@ -108,7 +156,10 @@ public:
     std::string name;
     VarExprNode(std::string varName, int offset);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    bool isPure() const override { return true; }
 };
 
 class AssignNode : public AST {
@@ -119,7 +170,10 @@ private:
 public:
     AssignNode(int offset, ASTPtr expr);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
 };
 
 class ReturnNode : public AST {
@@ -129,7 +183,10 @@ private:
 public:
     ReturnNode(ASTPtr expr);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
 };
 
 class FunctionNode : public AST {
@@ -137,12 +194,17 @@ private:
     std::string returnType;
     std::string name;
     std::vector<std::string> params;
+    int localCount; // Parameters plus declared locals
     ASTPtr body;
 
 public:
-    FunctionNode(std::string returnType, std::string name, std::vector<std::string> parameters, ASTPtr body);
+    FunctionNode(std::string returnType, std::string name, std::vector<std::string> parameters, int localCount, ASTPtr body);
+    const std::string &functionName() const { return name; }
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
 };
 
 class FunctionCallNode : public AST {
@@ -153,7 +215,10 @@ private:
 public:
     FunctionCallNode(std::string name, std::vector<ASTPtr> arguments);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
 };
 
 class PrintStmtNode : public AST {
@@ -163,7 +228,11 @@ private:
 public:
     explicit PrintStmtNode(ASTPtr expr);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    bool leavesValue() const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
 };
 
 class ReadStmtNode : public AST {
@@ -174,7 +243,9 @@ private:
 public:
     explicit ReadStmtNode(ASTPtr var, int varOffset);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
 };
 
 class UnaryMinusNode : public AST {
@@ -184,7 +255,17 @@ private:
 public:
     explicit UnaryMinusNode(ASTPtr expr);
     void emit() const override;
-    void emitStackCode() const override;
+    void emitStackCode(StackCodeGen &gen) const override;
+    int emitRegisterCode(RegisterCodeGen &gen, int target) const override;
+    int emitIR(IRBuilder &builder) const override;
+    ASTPtr fold() override;
+    bool isPure() const override { return expr->isPure(); }
+    bool isAlwaysInt() const override { return expr->isAlwaysInt(); }
 };
 
+// Folds constant subtrees with the VM's int/float semantics, applies the
+// algebraic identities that hold for every operand type, and drops the dead
+// side of constant if/while conditions
+void foldConstants(std::vector<ASTPtr> &program);
+
 #endif //COMPILER_AST_HPP
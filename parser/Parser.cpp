@@ -58,7 +58,9 @@ std::vector<ASTPtr> Parser::parseProgram() {
     std::vector<ASTPtr> functions;
 
     while (currentToken.getToken() != TokenType::END_OF_FILE) {
+        const int line = currentToken.getLine();
         functions.push_back(parseFunction());
+        functions.back()->line = line;
     }
 
     return functions;
@@ -229,11 +231,15 @@ ASTPtr Parser::parseBlock() {
     std::vector<ASTPtr> stmts;
 
     while(currentToken.getToken() == TokenType::INT) {
+        const int line = currentToken.getLine();
         stmts.push_back(parseVarDecl());
+        stmts.back()->line = line;
     }
 
     while(currentToken.getToken() != TokenType::RIGHT_BRACE) {
+        const int line = currentToken.getLine();
         stmts.push_back(parseStmt());
+        stmts.back()->line = line;
     }
 
     expect(TokenType::RIGHT_BRACE);
@@ -417,5 +423,5 @@ ASTPtr Parser::parseFunction() {
 
     auto body = parseBlock();
 
-    return std::make_unique<FunctionNode>(returnType, name, params, std::move(body));
+    return std::make_unique<FunctionNode>(returnType, name, params, currentVarOffset, std::move(body));
 }
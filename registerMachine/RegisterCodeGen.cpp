@@ -0,0 +1,106 @@
+#include "RegisterCodeGen.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+void RegisterCodeGen::beginFunction(const std::string &name, int paramCount, int localCount) {
+    currentFunction = static_cast<int>(program.functions.size());
+    functionIndex[name] = currentFunction;
+    if(name == "main") program.mainFunction = currentFunction;
+
+    program.functions.push_back({name, static_cast<int>(program.code.size()), paramCount, localCount});
+    nextTemp = localCount;
+}
+
+void RegisterCodeGen::endFunction() {
+    // Falling off the end of a function returns 0
+    emit(RegisterOpcode::RET);
+    currentFunction = -1;
+}
+
+int RegisterCodeGen::allocateTemp() {
+    RegisterFunction &function = program.functions[currentFunction];
+    const int reg = nextTemp++;
+    function.frameSize = std::max(function.frameSize, nextTemp);
+    return reg;
+}
+
+int RegisterCodeGen::newLabel() {
+    labelPositions.push_back(-1);
+    return static_cast<int>(labelPositions.size()) - 1;
+}
+
+void RegisterCodeGen::placeLabel(int label) {
+    labelPositions[label] = static_cast<int>(program.code.size());
+}
+
+void RegisterCodeGen::emit(RegisterOpcode opcode, int a, int b, int c, int operand) {
+    RegisterInstruction instruction{opcode, static_cast<uint16_t>(a), static_cast<uint16_t>(b), static_cast<uint16_t>(c), {operand}};
+    program.code.push_back(instruction);
+}
+
+void RegisterCodeGen::emitFloat(RegisterOpcode opcode, int a, float operand) {
+    emit(opcode, a);
+    program.code.back().floatOperand = operand;
+}
+
+void RegisterCodeGen::emitBranch(RegisterOpcode opcode, int a, int b, int label) {
+    labelFixups.emplace_back(program.code.size(), label);
+    emit(opcode, a, b);
+}
+
+void RegisterCodeGen::emitCall(int result, int argBase, int argCount, const std::string &name) {
+    // Arguments must already sit in the registers the callee frame will start at
+    RegisterFunction &function = program.functions[currentFunction];
+    function.frameSize = std::max(function.frameSize, argBase + argCount);
+
+    callFixups.emplace_back(program.code.size(), name);
+    emit(RegisterOpcode::CALL, result, argBase, argCount);
+}
+
+void RegisterCodeGen::emitString(RegisterOpcode opcode, const std::string &text) {
+    emit(opcode, 0, 0, 0, static_cast<int>(program.strings.size()));
+    program.strings.push_back(text);
+}
+
+bool RegisterCodeGen::finish(RegisterProgram &result) {
+    bool resolved = true;
+
+    for(const auto &function : program.functions) {
+        if(function.frameSize > std::numeric_limits<uint16_t>::max()) {
+            std::cerr << "Error: function '" << function.name << "' needs more registers than the instruction format allows" << std::endl;
+            resolved = false;
+        }
+    }
+
+    for(const auto &[index, label] : labelFixups) {
+        program.code[index].operand = labelPositions[label];
+    }
+
+    for(const auto &[index, name] : callFixups) {
+        auto it = functionIndex.find(name);
+        if(it == functionIndex.end()) {
+            std::cerr << "Error: call to undefined function '" << name << "'" << std::endl;
+            resolved = false;
+            continue;
+        }
+
+        const RegisterFunction &callee = program.functions[it->second];
+        if(callee.paramCount != program.code[index].c) {
+            std::cerr << "Error: '" << name << "' expects " << callee.paramCount << " arguments, but got "
+                      << program.code[index].c << std::endl;
+            resolved = false;
+        }
+        program.code[index].operand = it->second;
+    }
+
+    if(program.mainFunction < 0) {
+        std::cerr << "Error: program has no main function" << std::endl;
+        resolved = false;
+    }
+
+    result = std::move(program);
+    program = RegisterProgram{};
+    return resolved;
+}
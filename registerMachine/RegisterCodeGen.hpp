@@ -0,0 +1,44 @@
+#ifndef REGISTERCODEGEN_HPP
+#define REGISTERCODEGEN_HPP
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "RegisterMachine.hpp"
+
+// Builds a RegisterProgram from the AST. Locals keep the frame offsets the
+// parser assigned; temporaries are handed out above them in stack order so an
+// expression tree needs no more registers than its depth.
+class RegisterCodeGen {
+private:
+    RegisterProgram program;
+    std::unordered_map<std::string, int> functionIndex;
+    std::vector<int> labelPositions;
+    std::vector<std::pair<size_t, int>> labelFixups;             // instruction -> label
+    std::vector<std::pair<size_t, std::string>> callFixups;      // instruction -> callee name
+
+    int currentFunction = -1;
+    int nextTemp = 0;
+
+public:
+    void beginFunction(const std::string &name, int paramCount, int localCount);
+    void endFunction();
+
+    int allocateTemp();
+    [[nodiscard]] int tempMark() const { return nextTemp; }
+    void releaseTemps(int mark) { nextTemp = mark; }
+
+    int newLabel();
+    void placeLabel(int label);
+
+    void emit(RegisterOpcode opcode, int a = 0, int b = 0, int c = 0, int operand = 0);
+    void emitFloat(RegisterOpcode opcode, int a, float operand);
+    void emitBranch(RegisterOpcode opcode, int a, int b, int label);
+    void emitCall(int result, int argBase, int argCount, const std::string &name);
+    void emitString(RegisterOpcode opcode, const std::string &text);
+
+    bool finish(RegisterProgram &result);
+};
+
+#endif //REGISTERCODEGEN_HPP
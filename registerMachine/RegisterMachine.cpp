@@ -0,0 +1,194 @@
+#include "RegisterMachine.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <limits>
+
+namespace {
+    int toInt(const Value &value, const char *context) {
+        if(value.isInt()) return value.asInt();
+
+        std::cerr << "Warning: float " << value.asFloat() << " converted to int " << context << "\n";
+        return static_cast<int>(value.asFloat());
+    }
+
+    // An int divide by zero, or INT_MIN / -1, would trap the host process
+    bool checkIntDivision(const Value &lhs, const Value &rhs) {
+        if(!Value::bothInt(lhs, rhs)) return true;
+        if(rhs.asInt() == 0) {
+            std::cerr << "Error: division by zero" << std::endl;
+            return false;
+        }
+        if(rhs.asInt() == -1 && lhs.asInt() == std::numeric_limits<int>::min()) {
+            std::cerr << "Error: integer overflow in division" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    template<typename Comparison>
+    bool compare(Comparison comparison, const Value &a, const Value &b) {
+        if(Value::bothInt(a, b)) return comparison(a.asInt(), b.asInt());
+        return comparison(a.toFloat(), b.toFloat());
+    }
+}
+
+std::string toString(RegisterOpcode opcode) {
+    static const std::string names[] = {
+            "load_int", "load_float", "move",
+            "add", "sub", "mul", "div", "mod",
+            "eq", "neq", "lt", "lte", "gt", "gte",
+            "neg",
+            "jump", "brz",
+            "eq_brz", "neq_brz", "lt_brz", "lte_brz", "gt_brz", "gte_brz",
+            "call",
+            "ret", "retv",
+            "print", "print_str", "read"};
+    static_assert(std::size(names) == static_cast<size_t>(RegisterOpcode::OPCODE_COUNT));
+    return names[static_cast<int>(opcode)];
+}
+
+RegisterMachine::RegisterMachine(RegisterProgram program) : program(std::move(program)) {}
+
+int RegisterMachine::runProgram() {
+    if(program.mainFunction < 0) {
+        std::cerr << "Error: program has no main function" << std::endl;
+        return 1;
+    }
+
+    const RegisterFunction &main = program.functions[program.mainFunction];
+    registers.assign(main.frameSize, Value(0));
+    callStack.clear();
+
+    int pc = main.entry;
+    int basePointer = 0;
+    Value *frame = registers.data();
+
+    while(true) {
+        const RegisterInstruction &instruction = program.code[pc++];
+
+        switch(instruction.opcode) {
+            case RegisterOpcode::LOAD_INT: frame[instruction.a] = instruction.operand; break;
+            case RegisterOpcode::LOAD_FLOAT: frame[instruction.a] = instruction.floatOperand; break;
+            case RegisterOpcode::MOVE: frame[instruction.a] = frame[instruction.b]; break;
+
+            case RegisterOpcode::ADD:
+                frame[instruction.a] = Value::apply([](auto a, auto b) -> Value { return a + b; }, frame[instruction.b], frame[instruction.c]);
+                break;
+            case RegisterOpcode::SUB:
+                frame[instruction.a] = Value::apply([](auto a, auto b) -> Value { return a - b; }, frame[instruction.b], frame[instruction.c]);
+                break;
+            case RegisterOpcode::MUL:
+                frame[instruction.a] = Value::apply([](auto a, auto b) -> Value { return a * b; }, frame[instruction.b], frame[instruction.c]);
+                break;
+            case RegisterOpcode::DIV:
+                if(!checkIntDivision(frame[instruction.b], frame[instruction.c])) return 1;
+                frame[instruction.a] = Value::apply([](auto a, auto b) -> Value { return a / b; }, frame[instruction.b], frame[instruction.c]);
+                break;
+            case RegisterOpcode::MOD:
+                if(!checkIntDivision(frame[instruction.b], frame[instruction.c])) return 1;
+                if(Value::bothInt(frame[instruction.b], frame[instruction.c])) {
+                    frame[instruction.a] = frame[instruction.b].asInt() % frame[instruction.c].asInt();
+                } else {
+                    std::cerr << "Error: cannot perform modulus on a float" << std::endl;
+                    frame[instruction.a] = 0;
+                }
+                break;
+
+            case RegisterOpcode::EQ: frame[instruction.a] = static_cast<int>(compare(std::equal_to<>(), frame[instruction.b], frame[instruction.c])); break;
+            case RegisterOpcode::NEQ: frame[instruction.a] = static_cast<int>(compare(std::not_equal_to<>(), frame[instruction.b], frame[instruction.c])); break;
+            case RegisterOpcode::LT: frame[instruction.a] = static_cast<int>(compare(std::less<>(), frame[instruction.b], frame[instruction.c])); break;
+            case RegisterOpcode::LTE: frame[instruction.a] = static_cast<int>(compare(std::less_equal<>(), frame[instruction.b], frame[instruction.c])); break;
+            case RegisterOpcode::GT: frame[instruction.a] = static_cast<int>(compare(std::greater<>(), frame[instruction.b], frame[instruction.c])); break;
+            case RegisterOpcode::GTE: frame[instruction.a] = static_cast<int>(compare(std::greater_equal<>(), frame[instruction.b], frame[instruction.c])); break;
+
+            case RegisterOpcode::NEG: {
+                const Value value = frame[instruction.b];
+                frame[instruction.a] = value.isInt() ? Value(-value.asInt()) : Value(-value.asFloat());
+                break;
+            }
+
+            case RegisterOpcode::JUMP: pc = instruction.operand; break;
+            case RegisterOpcode::BRZ:
+                if(toInt(frame[instruction.a], "in brz") == 0) pc = instruction.operand;
+                break;
+            case RegisterOpcode::EQ_BRZ: if(!compare(std::equal_to<>(), frame[instruction.a], frame[instruction.b])) pc = instruction.operand; break;
+            case RegisterOpcode::NEQ_BRZ: if(!compare(std::not_equal_to<>(), frame[instruction.a], frame[instruction.b])) pc = instruction.operand; break;
+            case RegisterOpcode::LT_BRZ: if(!compare(std::less<>(), frame[instruction.a], frame[instruction.b])) pc = instruction.operand; break;
+            case RegisterOpcode::LTE_BRZ: if(!compare(std::less_equal<>(), frame[instruction.a], frame[instruction.b])) pc = instruction.operand; break;
+            case RegisterOpcode::GT_BRZ: if(!compare(std::greater<>(), frame[instruction.a], frame[instruction.b])) pc = instruction.operand; break;
+            case RegisterOpcode::GTE_BRZ: if(!compare(std::greater_equal<>(), frame[instruction.a], frame[instruction.b])) pc = instruction.operand; break;
+
+            case RegisterOpcode::CALL: {
+                const RegisterFunction &callee = program.functions[instruction.operand];
+                const size_t frameEnd = basePointer + instruction.b + callee.frameSize;
+                if(callStack.size() == MAX_CALL_DEPTH) {
+                    std::cerr << "Error: Call stack overflow" << std::endl;
+                    return 1;
+                }
+                if(frameEnd > MAX_REGISTERS) {
+                    std::cerr << "Error: Stack overflow" << std::endl;
+                    return 1;
+                }
+                callStack.push_back({pc, basePointer, instruction.a});
+
+                // The callee frame starts at the first argument, so parameters need no copying
+                basePointer += instruction.b;
+                if(registers.size() < frameEnd) registers.resize(frameEnd);
+                std::fill(registers.begin() + basePointer + callee.paramCount, registers.begin() + static_cast<long>(frameEnd), Value(0));
+
+                frame = registers.data() + basePointer;
+                pc = callee.entry;
+                break;
+            }
+            case RegisterOpcode::RET:
+            case RegisterOpcode::RETV: {
+                const Value result = instruction.opcode == RegisterOpcode::RETV ? frame[instruction.a] : Value(0);
+                if(callStack.empty()) {
+                    return toInt(result, "in return from main");
+                }
+
+                const CallFrame caller = callStack.back();
+                callStack.pop_back();
+
+                basePointer = caller.basePointer;
+                frame = registers.data() + basePointer;
+                frame[caller.resultRegister] = result;
+                pc = caller.returnAddress;
+                break;
+            }
+
+            case RegisterOpcode::PRINT: std::cout << frame[instruction.a] << std::endl; break;
+            case RegisterOpcode::PRINT_STR: std::cout << program.strings[instruction.operand] << std::endl; break;
+            case RegisterOpcode::READ: {
+                std::string input;
+                std::cin >> input;
+                try {
+                    if(input.find('.') != std::string::npos) frame[instruction.a] = std::stof(input);
+                    else frame[instruction.a] = std::stoi(input);
+                } catch(...) {
+                    std::cerr << "Error: Invalid input for read()\n";
+                }
+                break;
+            }
+
+            default:
+                std::cerr << "Error: Instruction " << static_cast<int>(instruction.opcode) << " not found!" << std::endl;
+                break;
+        }
+    }
+}
+
+void RegisterMachine::printProgram() const {
+    for(const auto &function : program.functions) {
+        std::cout << "Function " << function.name << ": entry " << function.entry
+                  << ", params " << function.paramCount << ", frame " << function.frameSize << "\n";
+    }
+
+    int index = 0;
+    for(const auto &instruction : program.code) {
+        std::cout << "Instruction " << index++ << ": " << toString(instruction.opcode) << " r" << instruction.a
+                  << " r" << instruction.b << " r" << instruction.c << " " << instruction.operand << "\n";
+    }
+}
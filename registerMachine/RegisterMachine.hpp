@@ -0,0 +1,75 @@
+#ifndef REGISTERMACHINE_HPP
+#define REGISTERMACHINE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../stackMachine/Value.hpp"
+
+// Three-address instruction set. Registers are slots of the current frame:
+// locals occupy r0..rN-1 (parameters first) and expression temporaries follow.
+enum class RegisterOpcode : uint8_t {
+    LOAD_INT, LOAD_FLOAT, MOVE,              // a <- operand / a <- b
+    ADD, SUB, MUL, DIV, MOD,                 // a <- b op c
+    EQ, NEQ, LT, LTE, GT, GTE,               // a <- b cmp c
+    NEG,                                     // a <- -b
+    JUMP, BRZ,                               // pc <- operand (if a == 0)
+    EQ_BRZ, NEQ_BRZ, LT_BRZ, LTE_BRZ, GT_BRZ, GTE_BRZ, // pc <- operand unless a cmp b
+    CALL,                                    // a <- functions[operand](b .. b+c-1)
+    RET, RETV,                               // return 0 / return a
+    PRINT, PRINT_STR, READ,                  // print a / print strings[operand] / read a
+
+    OPCODE_COUNT
+};
+
+std::string toString(RegisterOpcode opcode);
+
+struct RegisterInstruction {
+    RegisterOpcode opcode;
+    uint16_t a, b, c;
+    union {
+        int operand;        // Integer immediate, branch target, function or string index
+        float floatOperand; // Float immediate for LOAD_FLOAT
+    };
+};
+
+struct RegisterFunction {
+    std::string name;
+    int entry;      // pc of the first instruction
+    int paramCount;
+    int frameSize;  // Locals plus the deepest temporary
+};
+
+struct RegisterProgram {
+    std::vector<RegisterInstruction> code;
+    std::vector<std::string> strings;
+    std::vector<RegisterFunction> functions;
+    int mainFunction = -1;
+};
+
+class RegisterMachine {
+private:
+    struct CallFrame {
+        int returnAddress;
+        int basePointer;
+        int resultRegister; // Caller register receiving the return value
+    };
+
+    // Same limits as the stack machine's call stack and default stack region
+    static constexpr size_t MAX_CALL_DEPTH = 1 << 20;
+    static constexpr size_t MAX_REGISTERS = 16 * 1024 * 1024;
+
+    RegisterProgram program;
+    std::vector<Value> registers;
+    std::vector<CallFrame> callStack;
+
+public:
+    explicit RegisterMachine(RegisterProgram program);
+
+    // Runs main and returns its exit value
+    int runProgram();
+    void printProgram() const;
+};
+
+#endif //REGISTERMACHINE_HPP
@@ -0,0 +1,202 @@
+#include "BufferedIo.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+
+#include <unistd.h>
+
+namespace {
+    bool isSpace(char c) {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+}
+
+OutputBuffer::OutputBuffer() : buffer(std::make_unique<char[]>(CAPACITY)) {
+    setFileDescriptor(1);
+}
+
+OutputBuffer::~OutputBuffer() {
+    flush();
+}
+
+void OutputBuffer::setFileDescriptor(int descriptor) {
+    flush();
+    fd = descriptor;
+    stream = nullptr;
+    lineBuffered = isatty(descriptor);
+}
+
+void OutputBuffer::setStream(std::ostream &output) {
+    flush();
+    stream = output.rdbuf();
+    lineBuffered = false;
+}
+
+// Short writes and EINTR are retried; on any other error the output is dropped
+void OutputBuffer::drain(const char *data, size_t size) {
+    if(holding) {
+        held.append(data, size);
+        return;
+    }
+    if(stream) {
+        stream->sputn(data, static_cast<std::streamsize>(size));
+        return;
+    }
+
+    while(size > 0) {
+        const ssize_t written = ::write(fd, data, size);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+}
+
+void OutputBuffer::flush() {
+    if(used == 0) return;
+    drain(buffer.get(), used);
+    used = 0;
+}
+
+void OutputBuffer::hold(bool enabled) {
+    if(holding && !enabled) {
+        holding = false;
+        drain(held.data(), held.size());
+        held.clear();
+    }
+    holding = enabled;
+}
+
+std::string OutputBuffer::pending() const {
+    return held + std::string(buffer.get(), used);
+}
+
+void OutputBuffer::reserve(size_t size) {
+    if(used + size > CAPACITY) flush();
+}
+
+void OutputBuffer::endLine() {
+    buffer[used++] = '\n';
+    if(lineBuffered) flush();
+}
+
+void OutputBuffer::write(std::string_view text) {
+    // Text longer than the buffer is written straight through
+    if(text.size() > CAPACITY) {
+        flush();
+        drain(text.data(), text.size());
+        return;
+    }
+
+    reserve(text.size());
+    std::memcpy(buffer.get() + used, text.data(), text.size());
+    used += text.size();
+}
+
+void OutputBuffer::writeLine(std::string_view text) {
+    write(text);
+    reserve(1);
+    endLine();
+}
+
+// Same text as operator<<: ints in full, floats like %g with six significant digits
+void OutputBuffer::writeLine(const Value &value) {
+    constexpr size_t LONGEST_NUMBER = 32;
+    reserve(LONGEST_NUMBER + 1);
+
+    char *first = buffer.get() + used;
+    char *last = first + LONGEST_NUMBER;
+    const std::to_chars_result result = value.isInt()
+            ? std::to_chars(first, last, value.asInt())
+            : std::to_chars(first, last, value.asFloat(), std::chars_format::general, 6);
+    used += static_cast<size_t>(result.ptr - first);
+    endLine();
+}
+
+InputReader::InputReader() : buffer(std::make_unique<char[]>(CAPACITY)) {}
+
+void InputReader::setFileDescriptor(int descriptor) {
+    fd = descriptor;
+    stream = nullptr;
+    begin = end = 0;
+    exhausted = false;
+}
+
+void InputReader::setStream(std::istream &input) {
+    stream = input.rdbuf();
+    begin = end = 0;
+    exhausted = false;
+}
+
+// Keeps the unread bytes, moved to the front, and appends whatever is available
+bool InputReader::refill() {
+    starved = false;
+    if(exhausted) return false;
+    if(tied) tied->flush();
+
+    std::memmove(buffer.get(), buffer.get() + begin, end - begin);
+    end -= begin;
+    begin = 0;
+    if(end == CAPACITY) return false;
+
+    ssize_t received;
+    if(stream) {
+        received = stream->sgetn(buffer.get() + end, static_cast<std::streamsize>(CAPACITY - end));
+    } else {
+        do {
+            received = ::read(fd, buffer.get() + end, CAPACITY - end);
+        } while(received < 0 && errno == EINTR);
+
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            starved = true;
+            return false;
+        }
+    }
+
+    if(received <= 0) {
+        exhausted = true;
+        return false;
+    }
+    end += static_cast<size_t>(received);
+    return true;
+}
+
+InputReader::Result InputReader::readValue(Value &value) {
+    starved = false;
+    while(true) {
+        while(begin < end && isSpace(buffer[begin])) begin++;
+        if(begin < end) break;
+        if(!refill()) return starved ? Result::WOULD_BLOCK : Result::END_OF_INPUT;
+    }
+
+    // Grow the token until whitespace or the end of input, refilling past the buffer end
+    size_t length = 0;
+    while(true) {
+        while(begin + length < end && !isSpace(buffer[begin + length])) length++;
+        if(begin + length < end || !refill()) break;
+    }
+    if(starved) return Result::WOULD_BLOCK;
+
+    const char *first = buffer.get() + begin;
+    const char *last = first + length;
+    begin += length;
+
+    const bool isFloat = std::memchr(first, '.', length) != nullptr;
+    if(first != last && *first == '+') first++;
+
+    // Like stoi/stof, a numeric prefix is enough: "12abc" reads as 12
+    std::from_chars_result result{};
+    if(isFloat) {
+        float number = 0;
+        result = std::from_chars(first, last, number);
+        value = Value(number);
+    } else {
+        int number = 0;
+        result = std::from_chars(first, last, number);
+        value = Value(number);
+    }
+    return result.ec == std::errc() ? Result::VALUE : Result::INVALID;
+}
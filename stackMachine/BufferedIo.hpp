@@ -0,0 +1,87 @@
+#ifndef BUFFEREDIO_HPP
+#define BUFFEREDIO_HPP
+
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#include "Value.hpp"
+
+// Output of print. Lines collect in one large buffer that is written with
+// write(2) only when it fills, when the run ends, or after every line when
+// line buffering is on (the default for terminals). Values are formatted with
+// to_chars straight into the buffer, so printing never allocates. While held,
+// nothing is written at all and the output collects in memory instead.
+class OutputBuffer {
+public:
+    static constexpr size_t CAPACITY = 64 * 1024;
+
+private:
+    std::unique_ptr<char[]> buffer;
+    size_t used = 0;
+    int fd = 1;
+    std::streambuf *stream = nullptr; // Set when writing to a stream instead of fd
+    bool lineBuffered = false;
+    bool holding = false;
+    std::string held; // Everything flushed while holding
+
+    void drain(const char *data, size_t size);
+    void reserve(size_t size);
+    void endLine();
+
+public:
+    OutputBuffer();
+    ~OutputBuffer();
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+    void setFileDescriptor(int descriptor);
+    void setStream(std::ostream &output);
+    void setLineBuffered(bool enabled) { lineBuffered = enabled; }
+    // Releasing a hold writes out everything collected so far
+    void hold(bool enabled);
+    // All output not yet written, held or buffered
+    [[nodiscard]] std::string pending() const;
+
+    void write(std::string_view text);
+    void writeLine(std::string_view text);
+    void writeLine(const Value &value);
+    void flush();
+};
+
+// Input of read. Tokens are whitespace-separated and parsed in place in a
+// buffer refilled with read(2); the tied output is flushed before blocking so
+// prompts always appear before the program waits for an answer. On a
+// non-blocking descriptor, a token that has not fully arrived yet is left
+// unconsumed and reported as WOULD_BLOCK.
+class InputReader {
+public:
+    static constexpr size_t CAPACITY = 64 * 1024;
+    enum class Result { VALUE, END_OF_INPUT, INVALID, WOULD_BLOCK };
+
+private:
+    std::unique_ptr<char[]> buffer;
+    size_t begin = 0, end = 0;
+    bool exhausted = false;
+    bool starved = false; // The last refill found a non-blocking source empty
+    int fd = 0;
+    std::streambuf *stream = nullptr; // Set when reading from a stream instead of fd
+    OutputBuffer *tied = nullptr;
+
+    bool refill();
+
+public:
+    InputReader();
+
+    void setFileDescriptor(int descriptor);
+    void setStream(std::istream &input);
+    void tie(OutputBuffer *output) { tied = output; }
+
+    // Tokens containing a '.' are floats, everything else ints
+    Result readValue(Value &value);
+};
+
+#endif //BUFFEREDIO_HPP
@@ -0,0 +1,441 @@
+#include "Bytecode.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+namespace {
+    const std::unordered_map<std::string, Opcode> mnemonics = {
+            {"push", Opcode::PUSH_INT}, {"pop", Opcode::POP}, {"dup", Opcode::DUP},
+            {"load", Opcode::LOAD}, {"save", Opcode::SAVE}, {"store", Opcode::STORE},
+            {"call", Opcode::CALL}, {"enter", Opcode::ENTER}, {"ret", Opcode::RET}, {"retv", Opcode::RETV},
+            {"brt", Opcode::BRT}, {"brz", Opcode::BRZ}, {"jump", Opcode::JUMP},
+            {"load_local", Opcode::LOAD_LOCAL}, {"store_local", Opcode::STORE_LOCAL},
+            {"eq_brz", Opcode::EQ_BRZ}, {"neq_brz", Opcode::NEQ_BRZ}, {"lt_brz", Opcode::LT_BRZ},
+            {"lte_brz", Opcode::LTE_BRZ}, {"gt_brz", Opcode::GT_BRZ}, {"gte_brz", Opcode::GTE_BRZ},
+            {"neg", Opcode::NEG}, {"add", Opcode::ADD}, {"sub", Opcode::SUB},
+            {"mul", Opcode::MUL}, {"div", Opcode::DIV}, {"mod", Opcode::MOD},
+            {"eq", Opcode::EQ}, {"neq", Opcode::NEQ}, {"lt", Opcode::LT},
+            {"lte", Opcode::LTE}, {"gt", Opcode::GT}, {"gte", Opcode::GTE},
+            {"print", Opcode::PRINT}, {"read", Opcode::READ}, {"end", Opcode::END},
+    };
+
+    // Offset from the base opcode of a pop/load/save/store family for its bp/top forms
+    int addressModeOffset(const std::string &arg) {
+        if(arg == "bp") return 1;
+        if(arg == "top") return 2;
+        return 0;
+    }
+}
+
+std::string toString(Opcode opcode) {
+    static const std::string names[] = {
+            "push", "push", "push bp", "push top",
+            "pop", "pop bp", "pop top", "dup",
+            "load", "load bp", "load top",
+            "save", "save bp", "save top",
+            "store", "store bp", "store top",
+            "load_local", "store_local",
+            "call", "enter", "ret", "retv", "brt", "brz", "jump",
+            "eq_brz", "neq_brz", "lt_brz", "lte_brz", "gt_brz", "gte_brz",
+            "neg", "add", "sub", "mul", "div", "mod",
+            "eq", "neq", "lt", "lte", "gt", "gte",
+            "print", "print", "read", "end", "end bp", "end top", "end", "end",
+            "add_ii", "sub_ii", "mul_ii", "div_ii",
+            "eq_ii", "neq_ii", "lt_ii", "lte_ii", "gt_ii", "gte_ii",
+            "eq_brz_ii", "neq_brz_ii", "lt_brz_ii", "lte_brz_ii", "gt_brz_ii", "gte_brz_ii"};
+    static_assert(std::size(names) == static_cast<size_t>(Opcode::OPCODE_COUNT));
+    return names[static_cast<int>(opcode)];
+}
+
+bool isBranch(Opcode opcode) {
+    switch(opcode) {
+        case Opcode::CALL:
+        case Opcode::BRT:
+        case Opcode::BRZ:
+        case Opcode::JUMP:
+        case Opcode::EQ_BRZ:
+        case Opcode::NEQ_BRZ:
+        case Opcode::LT_BRZ:
+        case Opcode::LTE_BRZ:
+        case Opcode::GT_BRZ:
+        case Opcode::GTE_BRZ:
+        case Opcode::EQ_BRZ_II:
+        case Opcode::NEQ_BRZ_II:
+        case Opcode::LT_BRZ_II:
+        case Opcode::LTE_BRZ_II:
+        case Opcode::GT_BRZ_II:
+        case Opcode::GTE_BRZ_II:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool Assembler::error(const std::string &message) const {
+    std::cerr << "Error: line " << lineNumber << ": " << message << std::endl;
+    return false;
+}
+
+bool Assembler::parseNumber(const std::string &text, Instruction &instruction, Opcode intOpcode, Opcode floatOpcode) {
+    try {
+        if(text.find('.') != std::string::npos) {
+            instruction.opcode = floatOpcode;
+            instruction.floatOperand = std::stof(text);
+        } else {
+            instruction.opcode = intOpcode;
+            instruction.operand = std::stoi(text);
+        }
+    } catch(const std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+void Assembler::append(const Instruction &instruction) {
+    program.code.push_back(instruction);
+    program.lines.push_back(sourceLine);
+    textLines.push_back(lineNumber);
+}
+
+bool Assembler::directive(const std::string &name, const std::string &argument) {
+    if(name == ".line") {
+        Instruction line{};
+        if(!parseNumber(argument, line, Opcode::PUSH_INT, Opcode::OPCODE_COUNT) || line.opcode != Opcode::PUSH_INT) {
+            return error(".line requires a line number");
+        }
+        setSourceLine(line.operand);
+        return true;
+    }
+    if(name == ".function") {
+        if(argument.empty()) return error(".function requires a name");
+        markFunction(argument);
+        return true;
+    }
+    return error("unknown directive " + name);
+}
+
+void Assembler::emit(Opcode opcode, int operand) {
+    append({opcode, {operand}});
+}
+
+void Assembler::emitFloat(Opcode opcode, float operand) {
+    Instruction instruction{opcode, {0}};
+    instruction.floatOperand = operand;
+    append(instruction);
+}
+
+void Assembler::emitBranch(Opcode opcode, const std::string &label) {
+    unresolvedBranches.emplace_back(program.code.size(), label);
+    emit(opcode, -1);
+}
+
+// \n and \t are decoded here once; any other backslash is kept as written
+void Assembler::emitString(Opcode opcode, const std::string &text) {
+    std::string decoded;
+    for(size_t i = 0; i < text.size(); i++) {
+        if(text[i] == '\\' && i + 1 < text.size() && (text[i + 1] == 'n' || text[i + 1] == 't')) {
+            decoded += text[i + 1] == 'n' ? '\n' : '\t';
+            i++; // Skip the escaped character
+        } else {
+            decoded += text[i];
+        }
+    }
+
+    emit(opcode, static_cast<int>(program.strings.size()));
+    program.strings.push_back(std::move(decoded));
+}
+
+void Assembler::defineLabel(const std::string &label) {
+    program.labels[label] = static_cast<int>(program.code.size());
+}
+
+void Assembler::markFunction(const std::string &name) {
+    program.functions[name] = static_cast<int>(program.code.size());
+}
+
+void Assembler::setSourceLine(int line) {
+    sourceLine = line;
+    hasLineDirectives = true;
+}
+
+void Assembler::append(Assembler &&other) {
+    const int codeBase = static_cast<int>(program.code.size());
+    const int stringBase = static_cast<int>(program.strings.size());
+
+    for(Instruction instruction : other.program.code) {
+        if(instruction.opcode == Opcode::PRINT_STR) instruction.operand += stringBase;
+        program.code.push_back(instruction);
+    }
+    program.lines.insert(program.lines.end(), other.program.lines.begin(), other.program.lines.end());
+    textLines.insert(textLines.end(), other.textLines.begin(), other.textLines.end());
+    for(std::string &text : other.program.strings) program.strings.push_back(std::move(text));
+
+    for(const auto &[label, target] : other.program.labels) program.labels[label] = codeBase + target;
+    for(const auto &[name, entry] : other.program.functions) program.functions[name] = codeBase + entry;
+    for(auto &[index, label] : other.unresolvedBranches) unresolvedBranches.emplace_back(codeBase + index, std::move(label));
+    hasLineDirectives = hasLineDirectives || other.hasLineDirectives;
+
+    other = Assembler{};
+}
+
+bool Assembler::assembleLine(const std::string &line) {
+    lineNumber++;
+    std::string instruction = line;
+
+    // Remove ; -->
+    if(const size_t pos = instruction.find(';'); pos != std::string::npos) {
+        instruction.erase(pos);
+    }
+
+    std::istringstream instructionStream(instruction);
+    std::string token;
+    if(!(instructionStream >> token)) return true;
+
+    std::string argument;
+    bool quoted = false;
+    if (instructionStream >> std::ws && instructionStream.peek() == '"') {  // Handle quoted string argument
+        instructionStream.get(); // Remove the opening quote
+        std::getline(instructionStream, argument, '"'); // Read until closing quote
+        quoted = true;
+    } else if(!(instructionStream >> argument)) {
+        argument.clear();
+    }
+
+    if(token[0] == '.') return directive(token, argument);
+
+    // Anything that is not a mnemonic is a label
+    auto it = mnemonics.find(token);
+    if(it == mnemonics.end()) {
+        defineLabel(token);
+        return true;
+    }
+
+    const Opcode base = it->second;
+    switch(base) {
+        case Opcode::PUSH_INT: {
+            if(argument.empty()) return error("push requires an argument");
+            if(argument == "bp") { emit(Opcode::PUSH_BP); break; }
+            if(argument == "top") { emit(Opcode::PUSH_TOP); break; }
+
+            Instruction push{};
+            if(!parseNumber(argument, push, Opcode::PUSH_INT, Opcode::PUSH_FLOAT)) {
+                return error("Invalid push argument: " + argument);
+            }
+            append(push);
+            break;
+        }
+        case Opcode::POP:
+        case Opcode::LOAD:
+        case Opcode::SAVE:
+        case Opcode::STORE:
+            emit(static_cast<Opcode>(static_cast<int>(base) + addressModeOffset(argument)));
+            break;
+        case Opcode::LOAD_LOCAL:
+        case Opcode::STORE_LOCAL: {
+            Instruction local{};
+            // OPCODE_COUNT marks a float operand as invalid here
+            if(!parseNumber(argument, local, base, Opcode::OPCODE_COUNT) || local.opcode != base) {
+                return error(token + " requires an integer frame offset");
+            }
+            append(local);
+            break;
+        }
+        case Opcode::ENTER: {
+            // The only two-argument instruction: enter <params> <frame size>
+            int params = -1, frameSize = -1;
+            std::istringstream counts(argument);
+            if(!(counts >> params) || !(instructionStream >> frameSize) || params < 0 || frameSize < params || frameSize > MAX_FRAME_SIZE) {
+                return error("enter requires a parameter count and a frame size of at most " + std::to_string(MAX_FRAME_SIZE));
+            }
+            emit(Opcode::ENTER, enterOperand(params, frameSize));
+            break;
+        }
+        case Opcode::CALL:
+        case Opcode::BRT:
+        case Opcode::BRZ:
+        case Opcode::JUMP:
+        case Opcode::EQ_BRZ:
+        case Opcode::NEQ_BRZ:
+        case Opcode::LT_BRZ:
+        case Opcode::LTE_BRZ:
+        case Opcode::GT_BRZ:
+        case Opcode::GTE_BRZ:
+            if(argument.empty()) return error(token + " requires a label as argument");
+            emitBranch(base, argument);
+            break;
+        case Opcode::PRINT:
+            if(argument.empty() && !quoted) emit(Opcode::PRINT);
+            else emitString(Opcode::PRINT_STR, argument);
+            break;
+        case Opcode::END: {
+            if(argument.empty()) { emit(Opcode::END); break; }
+            if(argument == "bp") { emit(Opcode::END_BP); break; }
+            if(argument == "top") { emit(Opcode::END_TOP); break; }
+
+            Instruction end{};
+            if(!parseNumber(argument, end, Opcode::END_INT, Opcode::END_FLOAT)) {
+                return error("Invalid end argument: " + argument);
+            }
+            append(end);
+            break;
+        }
+        default:
+            emit(base);
+            break;
+    }
+
+    return true;
+}
+
+bool Assembler::assemble(std::istream &input) {
+    std::string line;
+    while(std::getline(input, line)) {
+        if(!assembleLine(line)) return false;
+    }
+    return true;
+}
+
+bool Assembler::finish(Program &result) {
+    // Running off the end of the program behaves like an explicit end
+    lineNumber = sourceLine = 0;
+    emit(Opcode::END);
+
+    bool resolved = true;
+    for(const auto &[index, label] : unresolvedBranches) {
+        auto it = program.labels.find(label);
+        if(it == program.labels.end()) {
+            std::cerr << "Error: label '" << label << "' not found" << std::endl;
+            resolved = false;
+            continue;
+        }
+        program.code[index].operand = it->second;
+    }
+    unresolvedBranches.clear();
+
+    if(!hasLineDirectives) program.lines = std::move(textLines);
+    textLines.clear();
+
+    result = std::move(program);
+    program = Program{};
+    return resolved;
+}
+
+bool assembleFile(const std::string &filename, Program &program) {
+    std::ifstream programFile(filename);
+    if(!programFile.is_open()) {
+        std::cerr << "Unable to open file " << filename << std::endl;
+        return false;
+    }
+
+    Assembler assembler;
+    if(!assembler.assemble(programFile)) return false;
+    return assembler.finish(program);
+}
+
+// Branch targets without a label get a synthetic pc_N: one. The end finish()
+// appends is left out, since assembling the text appends it again.
+void writeAssembly(const Program &program, std::ostream &output) {
+    const size_t size = program.code.size();
+    std::vector<std::vector<std::string>> labelsAt(size + 1);
+    for(const auto &[label, target] : program.labels) {
+        labelsAt[target].push_back(label);
+    }
+    for(const Instruction &instruction : program.code) {
+        if(isBranch(instruction.opcode) && labelsAt[instruction.operand].empty()) {
+            labelsAt[instruction.operand].push_back("pc_" + std::to_string(instruction.operand) + ":");
+        }
+    }
+    for(auto &labels : labelsAt) std::sort(labels.begin(), labels.end());
+
+    std::vector<std::vector<std::string>> functionsAt(size + 1);
+    for(const auto &[name, entry] : program.functions) {
+        functionsAt[entry].push_back(name);
+    }
+
+    int line = 0;
+    for(size_t pc = 0; pc <= size; pc++) {
+        for(const std::string &name : functionsAt[pc]) output << ".function " << name << "\n";
+        if(pc < program.lines.size() && program.lines[pc] != 0 && program.lines[pc] != line) {
+            line = program.lines[pc];
+            output << ".line " << line << "\n";
+        }
+        for(const std::string &label : labelsAt[pc]) output << label << "\n";
+
+        if(pc == size || (pc == size - 1 && program.code[pc].opcode == Opcode::END)) continue;
+        const Instruction &instruction = program.code[pc];
+        if(isBranch(instruction.opcode)) {
+            output << toString(instruction.opcode) << " " << labelsAt[instruction.operand].front() << "\n";
+        } else {
+            const std::string_view text = instruction.opcode == Opcode::PRINT_STR ? std::string_view(program.strings[instruction.operand]) : std::string_view();
+            output << disassemble(instruction, text) << "\n";
+        }
+    }
+}
+
+std::string formatFloat(float value) {
+    std::ostringstream number;
+    number.precision(std::numeric_limits<float>::max_digits10);
+    number << value;
+
+    // Integral values print without a '.', but the assembler needs one to tell floats apart
+    if(number.str().find('.') == std::string::npos) {
+        number.str("");
+        number << std::fixed;
+        number.precision(1);
+        number << value;
+    }
+    return number.str();
+}
+
+std::string disassemble(const Instruction &instruction, std::string_view stringOperand) {
+    std::ostringstream text;
+    text << toString(instruction.opcode);
+
+    switch(instruction.opcode) {
+        case Opcode::PUSH_INT:
+        case Opcode::END_INT:
+        case Opcode::LOAD_LOCAL:
+        case Opcode::STORE_LOCAL:
+        case Opcode::CALL:
+        case Opcode::BRT:
+        case Opcode::BRZ:
+        case Opcode::JUMP:
+        case Opcode::EQ_BRZ:
+        case Opcode::NEQ_BRZ:
+        case Opcode::LT_BRZ:
+        case Opcode::LTE_BRZ:
+        case Opcode::GT_BRZ:
+        case Opcode::GTE_BRZ:
+        case Opcode::EQ_BRZ_II:
+        case Opcode::NEQ_BRZ_II:
+        case Opcode::LT_BRZ_II:
+        case Opcode::LTE_BRZ_II:
+        case Opcode::GT_BRZ_II:
+        case Opcode::GTE_BRZ_II:
+            text << " " << instruction.operand;
+            break;
+        case Opcode::ENTER:
+            text << " " << enterParams(instruction.operand) << " " << enterFrameSize(instruction.operand);
+            break;
+        case Opcode::PUSH_FLOAT:
+        case Opcode::END_FLOAT:
+            text << " " << formatFloat(instruction.floatOperand);
+            break;
+        case Opcode::PRINT_STR:
+            text << " \"";
+            for(char c : stringOperand) {
+                if(c == '\n') text << "\\n";
+                else if(c == '\t') text << "\\t";
+                else text << c;
+            }
+            text << "\"";
+            break;
+        default:
+            break;
+    }
+
+    return text.str();
+}
@@ -0,0 +1,128 @@
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Decoded instruction set. Operand modes (bp/top) are folded into the opcode
+// so the interpreter never has to look at the argument text at run time.
+enum class Opcode : uint8_t {
+    // Memory state
+    PUSH_INT, PUSH_FLOAT, PUSH_BP, PUSH_TOP,
+    POP, POP_BP, POP_TOP, DUP,
+    LOAD, LOAD_BP, LOAD_TOP,
+    SAVE, SAVE_BP, SAVE_TOP,
+    STORE, STORE_BP, STORE_TOP,
+    LOAD_LOCAL, STORE_LOCAL, // Fused push N / load bp and push N / store bp
+
+    // Control of execution
+    CALL, ENTER, RET, RETV, BRT, BRZ, JUMP,
+    EQ_BRZ, NEQ_BRZ, LT_BRZ, LTE_BRZ, GT_BRZ, GTE_BRZ, // Fused comparison / brz
+
+    // Arithmetic
+    NEG, ADD, SUB, MUL, DIV, MOD,
+
+    // Relational
+    EQ, NEQ, LT, LTE, GT, GTE,
+
+    // Special
+    PRINT, PRINT_STR, READ, END, END_BP, END_TOP, END_INT, END_FLOAT,
+
+    // Quickened int/int forms, only ever written by the VM at run time
+    ADD_II, SUB_II, MUL_II, DIV_II,
+    EQ_II, NEQ_II, LT_II, LTE_II, GT_II, GTE_II,
+    EQ_BRZ_II, NEQ_BRZ_II, LT_BRZ_II, LTE_BRZ_II, GT_BRZ_II, GTE_BRZ_II,
+
+    OPCODE_COUNT
+};
+
+std::string toString(Opcode opcode);
+// Opcodes whose operand is a branch target
+bool isBranch(Opcode opcode);
+
+struct Instruction {
+    Opcode opcode;
+    union {
+        int operand;        // Integer immediate, frame offset, branch target or string pool index
+        float floatOperand; // Float immediate for PUSH_FLOAT / END_FLOAT
+    };
+};
+
+static_assert(sizeof(Instruction) == 8, "Instruction should stay two words wide");
+
+// Calling convention. The caller pushes the arguments and executes call, which
+// saves its return pc, bp and frame size on the VM's frame stack. The callee
+// starts with "enter params size": bp moves down onto the first argument and
+// the stack grows to hold every local, so locals 0..params-1 are the arguments.
+// ret and retv drop the whole frame, restore the caller and (retv) push the result.
+struct CallFrame {
+    int32_t returnAddress;
+    int32_t basePointer;
+    int32_t frameSize;
+};
+
+// enter packs its two counts into the operand, the frame size in the high half
+constexpr int MAX_FRAME_SIZE = 0x7FFF;
+constexpr int enterOperand(int params, int frameSize) { return frameSize << 16 | params; }
+constexpr int enterParams(int operand) { return operand & 0xFFFF; }
+constexpr int enterFrameSize(int operand) { return operand >> 16; }
+
+struct Program {
+    std::vector<Instruction> code;
+    std::vector<std::string> strings; // Arguments of print "...", escapes decoded
+    std::unordered_map<std::string, int> labels; // Label -> index of the next instruction
+    std::unordered_map<std::string, int> functions; // .function name -> entry pc
+    std::vector<int> lines; // Source line of each instruction, 0 where there is none
+};
+
+// Builds a Program from .vsm text, or from a code generator calling the emit
+// functions directly. Labels may be referenced before they are defined; all
+// branch targets are resolved to instruction indices by finish().
+// Debug directives: ".line N" attributes the following instructions to source
+// line N, ".function name" marks the next instruction as a function entry.
+// Without any .line directive the .vsm line numbers are recorded instead.
+class Assembler {
+private:
+    Program program;
+    std::vector<std::pair<size_t, std::string>> unresolvedBranches;
+    int lineNumber = 0;
+    int sourceLine = 0;
+    bool hasLineDirectives = false;
+    std::vector<int> textLines;
+
+    bool error(const std::string &message) const;
+    void append(const Instruction &instruction);
+    bool directive(const std::string &name, const std::string &argument);
+    static bool parseNumber(const std::string &text, Instruction &instruction, Opcode intOpcode, Opcode floatOpcode);
+
+public:
+    void emit(Opcode opcode, int operand = 0);
+    void emitFloat(Opcode opcode, float operand);
+    void emitBranch(Opcode opcode, const std::string &label);
+    void emitString(Opcode opcode, const std::string &text);
+    void defineLabel(const std::string &label);
+    void markFunction(const std::string &name); // .function
+    void setSourceLine(int line);               // .line
+    // Moves other's code, labels and strings after this assembler's, as if assembled here
+    void append(Assembler &&other);
+
+    bool assembleLine(const std::string &line);
+    bool assemble(std::istream &input);
+    bool finish(Program &result);
+};
+
+// Assembles a .vsm text file
+bool assembleFile(const std::string &filename, Program &program);
+// Writes program as .vsm text that assembles back to the same code
+void writeAssembly(const Program &program, std::ostream &output);
+
+// Round-trippable text for a float immediate; always contains a '.'
+std::string formatFloat(float value);
+// stringOperand is the pool entry a PRINT_STR refers to
+std::string disassemble(const Instruction &instruction, std::string_view stringOperand = {});
+
+#endif //BYTECODE_HPP
@@ -0,0 +1,585 @@
+#include "Jit.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#if JIT_SUPPORTED
+namespace {
+    enum Register : int {
+        RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+        R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+    };
+
+    // Pinned registers; all callee-saved so they survive calls into the VM
+    constexpr int FRAME = RBX;
+    constexpr int SP = R12;
+    constexpr int BP = R13;
+    constexpr int EXECUTED = R14;
+    constexpr int TABLE = R15;
+
+    enum Condition : uint8_t { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_A = 0x7, CC_NE = 0x5, CC_S = 0x8, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+    constexpr int32_t SP_OFFSET = offsetof(JitFrame, sp);
+    constexpr int32_t BP_OFFSET = offsetof(JitFrame, bp);
+    constexpr int32_t GPR_OFFSET = offsetof(JitFrame, gpr);
+    constexpr int32_t DISPATCH_OFFSET = offsetof(JitFrame, dispatch);
+    constexpr int32_t EXECUTED_OFFSET = offsetof(JitFrame, executed);
+    constexpr int32_t CHECKPOINT_OFFSET = offsetof(JitFrame, checkpoint);
+    constexpr int32_t STACK_BASE_OFFSET = offsetof(JitFrame, stackBase);
+    constexpr int32_t STACK_END_OFFSET = offsetof(JitFrame, stackEnd);
+    constexpr int32_t CALL_TOP_OFFSET = offsetof(JitFrame, callTop);
+    constexpr int32_t CALL_BOTTOM_OFFSET = offsetof(JitFrame, callBottom);
+    constexpr int32_t CALL_LIMIT_OFFSET = offsetof(JitFrame, callLimit);
+    constexpr int32_t FRAME_SIZE_OFFSET = offsetof(JitFrame, frameSize);
+    constexpr int32_t SLOT = sizeof(Value);
+
+    // Frames above this size are cleared by the VM rather than by unrolled stores
+    constexpr int MAX_INLINE_LOCALS = 16;
+
+    // Minimal x86-64 encoder for the handful of instruction forms the templates use
+    class Emitter {
+    private:
+        std::vector<uint8_t> bytes;
+
+        void byte(uint8_t value) { bytes.push_back(value); }
+        void dword(uint32_t value) {
+            for(int i = 0; i < 4; i++) byte(static_cast<uint8_t>(value >> (8 * i)));
+        }
+        void qword(uint64_t value) {
+            for(int i = 0; i < 8; i++) byte(static_cast<uint8_t>(value >> (8 * i)));
+        }
+
+        void rex(bool wide, int reg, int index, int base) {
+            const uint8_t prefix = 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+            if(prefix != 0x40) byte(prefix);
+        }
+
+        void registerOperand(int reg, int rm) {
+            byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+        }
+
+        void memoryOperand(int reg, int base, int32_t displacement) {
+            const bool needsDisplacement = displacement != 0 || (base & 7) == RBP;
+            const bool shortDisplacement = displacement >= -128 && displacement <= 127;
+            const uint8_t mod = !needsDisplacement ? 0 : shortDisplacement ? 1 : 2;
+
+            byte((mod << 6) | ((reg & 7) << 3) | (base & 7));
+            if((base & 7) == RSP) byte(0x24); // rsp/r12 bases need a SIB byte
+            if(mod == 1) byte(static_cast<uint8_t>(displacement));
+            if(mod == 2) dword(static_cast<uint32_t>(displacement));
+        }
+
+    public:
+        [[nodiscard]] size_t size() const { return bytes.size(); }
+        [[nodiscard]] const std::vector<uint8_t> &data() const { return bytes; }
+
+        void load64(int dst, int base, int32_t displacement) { rex(true, dst, 0, base); byte(0x8B); memoryOperand(dst, base, displacement); }
+        void store64(int base, int32_t displacement, int src) { rex(true, src, 0, base); byte(0x89); memoryOperand(src, base, displacement); }
+        void compare64(int reg, int base, int32_t displacement) { rex(true, reg, 0, base); byte(0x3B); memoryOperand(reg, base, displacement); }
+        void add64(int reg, int base, int32_t displacement) { rex(true, reg, 0, base); byte(0x03); memoryOperand(reg, base, displacement); }
+        void sub64(int reg, int base, int32_t displacement) { rex(true, reg, 0, base); byte(0x2B); memoryOperand(reg, base, displacement); }
+        void load32(int dst, int base, int32_t displacement) { rex(false, dst, 0, base); byte(0x8B); memoryOperand(dst, base, displacement); }
+        void store32(int base, int32_t displacement, int src) { rex(false, src, 0, base); byte(0x89); memoryOperand(src, base, displacement); }
+        void storeImmediate32(int base, int32_t displacement, int32_t immediate) {
+            rex(false, 0, 0, base); byte(0xC7); memoryOperand(0, base, displacement); dword(static_cast<uint32_t>(immediate));
+        }
+        void storeImmediate64(int base, int32_t displacement, int32_t immediate) {
+            rex(true, 0, 0, base); byte(0xC7); memoryOperand(0, base, displacement); dword(static_cast<uint32_t>(immediate));
+        }
+        void add64(int reg, int32_t immediate) { arithmeticImmediate(0, reg, immediate); }
+        void sub64(int reg, int32_t immediate) { arithmeticImmediate(5, reg, immediate); }
+        void arithmeticImmediate(int extension, int reg, int32_t immediate) {
+            rex(true, 0, 0, reg);
+            if(immediate >= -128 && immediate <= 127) {
+                byte(0x83); registerOperand(extension, reg); byte(static_cast<uint8_t>(immediate));
+            } else {
+                byte(0x81); registerOperand(extension, reg); dword(static_cast<uint32_t>(immediate));
+            }
+        }
+
+        // op r/m32, r32 for add (0x01), sub (0x29), or (0x09), cmp (0x39), test (0x85), mov (0x89)
+        void alu32(uint8_t opcode, int dst, int src) { rex(false, src, 0, dst); byte(opcode); registerOperand(src, dst); }
+        void alu64(uint8_t opcode, int dst, int src) { rex(true, src, 0, dst); byte(opcode); registerOperand(src, dst); }
+        void imul32(int dst, int src) { rex(false, dst, 0, src); byte(0x0F); byte(0xAF); registerOperand(dst, src); }
+        void idiv32(int reg) { rex(false, 0, 0, reg); byte(0xF7); registerOperand(7, reg); }
+        void cdq() { byte(0x99); }
+        void neg32(int reg) { rex(false, 0, 0, reg); byte(0xF7); registerOperand(3, reg); }
+        void cmp32(int reg, int32_t immediate) { rex(false, 0, 0, reg); byte(0x81); registerOperand(7, reg); dword(static_cast<uint32_t>(immediate)); }
+        void shl64(int reg, uint8_t count) { rex(true, 0, 0, reg); byte(0xC1); registerOperand(4, reg); byte(count); }
+        void shr64(int reg, uint8_t count) { rex(true, 0, 0, reg); byte(0xC1); registerOperand(5, reg); byte(count); }
+
+        // Only used with eax..ebx, which need no REX prefix for their low byte
+        void setcc(Condition condition, int reg) { byte(0x0F); byte(0x90 | condition); registerOperand(0, reg); }
+        void movzx8(int dst, int src) { byte(0x0F); byte(0xB6); registerOperand(dst, src); }
+
+        void mov32(int reg, int32_t immediate) { rex(false, 0, 0, reg); byte(0xB8 | (reg & 7)); dword(static_cast<uint32_t>(immediate)); }
+        void mov64(int reg, uint64_t immediate) { rex(true, 0, 0, reg); byte(0xB8 | (reg & 7)); qword(immediate); }
+
+        void push(int reg) { rex(false, 0, 0, reg); byte(0x50 | (reg & 7)); }
+        void pop(int reg) { rex(false, 0, 0, reg); byte(0x58 | (reg & 7)); }
+        void call(int reg) { rex(false, 0, 0, reg); byte(0xFF); registerOperand(2, reg); }
+        void ret() { byte(0xC3); }
+
+        // jmp [table + index * 8]
+        void jumpIndirect(int table, int index) {
+            rex(false, 0, index, table);
+            byte(0xFF);
+            byte(0x24);
+            byte(0xC0 | ((index & 7) << 3) | (table & 7));
+        }
+
+        // Branches return the position of their rel32 for patching
+        size_t jump() { byte(0xE9); dword(0); return size() - 4; }
+        size_t jump(Condition condition) { byte(0x0F); byte(0x80 | condition); dword(0); return size() - 4; }
+
+        void patch(size_t position, size_t target) {
+            const auto relative = static_cast<int32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(position + 4));
+            std::memcpy(&bytes[position], &relative, sizeof(relative));
+        }
+    };
+
+    class Translator {
+    private:
+        Emitter emitter;
+        const ProgramImage &program;
+        Jit::StepFunction step;
+
+        std::vector<size_t> nativeOffset;                 // pc -> offset of its code
+        std::vector<std::pair<size_t, int>> pcFixups;     // rel32 -> pc
+        std::vector<std::pair<size_t, int>> slowPaths;    // rel32 -> pc whose guard failed
+        std::vector<size_t> dispatchFixups;               // rel32 -> shared dispatch stub
+        std::vector<std::pair<size_t, int>> checkpoints;  // rel32 -> loop header past its checkpoint
+        std::vector<bool> loopHeader;                     // pc is the target of a backward branch
+
+        void jumpToPc(Condition condition, int pc) { pcFixups.emplace_back(emitter.jump(condition), pc); }
+        void jumpToPc(int pc) { pcFixups.emplace_back(emitter.jump(), pc); }
+
+        // The tag word of an int is zero, so one OR tests both operands
+        void loadIntOperands(int pc) {
+            emitter.load64(RAX, SP, -2 * SLOT);
+            emitter.load64(RCX, SP, -SLOT);
+            emitter.alu32(0x89, RDX, RAX);
+            emitter.alu32(0x09, RDX, RCX);
+            slowPaths.emplace_back(emitter.jump(CC_NE), pc);
+            emitter.shr64(RAX, 32);
+            emitter.shr64(RCX, 32);
+        }
+
+        void setGpr(int reg) { emitter.store64(FRAME, GPR_OFFSET, reg); }
+
+        // Calls back into the VM for the instruction at pc, leaving the next pc in eax.
+        // The VM counts the instruction itself, so the native count is taken back.
+        void emitStep(int pc) {
+            emitter.sub64(EXECUTED, 1);
+            emitter.store64(FRAME, SP_OFFSET, SP);
+            emitter.store64(FRAME, BP_OFFSET, BP);
+            emitter.store64(FRAME, EXECUTED_OFFSET, EXECUTED);
+            emitter.alu64(0x89, RDI, FRAME);
+            emitter.mov32(RSI, pc);
+            emitter.mov64(RAX, reinterpret_cast<uint64_t>(step));
+            emitter.call(RAX);
+            emitter.load64(SP, FRAME, SP_OFFSET);
+            emitter.load64(BP, FRAME, BP_OFFSET);
+            emitter.load64(EXECUTED, FRAME, EXECUTED_OFFSET);
+        }
+
+        // Continue at pc + 1 when the VM fell through, otherwise go through the table
+        void emitStepAndContinue(int pc) {
+            emitStep(pc);
+            emitter.cmp32(RAX, pc + 1);
+            dispatchFixups.push_back(emitter.jump(CC_NE));
+        }
+
+        void arithmetic(int pc, void (Emitter::*operation)(int, int), uint8_t aluOpcode) {
+            loadIntOperands(pc);
+            if(operation) (emitter.*operation)(RAX, RCX);
+            else emitter.alu32(aluOpcode, RAX, RCX);
+            emitter.shl64(RAX, 32);
+            emitter.store64(SP, -2 * SLOT, RAX);
+            setGpr(RAX);
+            emitter.sub64(SP, SLOT);
+        }
+
+        // A zero or -1 divisor is left to the VM so division faults and overflow match the interpreter
+        void division(int pc, int resultRegister) {
+            loadIntOperands(pc);
+            emitter.alu32(0x85, RCX, RCX);
+            slowPaths.emplace_back(emitter.jump(CC_E), pc);
+            emitter.cmp32(RCX, -1);
+            slowPaths.emplace_back(emitter.jump(CC_E), pc);
+            emitter.cdq();
+            emitter.idiv32(RCX);
+            emitter.shl64(resultRegister, 32);
+            emitter.store64(SP, -2 * SLOT, resultRegister);
+            setGpr(resultRegister);
+            emitter.sub64(SP, SLOT);
+        }
+
+        void comparison(int pc, Condition condition) {
+            loadIntOperands(pc);
+            emitter.alu32(0x39, RAX, RCX);
+            emitter.setcc(condition, RAX);
+            emitter.movzx8(RAX, RAX);
+            emitter.shl64(RAX, 32);
+            emitter.store64(SP, -2 * SLOT, RAX);
+            setGpr(RAX);
+            emitter.sub64(SP, SLOT);
+        }
+
+        void compareAndBranch(int pc, Condition condition, int target) {
+            loadIntOperands(pc);
+            emitter.alu32(0x39, RAX, RCX);
+            emitter.setcc(condition, RDX);
+            emitter.movzx8(RDX, RDX);
+            emitter.shl64(RDX, 32);
+            setGpr(RDX);
+            emitter.sub64(SP, 2 * SLOT);
+            emitter.alu64(0x85, RDX, RDX);
+            jumpToPc(CC_E, target);
+        }
+
+        // brz/brt on an int flag; anything else goes through the VM for its warning
+        void conditionalBranch(int pc, int target, bool branchIfOne) {
+            emitter.load64(RAX, SP, -SLOT);
+            emitter.alu32(0x85, RAX, RAX);
+            slowPaths.emplace_back(emitter.jump(CC_NE), pc);
+            setGpr(RAX);
+            emitter.sub64(SP, SLOT);
+            emitter.shr64(RAX, 32);
+            if(branchIfOne) {
+                emitter.cmp32(RAX, 1);
+                jumpToPc(CC_E, target);
+            } else {
+                emitter.alu32(0x85, RAX, RAX);
+                jumpToPc(CC_E, target);
+            }
+        }
+
+        // Saves the return pc, bp (as a slot index) and frame size, then gives the callee an empty frame
+        void call(int pc, int target) {
+            emitter.load64(RAX, FRAME, CALL_TOP_OFFSET);
+            emitter.compare64(RAX, FRAME, CALL_LIMIT_OFFSET);
+            slowPaths.emplace_back(emitter.jump(CC_AE), pc);
+            emitter.storeImmediate32(RAX, offsetof(CallFrame, returnAddress), pc + 1);
+            emitter.alu64(0x89, RCX, BP);
+            emitter.sub64(RCX, FRAME, STACK_BASE_OFFSET);
+            emitter.shr64(RCX, 3);
+            emitter.store32(RAX, offsetof(CallFrame, basePointer), RCX);
+            emitter.load32(RCX, FRAME, FRAME_SIZE_OFFSET);
+            emitter.store32(RAX, offsetof(CallFrame, frameSize), RCX);
+            emitter.add64(RAX, sizeof(CallFrame));
+            emitter.store64(FRAME, CALL_TOP_OFFSET, RAX);
+            emitter.alu64(0x89, BP, SP);
+            emitter.storeImmediate32(FRAME, FRAME_SIZE_OFFSET, 0);
+            jumpToPc(target);
+        }
+
+        // Out-of-range frames take the VM's path, which reports the underflow or overflow
+        void enter(int pc, int params, int size) {
+            if(size - params > MAX_INLINE_LOCALS) {
+                emitStepAndContinue(pc);
+                return;
+            }
+            emitter.alu64(0x89, RAX, SP);
+            emitter.sub64(RAX, params * SLOT);
+            emitter.compare64(RAX, FRAME, STACK_BASE_OFFSET);
+            slowPaths.emplace_back(emitter.jump(CC_B), pc);
+            emitter.alu64(0x89, RCX, RAX);
+            emitter.add64(RCX, std::max(size, 1) * SLOT);
+            emitter.compare64(RCX, FRAME, STACK_END_OFFSET);
+            slowPaths.emplace_back(emitter.jump(CC_A), pc);
+            for(int local = params; local < size; local++) {
+                emitter.storeImmediate64(RAX, local * SLOT, 0); // Value(0) is all zero bits
+            }
+            emitter.alu64(0x89, BP, RAX);
+            emitter.alu64(0x89, SP, RAX);
+            emitter.add64(SP, size * SLOT);
+            emitter.storeImmediate32(FRAME, FRAME_SIZE_OFFSET, size);
+        }
+
+        // Returning from the outermost frame halts, which only the VM can do
+        void ret(int pc, bool withValue) {
+            emitter.load64(RAX, FRAME, CALL_TOP_OFFSET);
+            emitter.compare64(RAX, FRAME, CALL_BOTTOM_OFFSET);
+            slowPaths.emplace_back(emitter.jump(CC_E), pc);
+            if(withValue) {
+                emitter.load64(RDX, SP, -SLOT);
+                setGpr(RDX);
+            }
+            emitter.sub64(RAX, sizeof(CallFrame));
+            emitter.store64(FRAME, CALL_TOP_OFFSET, RAX);
+            emitter.alu64(0x89, SP, BP);
+            emitter.load32(RCX, RAX, offsetof(CallFrame, basePointer));
+            emitter.shl64(RCX, 3);
+            emitter.add64(RCX, FRAME, STACK_BASE_OFFSET);
+            emitter.alu64(0x89, BP, RCX);
+            emitter.load32(RCX, RAX, offsetof(CallFrame, frameSize));
+            emitter.store32(FRAME, FRAME_SIZE_OFFSET, RCX);
+            if(withValue) {
+                emitter.store64(SP, 0, RDX);
+                emitter.add64(SP, SLOT);
+            }
+            emitter.load32(RAX, RAX, offsetof(CallFrame, returnAddress));
+            dispatchFixups.push_back(emitter.jump());
+        }
+
+        // One 64-bit store, so a following 64-bit load of the slot can be store-forwarded
+        void pushImmediate(Value::Type type, int32_t payload) {
+            emitter.mov64(RAX, (uint64_t{static_cast<uint32_t>(payload)} << 32) | static_cast<uint32_t>(type));
+            emitter.store64(SP, 0, RAX);
+            setGpr(RAX);
+            emitter.add64(SP, SLOT);
+        }
+
+        void translate(int pc, const Instruction &instruction) {
+            const int operand = instruction.operand;
+            if(loopHeader[pc]) {
+                emitter.compare64(EXECUTED, FRAME, CHECKPOINT_OFFSET);
+                checkpoints.emplace_back(emitter.jump(CC_A), pc);
+            }
+            emitter.add64(EXECUTED, 1);
+
+            // Quickened *_II forms share the generic templates, which check the tags themselves
+            switch(ProgramImage::opcode(instruction)) {
+                case Opcode::PUSH_INT: pushImmediate(Value::Type::INT, operand); break;
+                case Opcode::PUSH_FLOAT: pushImmediate(Value::Type::FLOAT, operand); break;
+                case Opcode::POP:
+                    emitter.load64(RAX, SP, -SLOT);
+                    setGpr(RAX);
+                    emitter.sub64(SP, SLOT);
+                    break;
+                case Opcode::DUP:
+                    emitter.load64(RAX, SP, -SLOT);
+                    emitter.store64(SP, 0, RAX);
+                    setGpr(RAX);
+                    emitter.add64(SP, SLOT);
+                    break;
+                case Opcode::LOAD_LOCAL:
+                    emitter.load64(RAX, BP, operand * SLOT);
+                    emitter.store64(SP, 0, RAX);
+                    setGpr(RAX);
+                    emitter.add64(SP, SLOT);
+                    break;
+                case Opcode::STORE_LOCAL:
+                    emitter.load64(RAX, SP, -SLOT);
+                    emitter.store64(BP, operand * SLOT, RAX);
+                    setGpr(RAX);
+                    break;
+                case Opcode::JUMP: jumpToPc(operand); break;
+                case Opcode::CALL: call(pc, operand); break;
+                case Opcode::ENTER: enter(pc, enterParams(operand), enterFrameSize(operand)); break;
+                case Opcode::RET: ret(pc, false); break;
+                case Opcode::RETV: ret(pc, true); break;
+                case Opcode::BRZ: conditionalBranch(pc, operand, false); break;
+                case Opcode::BRT: conditionalBranch(pc, operand, true); break;
+
+                case Opcode::EQ_BRZ:
+                case Opcode::EQ_BRZ_II: compareAndBranch(pc, CC_E, operand); break;
+                case Opcode::NEQ_BRZ:
+                case Opcode::NEQ_BRZ_II: compareAndBranch(pc, CC_NE, operand); break;
+                case Opcode::LT_BRZ:
+                case Opcode::LT_BRZ_II: compareAndBranch(pc, CC_L, operand); break;
+                case Opcode::LTE_BRZ:
+                case Opcode::LTE_BRZ_II: compareAndBranch(pc, CC_LE, operand); break;
+                case Opcode::GT_BRZ:
+                case Opcode::GT_BRZ_II: compareAndBranch(pc, CC_G, operand); break;
+                case Opcode::GTE_BRZ:
+                case Opcode::GTE_BRZ_II: compareAndBranch(pc, CC_GE, operand); break;
+
+                case Opcode::NEG:
+                    emitter.load64(RAX, SP, -SLOT);
+                    emitter.alu32(0x85, RAX, RAX);
+                    slowPaths.emplace_back(emitter.jump(CC_NE), pc);
+                    emitter.shr64(RAX, 32);
+                    emitter.neg32(RAX);
+                    emitter.shl64(RAX, 32);
+                    emitter.store64(SP, -SLOT, RAX);
+                    break;
+                case Opcode::ADD:
+                case Opcode::ADD_II: arithmetic(pc, nullptr, 0x01); break;
+                case Opcode::SUB:
+                case Opcode::SUB_II: arithmetic(pc, nullptr, 0x29); break;
+                case Opcode::MUL:
+                case Opcode::MUL_II: arithmetic(pc, &Emitter::imul32, 0); break;
+                case Opcode::DIV:
+                case Opcode::DIV_II: division(pc, RAX); break;
+                case Opcode::MOD: division(pc, RDX); break;
+
+                case Opcode::EQ:
+                case Opcode::EQ_II: comparison(pc, CC_E); break;
+                case Opcode::NEQ:
+                case Opcode::NEQ_II: comparison(pc, CC_NE); break;
+                case Opcode::LT:
+                case Opcode::LT_II: comparison(pc, CC_L); break;
+                case Opcode::LTE:
+                case Opcode::LTE_II: comparison(pc, CC_LE); break;
+                case Opcode::GT:
+                case Opcode::GT_II: comparison(pc, CC_G); break;
+                case Opcode::GTE:
+                case Opcode::GTE_II: comparison(pc, CC_GE); break;
+
+                default:
+                    emitStepAndContinue(pc);
+                    break;
+            }
+        }
+
+    public:
+        Translator(const ProgramImage &program, Jit::StepFunction step) : program(program), step(step) {}
+
+        // Returns the code bytes and the offset of every pc within them
+        std::vector<size_t> run(std::vector<uint8_t> &code) {
+            const int count = static_cast<int>(program.size());
+            nativeOffset.resize(count);
+
+            // Every native cycle passes through one of these; the rest of
+            // control flow goes through the VM, which checks the checkpoint itself
+            loopHeader.assign(count, false);
+            for(int pc = 0; pc < count; pc++) {
+                const Instruction &instruction = program.code()[pc];
+                if(isBranch(ProgramImage::opcode(instruction)) && instruction.operand <= pc) {
+                    loopHeader[instruction.operand] = true;
+                }
+            }
+
+            // void entry(JitFrame *frame, int32_t pc)
+            emitter.push(RBX);
+            emitter.push(R12);
+            emitter.push(R13);
+            emitter.push(R14);
+            emitter.push(R15); // Five pushes keep the stack 16-byte aligned for calls into the VM
+            emitter.alu64(0x89, FRAME, RDI);
+            emitter.load64(SP, FRAME, SP_OFFSET);
+            emitter.load64(BP, FRAME, BP_OFFSET);
+            emitter.load64(EXECUTED, FRAME, EXECUTED_OFFSET);
+            emitter.load64(TABLE, FRAME, DISPATCH_OFFSET);
+            emitter.alu32(0x89, RAX, RSI);
+            dispatchFixups.push_back(emitter.jump());
+
+            for(int pc = 0; pc < count; pc++) {
+                nativeOffset[pc] = emitter.size();
+                translate(pc, program.code()[pc]);
+            }
+
+            // Guard failures run the generic instruction in the VM
+            std::vector<std::pair<size_t, size_t>> slowPathOffsets;
+            for(const auto &[position, pc] : slowPaths) {
+                slowPathOffsets.emplace_back(position, emitter.size());
+                emitStep(pc);
+                if(pc + 1 < count) {
+                    emitter.cmp32(RAX, pc + 1);
+                    jumpToPc(CC_E, pc + 1);
+                }
+                dispatchFixups.push_back(emitter.jump());
+            }
+
+            // Running out of fuel or time is handled by the VM, which jitStep checks before stepping
+            std::vector<std::pair<size_t, size_t>> checkpointOffsets;
+            for(const auto &[position, pc] : checkpoints) {
+                checkpointOffsets.emplace_back(position, emitter.size());
+                emitter.add64(EXECUTED, 1); // emitStep takes back a count the header has not added yet
+                emitStep(pc);
+                dispatchFixups.push_back(emitter.jump());
+            }
+
+            const size_t dispatch = emitter.size();
+            emitter.alu32(0x85, RAX, RAX);
+            const size_t toExit = emitter.jump(CC_S);
+            emitter.jumpIndirect(TABLE, RAX);
+
+            const size_t exit = emitter.size();
+            emitter.store64(FRAME, SP_OFFSET, SP);
+            emitter.store64(FRAME, BP_OFFSET, BP);
+            emitter.store64(FRAME, EXECUTED_OFFSET, EXECUTED);
+            emitter.pop(R15);
+            emitter.pop(R14);
+            emitter.pop(R13);
+            emitter.pop(R12);
+            emitter.pop(RBX);
+            emitter.ret();
+
+            for(const auto &[position, pc] : pcFixups) emitter.patch(position, nativeOffset[pc]);
+            for(const auto &[position, target] : slowPathOffsets) emitter.patch(position, target);
+            for(const auto &[position, target] : checkpointOffsets) emitter.patch(position, target);
+            for(size_t position : dispatchFixups) emitter.patch(position, dispatch);
+            emitter.patch(toExit, exit);
+
+            code = emitter.data();
+            return nativeOffset;
+        }
+    };
+
+    // Generated code addresses Value halves directly: tag in the low word, payload in the high word
+    bool valueLayoutMatches() {
+        const Value intValue(5);
+        const Value floatValue(1.5f);
+        uint64_t intBits, floatBits;
+        uint32_t floatPayload;
+        const float payload = 1.5f;
+        std::memcpy(&intBits, &intValue, sizeof(intBits));
+        std::memcpy(&floatBits, &floatValue, sizeof(floatBits));
+        std::memcpy(&floatPayload, &payload, sizeof(floatPayload));
+        return intBits == (uint64_t{5} << 32) && floatBits == ((uint64_t{floatPayload} << 32) | 1);
+    }
+}
+#endif
+
+Jit::~Jit() {
+#if JIT_SUPPORTED
+    if(code) munmap(code, codeBytes);
+#endif
+}
+
+bool Jit::supported() {
+#if JIT_SUPPORTED
+    return valueLayoutMatches();
+#else
+    return false;
+#endif
+}
+
+bool Jit::compile(const ProgramImage &program, StepFunction step) {
+#if JIT_SUPPORTED
+    if(!supported() || program.size() == 0) return false;
+
+    std::vector<uint8_t> bytes;
+    Translator translator(program, step);
+    const std::vector<size_t> offsets = translator.run(bytes);
+
+    // Written while writable, then flipped to read/execute before anything runs
+    codeBytes = bytes.size();
+    code = mmap(nullptr, codeBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED) {
+        code = nullptr;
+        return false;
+    }
+    std::memcpy(code, bytes.data(), codeBytes);
+    if(mprotect(code, codeBytes, PROT_READ | PROT_EXEC) != 0) return false;
+
+    dispatchTable.clear();
+    for(size_t offset : offsets) {
+        dispatchTable.push_back(static_cast<const char *>(code) + offset);
+    }
+    return true;
+#else
+    (void)program;
+    (void)step;
+    return false;
+#endif
+}
+
+void Jit::run(JitFrame &frame, int pc) const {
+    frame.dispatch = dispatchTable.data();
+    // The entry sequence is the first thing in the buffer
+    auto entry = reinterpret_cast<void (*)(JitFrame *, int32_t)>(code);
+    entry(&frame, pc);
+}
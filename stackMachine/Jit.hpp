@@ -0,0 +1,56 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ProgramImage.hpp"
+#include "Value.hpp"
+
+class StackMachine;
+
+// VM state shared with generated code. Native code keeps sp and bp in
+// registers and writes them back here whenever it calls into the VM.
+struct JitFrame {
+    StackMachine *vm;
+    Value *sp;       // memoryStack + stackTop
+    Value *bp;       // memoryStack + basePointer
+    Value gpr;       // generalPurposeRegister
+    const void *const *dispatch; // Native entry point of every pc
+    uint64_t executed; // Instructions run so far, kept in a register by native code
+    uint64_t checkpoint; // Fuel or time slice end, compared against executed at every loop header
+    Value *stackBase, *stackEnd;   // Bounds of memoryStack that enter checks against
+    CallFrame *callTop;            // callStack + callDepth
+    CallFrame *callBottom, *callLimit;
+    int32_t frameSize;
+};
+
+// Baseline template JIT for x86-64. Every instruction is translated in
+// isolation: int/int arithmetic, comparisons, branches, calls, returns and frame
+// accesses run inline behind a tag or bounds check, and everything else (print,
+// read, float operands, ...) is handed back to the interpreter one instruction at a time.
+// Targets of backward branches check the fuel budget and time slice before running.
+class Jit {
+public:
+    // Executes the instruction at pc in the VM and returns the next pc, or a negative value to stop
+    using StepFunction = int64_t (*)(JitFrame *frame, int32_t pc);
+
+private:
+    void *code = nullptr;
+    size_t codeBytes = 0;
+    std::vector<const void *> dispatchTable;
+
+public:
+    Jit() = default;
+    ~Jit();
+    Jit(const Jit &) = delete;
+    Jit &operator=(const Jit &) = delete;
+
+    static bool supported();
+
+    bool compile(const ProgramImage &program, StepFunction step);
+    void run(JitFrame &frame, int pc) const;
+};
+
+#endif //JIT_HPP
@@ -0,0 +1,197 @@
+#include "Peephole.hpp"
+
+#include <vector>
+
+namespace {
+    // Control never falls through to the next instruction
+    bool isUnconditional(Opcode opcode) {
+        switch(opcode) {
+            case Opcode::JUMP:
+            case Opcode::RET:
+            case Opcode::RETV:
+            case Opcode::END:
+            case Opcode::END_BP:
+            case Opcode::END_TOP:
+            case Opcode::END_INT:
+            case Opcode::END_FLOAT:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Pushes one value and does nothing else
+    bool isPurePush(Opcode opcode) {
+        return opcode == Opcode::PUSH_INT || opcode == Opcode::PUSH_FLOAT || opcode == Opcode::LOAD_LOCAL;
+    }
+
+    class PeepholeOptimizer {
+    private:
+        std::vector<Instruction> &code;
+        std::vector<bool> removed;
+        std::vector<bool> branchTarget;
+        std::vector<size_t> live;
+        // ret at depth 0 and end exit with whatever the last pop left in the
+        // register, so pops can only be dropped in programs without them
+        bool registerObservable = false;
+        size_t removedCount = 0;
+
+        size_t nextLive(size_t pc) const {
+            while(pc < code.size() && removed[pc]) pc++;
+            return pc;
+        }
+
+        void remove(size_t pc) {
+            removed[pc] = true;
+            removedCount++;
+        }
+
+        bool threadBranches();
+        void findBranchTargets(const Program &program);
+        bool rewriteWindow(size_t position);
+
+    public:
+        explicit PeepholeOptimizer(std::vector<Instruction> &code) : code(code), removed(code.size(), false) {
+            // The end sentinel only counts when control can fall into it
+            size_t reachable = code.size();
+            if(reachable >= 2 && code.back().opcode == Opcode::END && isUnconditional(code[reachable - 2].opcode)) reachable--;
+            for(size_t pc = 0; pc < reachable; pc++) {
+                if(code[pc].opcode == Opcode::RET || code[pc].opcode == Opcode::END) registerObservable = true;
+            }
+        }
+
+        size_t run(Program &program);
+    };
+
+    // Points every branch at the first live instruction past any chain of jumps
+    bool PeepholeOptimizer::threadBranches() {
+        bool changed = false;
+        for(size_t pc = 0; pc < code.size(); pc++) {
+            Instruction &instruction = code[pc];
+            if(removed[pc] || !isBranch(instruction.opcode)) continue;
+
+            auto target = nextLive(static_cast<size_t>(instruction.operand));
+            if(instruction.opcode != Opcode::CALL) {
+                // Bounded, so a jump that loops onto itself ends the chain
+                for(size_t hops = 0; target < code.size() && code[target].opcode == Opcode::JUMP && hops < code.size(); hops++) {
+                    target = nextLive(static_cast<size_t>(code[target].operand));
+                }
+            }
+
+            if(target != static_cast<size_t>(instruction.operand)) {
+                instruction.operand = static_cast<int>(target);
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    void PeepholeOptimizer::findBranchTargets(const Program &program) {
+        branchTarget.assign(code.size() + 1, false);
+        branchTarget[0] = true;
+        // The end sentinel finish() appends has to stay last even when nothing reaches it
+        if(!code.empty() && code.back().opcode == Opcode::END) branchTarget[code.size() - 1] = true;
+        for(const auto &[name, entry] : program.functions) branchTarget[entry] = true;
+        for(size_t pc = 0; pc < code.size(); pc++) {
+            if(!removed[pc] && isBranch(code[pc].opcode)) branchTarget[code[pc].operand] = true;
+        }
+
+        live.clear();
+        for(size_t pc = 0; pc < code.size(); pc++) {
+            if(!removed[pc]) live.push_back(pc);
+        }
+    }
+
+    // Applies the first rule that matches the live instructions starting at live[position]
+    bool PeepholeOptimizer::rewriteWindow(size_t position) {
+        const size_t pc = live[position];
+        if(removed[pc]) return false;
+        const Instruction &first = code[pc];
+        const size_t next = position + 1 < live.size() ? live[position + 1] : code.size();
+
+        if(first.opcode == Opcode::JUMP && static_cast<size_t>(first.operand) == next) {
+            remove(pc);
+            return true;
+        }
+
+        if(isUnconditional(first.opcode)) {
+            bool changed = false;
+            for(size_t i = position + 1; i < live.size() && !branchTarget[live[i]]; i++) {
+                if(removed[live[i]]) continue;
+                remove(live[i]);
+                changed = true;
+            }
+            return changed;
+        }
+
+        if(next == code.size() || removed[next] || branchTarget[next]) return false;
+        const Instruction &second = code[next];
+
+        if(first.opcode == Opcode::STORE_LOCAL && second.opcode == Opcode::POP && position + 2 < live.size()) {
+            const size_t third = live[position + 2];
+            if(!removed[third] && !branchTarget[third] &&
+               code[third].opcode == Opcode::LOAD_LOCAL && code[third].operand == first.operand) {
+                remove(next);
+                remove(third);
+                return true;
+            }
+        }
+
+        if(first.opcode == Opcode::STORE_LOCAL && second.opcode == Opcode::STORE_LOCAL && first.operand == second.operand) {
+            remove(next);
+            return true;
+        }
+
+        if(registerObservable) return false;
+
+        if(first.opcode == Opcode::LOAD_LOCAL && second.opcode == Opcode::STORE_LOCAL && first.operand == second.operand) {
+            remove(next);
+            return true;
+        }
+
+        if(isPurePush(first.opcode) && second.opcode == Opcode::POP) {
+            remove(pc);
+            remove(next);
+            return true;
+        }
+        return false;
+    }
+
+    size_t PeepholeOptimizer::run(Program &program) {
+        bool changed = true;
+        while(changed) {
+            changed = threadBranches();
+            findBranchTargets(program);
+            for(size_t position = 0; position < live.size(); position++) {
+                if(rewriteWindow(position)) changed = true;
+            }
+        }
+
+        // Everything that pointed at a removed instruction moves to the next one kept
+        std::vector<int> newIndex(code.size() + 1);
+        std::vector<Instruction> kept;
+        std::vector<int> keptLines;
+        for(size_t pc = 0; pc < code.size(); pc++) {
+            newIndex[pc] = static_cast<int>(kept.size());
+            if(removed[pc]) continue;
+            kept.push_back(code[pc]);
+            if(pc < program.lines.size()) keptLines.push_back(program.lines[pc]);
+        }
+        newIndex[code.size()] = static_cast<int>(kept.size());
+
+        for(Instruction &instruction : kept) {
+            if(isBranch(instruction.opcode)) instruction.operand = newIndex[instruction.operand];
+        }
+        for(auto &[label, target] : program.labels) target = newIndex[target];
+        for(auto &[name, entry] : program.functions) entry = newIndex[entry];
+
+        code = std::move(kept);
+        program.lines = std::move(keptLines);
+        return removedCount;
+    }
+}
+
+size_t optimizePeephole(Program &program) {
+    PeepholeOptimizer optimizer(program.code);
+    return optimizer.run(program);
+}
@@ -0,0 +1,20 @@
+#ifndef PEEPHOLE_HPP
+#define PEEPHOLE_HPP
+
+#include <cstddef>
+
+#include "Bytecode.hpp"
+
+// Windowed clean-up of assembled code, repeated until nothing changes:
+//   - branches to a jump go straight to its final target
+//   - jumps to the next instruction are dropped
+//   - code after a jump, return or end that no branch reaches is dropped
+//   - "store_local k / pop / load_local k" keeps only the store
+//   - "load_local k / store_local k" keeps only the load, and a store repeated keeps one
+//   - a push or load_local immediately popped is dropped with its pop
+// A window never spans a branch target, and labels, function entries, source
+// lines and branch targets are moved onto the instructions that remain.
+// Returns the number of instructions removed.
+size_t optimizePeephole(Program &program);
+
+#endif //PEEPHOLE_HPP
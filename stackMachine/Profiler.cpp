@@ -0,0 +1,113 @@
+#include "Profiler.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace {
+    // toString() gives the assembler spelling, which several opcodes share
+    std::string opcodeName(Opcode opcode) {
+        switch(opcode) {
+            case Opcode::PUSH_FLOAT: return "push float";
+            case Opcode::PRINT_STR: return "print str";
+            case Opcode::END_INT: return "end int";
+            case Opcode::END_FLOAT: return "end float";
+            default: return toString(opcode);
+        }
+    }
+}
+
+uint64_t Profiler::readCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+void Profiler::attach(const ProgramImage &image) {
+    program = &image;
+    opcodes = {};
+    pcCounts.assign(image.size(), 0);
+}
+
+void Profiler::leave(Opcode opcode, uint64_t cycles) {
+    OpcodeStats &stats = opcodes[static_cast<size_t>(opcode)];
+    stats.cycles += cycles;
+
+    const int bucket = cycles == 0 ? 0 : std::min(BUCKETS - 1, static_cast<int>(std::bit_width(cycles)) - 1);
+    stats.histogram[bucket]++;
+}
+
+void Profiler::report(std::ostream &out) const {
+    uint64_t totalCount = 0;
+    uint64_t totalCycles = 0;
+    std::vector<size_t> order;
+    for(size_t op = 0; op < opcodes.size(); op++) {
+        if(opcodes[op].count == 0) continue;
+        totalCount += opcodes[op].count;
+        totalCycles += opcodes[op].cycles;
+        order.push_back(op);
+    }
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return opcodes[a].cycles > opcodes[b].cycles; });
+
+    out << "\nProfile: " << totalCount << " instructions, " << totalCycles << " cycles\n";
+    out << std::left << std::setw(12) << "Opcode" << std::right << std::setw(14) << "Count" << std::setw(16) << "Cycles"
+        << std::setw(8) << "%" << std::setw(12) << "Cycles/op" << "  Histogram (cycles: count)\n";
+
+    for(size_t op : order) {
+        const OpcodeStats &stats = opcodes[op];
+        const double share = totalCycles ? 100.0 * static_cast<double>(stats.cycles) / static_cast<double>(totalCycles) : 0.0;
+
+        out << std::left << std::setw(12) << opcodeName(static_cast<Opcode>(op)) << std::right
+            << std::setw(14) << stats.count << std::setw(16) << stats.cycles
+            << std::setw(8) << std::fixed << std::setprecision(1) << share
+            << std::setw(12) << std::setprecision(1) << static_cast<double>(stats.cycles) / static_cast<double>(stats.count) << " ";
+
+        for(int bucket = 0; bucket < BUCKETS; bucket++) {
+            if(stats.histogram[bucket] == 0) continue;
+            out << " " << (bucket == BUCKETS - 1 ? ">=" : "<") << (uint64_t{1} << (bucket == BUCKETS - 1 ? bucket : bucket + 1))
+                << ":" << stats.histogram[bucket];
+        }
+        out << "\n";
+    }
+
+    if(!program) return;
+
+    // Every pc is attributed to the closest label at or before it
+    std::vector<std::pair<int, std::string>> labels;
+    for(size_t i = 0; i < program->labelTableSize(); i++) {
+        if(program->labelIsFunction(i)) continue;
+        labels.emplace_back(program->labelTarget(i), std::string(program->labelName(i)));
+    }
+    std::sort(labels.begin(), labels.end());
+
+    std::vector<std::pair<uint64_t, std::string>> perLabel;
+    uint64_t unlabelled = 0;
+    size_t next = 0;
+    for(size_t pc = 0; pc < pcCounts.size(); pc++) {
+        while(next < labels.size() && labels[next].first <= static_cast<int>(pc)) {
+            perLabel.emplace_back(0, labels[next].second);
+            next++;
+        }
+        if(perLabel.empty()) unlabelled += pcCounts[pc];
+        else perLabel.back().first += pcCounts[pc];
+    }
+    if(unlabelled) perLabel.emplace_back(unlabelled, "(entry)");
+    std::sort(perLabel.begin(), perLabel.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    out << "\n" << std::left << std::setw(24) << "Label" << std::right << std::setw(14) << "Instructions" << std::setw(8) << "%" << "\n";
+    for(const auto &[count, label] : perLabel) {
+        if(count == 0) continue;
+        out << std::left << std::setw(24) << label << std::right << std::setw(14) << count << std::setw(8) << std::fixed
+            << std::setprecision(1) << (totalCount ? 100.0 * static_cast<double>(count) / static_cast<double>(totalCount) : 0.0) << "\n";
+    }
+    out << std::defaultfloat;
+}
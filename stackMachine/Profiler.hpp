@@ -0,0 +1,51 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "Bytecode.hpp"
+#include "ProgramImage.hpp"
+
+// Per-opcode execution counts and cycle costs for --profile. Cycles come from
+// rdtsc where available (nanoseconds elsewhere) and are bucketed by power of
+// two, so a handful of slow outliers (print, a cold page) stay visible next
+// to the mean. The report goes to stderr so program output is unchanged.
+class Profiler {
+public:
+    static constexpr int BUCKETS = 16; // Bucket b holds costs in [2^b, 2^(b+1)), the last one everything above
+
+private:
+    struct OpcodeStats {
+        uint64_t count = 0;
+        uint64_t cycles = 0;
+        std::array<uint64_t, BUCKETS> histogram{};
+    };
+
+    std::array<OpcodeStats, static_cast<size_t>(Opcode::OPCODE_COUNT)> opcodes{};
+    std::vector<uint64_t> pcCounts;
+    const ProgramImage *program = nullptr;
+
+public:
+    Profiler() = default;
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+
+    static uint64_t readCycleCounter();
+
+    // Starts a fresh set of counters for a run of image
+    void attach(const ProgramImage &image);
+
+    void enter(int pc, Opcode opcode) {
+        opcodes[static_cast<size_t>(opcode)].count++;
+        pcCounts[pc]++;
+    }
+
+    void leave(Opcode opcode, uint64_t cycles);
+
+    void report(std::ostream &out) const;
+};
+
+#endif //PROFILER_HPP
@@ -0,0 +1,292 @@
+#include "ProgramImage.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <tuple>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    size_t align8(size_t offset) {
+        return (offset + 7) & ~static_cast<size_t>(7);
+    }
+
+    // FNV-1a
+    uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+        const auto *bytes = static_cast<const unsigned char *>(data);
+        for(size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3;
+        }
+        return hash;
+    }
+
+    bool invalid(const std::string &reason) {
+        std::cerr << "Error: invalid program image: " << reason << std::endl;
+        return false;
+    }
+}
+
+ProgramImage::~ProgramImage() {
+    release();
+}
+
+void ProgramImage::release() {
+    if(mapping) munmap(mapping, mappingBytes);
+    mapping = nullptr;
+    mappingBytes = 0;
+    buffer.clear();
+
+    instructions = nullptr;
+    instructionCount = stringCount = labelCount = 0;
+    strings = nullptr;
+    labels = nullptr;
+    stringData = nullptr;
+    lines = nullptr;
+    deoptimized.reset();
+    fingerprintValue = 0;
+}
+
+std::vector<char> ProgramImage::serialize(const Program &program, bool includeDebug) {
+    std::string stringBytes;
+    auto intern = [&stringBytes](const std::string &text) {
+        ImageString entry{static_cast<uint32_t>(stringBytes.size()), static_cast<uint32_t>(text.size())};
+        stringBytes += text;
+        return entry;
+    };
+
+    std::vector<ImageString> pool;
+    for(const auto &text : program.strings) {
+        pool.push_back(intern(text));
+    }
+
+    // Sorted so the same program always produces the same bytes
+    std::vector<std::tuple<int, uint32_t, std::string>> sortedLabels;
+    for(const auto &[name, target] : program.labels) {
+        sortedLabels.emplace_back(target, ImageLabel::LABEL, name);
+    }
+    for(const auto &[name, target] : program.functions) {
+        sortedLabels.emplace_back(target, ImageLabel::FUNCTION, name);
+    }
+    std::sort(sortedLabels.begin(), sortedLabels.end());
+
+    std::vector<ImageLabel> labelTable;
+    for(const auto &[target, kind, name] : sortedLabels) {
+        labelTable.push_back({intern(name), target, kind});
+    }
+
+    includeDebug = includeDebug && program.lines.size() == program.code.size();
+
+    ImageHeader header{};
+    std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.version = VERSION;
+    header.flags = includeDebug ? HAS_DEBUG : 0;
+    header.byteOrder = BYTE_ORDER_MARK;
+
+    size_t offset = align8(sizeof(ImageHeader));
+    header.instructionCount = static_cast<uint32_t>(program.code.size());
+    header.instructionOffset = static_cast<uint32_t>(offset);
+    offset = align8(offset + program.code.size() * sizeof(Instruction));
+
+    header.stringCount = static_cast<uint32_t>(pool.size());
+    header.stringOffset = static_cast<uint32_t>(offset);
+    offset = align8(offset + pool.size() * sizeof(ImageString));
+
+    header.labelCount = static_cast<uint32_t>(labelTable.size());
+    header.labelOffset = static_cast<uint32_t>(offset);
+    offset = align8(offset + labelTable.size() * sizeof(ImageLabel));
+
+    header.stringDataSize = static_cast<uint32_t>(stringBytes.size());
+    header.stringDataOffset = static_cast<uint32_t>(offset);
+    offset = align8(offset + stringBytes.size());
+
+    if(includeDebug) {
+        header.debugOffset = static_cast<uint32_t>(offset);
+        offset = align8(offset + program.code.size() * sizeof(int32_t));
+    }
+    header.fileSize = static_cast<uint32_t>(offset);
+
+    std::vector<char> bytes(offset, 0);
+    std::memcpy(bytes.data(), &header, sizeof(header));
+
+    // Field by field, so padding inside Instruction is always written as zero
+    auto *code = reinterpret_cast<Instruction *>(bytes.data() + header.instructionOffset);
+    for(size_t i = 0; i < program.code.size(); i++) {
+        code[i].opcode = program.code[i].opcode;
+        code[i].operand = program.code[i].operand;
+    }
+
+    if(!pool.empty()) std::memcpy(bytes.data() + header.stringOffset, pool.data(), pool.size() * sizeof(ImageString));
+    if(!labelTable.empty()) std::memcpy(bytes.data() + header.labelOffset, labelTable.data(), labelTable.size() * sizeof(ImageLabel));
+    std::memcpy(bytes.data() + header.stringDataOffset, stringBytes.data(), stringBytes.size());
+
+    if(includeDebug) {
+        auto *lineTable = reinterpret_cast<int32_t *>(bytes.data() + header.debugOffset);
+        std::copy(program.lines.begin(), program.lines.end(), lineTable);
+    }
+
+    return bytes;
+}
+
+bool ProgramImage::writeFile(const Program &program, const std::string &filename, bool includeDebug) {
+    const std::vector<char> bytes = serialize(program, includeDebug);
+
+    std::ofstream imageFile(filename, std::ios::binary | std::ios::trunc);
+    if(!imageFile.is_open()) {
+        std::cerr << "Unable to open file " << filename << std::endl;
+        return false;
+    }
+
+    imageFile.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    return static_cast<bool>(imageFile);
+}
+
+bool ProgramImage::isImageFile(const std::string &filename) {
+    std::ifstream file(filename, std::ios::binary);
+    char magic[sizeof(MAGIC)] = {};
+    file.read(magic, sizeof(magic));
+    return file && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+// Checks everything the dispatch loop trusts, then points the views into the bytes
+bool ProgramImage::bind(char *bytes, size_t size) {
+    if(size < sizeof(ImageHeader)) return invalid("truncated header");
+
+    ImageHeader header{};
+    std::memcpy(&header, bytes, sizeof(header));
+    if(std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) return invalid("bad magic");
+    if(header.version != VERSION) return invalid("unsupported version " + std::to_string(header.version));
+    if(header.byteOrder != BYTE_ORDER_MARK) return invalid("written on a machine with a different byte order");
+    if(header.fileSize != size) return invalid("size does not match the header");
+
+    auto fits = [size](uint64_t offset, uint64_t count, uint64_t elementSize) {
+        return offset % 8 == 0 && offset + count * elementSize <= size;
+    };
+    if(!fits(header.instructionOffset, header.instructionCount, sizeof(Instruction)) ||
+       !fits(header.stringOffset, header.stringCount, sizeof(ImageString)) ||
+       !fits(header.labelOffset, header.labelCount, sizeof(ImageLabel)) ||
+       !fits(header.stringDataOffset, header.stringDataSize, 1)) {
+        return invalid("section out of bounds");
+    }
+    if((header.flags & HAS_DEBUG) && !fits(header.debugOffset, header.instructionCount, sizeof(int32_t))) {
+        return invalid("debug section out of bounds");
+    }
+
+    auto *code = reinterpret_cast<Instruction *>(bytes + header.instructionOffset);
+    const auto *pool = reinterpret_cast<const ImageString *>(bytes + header.stringOffset);
+    const auto *labelTable = reinterpret_cast<const ImageLabel *>(bytes + header.labelOffset);
+    const int count = static_cast<int>(header.instructionCount);
+
+    if(count == 0 || code[count - 1].opcode != Opcode::END) return invalid("program must end with the end sentinel");
+
+    for(int pc = 0; pc < count; pc++) {
+        const Instruction &instruction = code[pc];
+        // Quickened forms only ever exist in memory
+        if(instruction.opcode >= Opcode::ADD_II) {
+            return invalid("bad opcode " + std::to_string(static_cast<int>(instruction.opcode)) + " at " + std::to_string(pc));
+        }
+        if(isBranch(instruction.opcode) && (instruction.operand < 0 || instruction.operand >= count)) {
+            return invalid("branch target out of range at " + std::to_string(pc));
+        }
+        if(instruction.opcode == Opcode::PRINT_STR && (instruction.operand < 0 || instruction.operand >= static_cast<int>(header.stringCount))) {
+            return invalid("string index out of range at " + std::to_string(pc));
+        }
+    }
+
+    auto inStringData = [&header](const ImageString &entry) {
+        return static_cast<uint64_t>(entry.offset) + entry.length <= header.stringDataSize;
+    };
+    for(uint32_t i = 0; i < header.stringCount; i++) {
+        if(!inStringData(pool[i])) return invalid("string out of bounds");
+    }
+    for(uint32_t i = 0; i < header.labelCount; i++) {
+        if(!inStringData(labelTable[i].name) || labelTable[i].target < 0 || labelTable[i].target >= count ||
+           labelTable[i].kind > ImageLabel::FUNCTION) {
+            return invalid("label out of bounds");
+        }
+    }
+
+    instructions = code;
+    instructionCount = header.instructionCount;
+    strings = pool;
+    stringCount = header.stringCount;
+    labels = labelTable;
+    labelCount = header.labelCount;
+    stringData = bytes + header.stringDataOffset;
+    lines = (header.flags & HAS_DEBUG) ? reinterpret_cast<const int32_t *>(bytes + header.debugOffset) : nullptr;
+    deoptimized = std::make_unique<std::atomic<bool>[]>(instructionCount);
+
+    fingerprintValue = 0xcbf29ce484222325;
+    for(int pc = 0; pc < count; pc++) {
+        fingerprintValue = hashBytes(fingerprintValue, &code[pc].opcode, sizeof(code[pc].opcode));
+        fingerprintValue = hashBytes(fingerprintValue, &code[pc].operand, sizeof(code[pc].operand));
+    }
+    fingerprintValue = hashBytes(fingerprintValue, stringData, header.stringDataSize);
+    return true;
+}
+
+// Quickening: generic ops that see int/int operands rewrite themselves to the
+// matching *_II opcode. The quickened form guards on the tags and rewrites the
+// instruction back for good the first time the guard fails.
+void ProgramImage::quicken(size_t pc, Opcode quickened) {
+    if(deoptimized[pc].load(std::memory_order_relaxed)) return;
+    std::atomic_ref(instructions[pc].opcode).store(quickened, std::memory_order_relaxed);
+}
+
+void ProgramImage::deoptimize(size_t pc, Opcode generic) {
+    deoptimized[pc].store(true, std::memory_order_relaxed);
+    std::atomic_ref(instructions[pc].opcode).store(generic, std::memory_order_relaxed);
+}
+
+bool ProgramImage::load(const Program &program) {
+    release();
+
+    const std::vector<char> bytes = serialize(program);
+    buffer.resize((bytes.size() + 7) / 8);
+    std::memcpy(buffer.data(), bytes.data(), bytes.size());
+
+    return bind(reinterpret_cast<char *>(buffer.data()), bytes.size());
+}
+
+bool ProgramImage::loadFile(const std::string &filename) {
+    release();
+
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        std::cerr << "Unable to open file " << filename << std::endl;
+        return false;
+    }
+
+    struct stat status{};
+    if(fstat(fd, &status) != 0 || status.st_size <= 0) {
+        close(fd);
+        return invalid(filename + " is empty");
+    }
+
+    // Private and writable: the file is never modified, quickened pages are copied on write
+    mappingBytes = static_cast<size_t>(status.st_size);
+    mapping = mmap(nullptr, mappingBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) {
+        mapping = nullptr;
+        std::cerr << "Unable to map file " << filename << std::endl;
+        return false;
+    }
+
+    if(!bind(static_cast<char *>(mapping), mappingBytes)) {
+        release();
+        return false;
+    }
+    return true;
+}
+
+std::string ProgramImage::disassemble(size_t pc) const {
+    const Instruction &instruction = instructions[pc];
+    return ::disassemble(instruction, instruction.opcode == Opcode::PRINT_STR ? string(instruction.operand) : std::string_view{});
+}
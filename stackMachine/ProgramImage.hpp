@@ -0,0 +1,124 @@
+#ifndef PROGRAMIMAGE_HPP
+#define PROGRAMIMAGE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Bytecode.hpp"
+
+// Binary .vsmb layout. Every section is 8-byte aligned and addressed by a byte
+// offset from the start of the file, so a mapped file is used exactly as is.
+// Values are in native byte order; byteOrder rejects images from the other kind.
+//
+//   ImageHeader
+//   Instruction[instructionCount]      opcode stream with resolved branch targets
+//   ImageString[stringCount]           constant pool: print "..." arguments, escapes decoded
+//   ImageLabel[labelCount]             labels and .function entries
+//   char[stringDataSize]               bytes of pool strings and label names
+//   int32_t[instructionCount]          debug: source line per instruction (optional)
+struct ImageHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+    uint32_t byteOrder;
+    uint32_t fileSize;
+    uint32_t instructionCount, instructionOffset;
+    uint32_t stringCount, stringOffset;
+    uint32_t labelCount, labelOffset;
+    uint32_t stringDataSize, stringDataOffset;
+    uint32_t debugOffset;
+    uint32_t reserved;
+};
+
+struct ImageString {
+    uint32_t offset; // Into the string data
+    uint32_t length;
+};
+
+struct ImageLabel {
+    enum Kind : uint32_t { LABEL = 0, FUNCTION = 1 };
+
+    ImageString name;
+    int32_t target;
+    uint32_t kind;
+};
+
+// Executable form of a program. Images either own a serialized buffer built
+// from an assembled Program or execute a binary file mapped in place. The
+// mapping is private, so quickening only copies the pages it rewrites.
+//
+// Once loaded an image is shared: any number of VMs, on any threads, run it
+// at the same time. Quickening is the only write, and it goes through relaxed
+// atomics on the opcode byte; a lost race only costs one extra rewrite, since
+// quickened forms check their operand tags anyway.
+class ProgramImage {
+private:
+    std::vector<uint64_t> buffer; // 8-byte aligned storage for in-memory images
+    void *mapping = nullptr;
+    size_t mappingBytes = 0;
+
+    Instruction *instructions = nullptr;
+    size_t instructionCount = 0;
+    const ImageString *strings = nullptr;
+    size_t stringCount = 0;
+    const ImageLabel *labels = nullptr;
+    size_t labelCount = 0;
+    const char *stringData = nullptr;
+    const int32_t *lines = nullptr;
+    std::unique_ptr<std::atomic<bool>[]> deoptimized; // pcs whose quickened form failed its type guard
+    uint64_t fingerprintValue = 0;
+
+    bool bind(char *bytes, size_t size);
+    void release();
+
+public:
+    static constexpr char MAGIC[4] = {'V', 'S', 'M', 'B'};
+    static constexpr uint16_t VERSION = 3; // 2: pool strings are stored with escapes decoded, 3: enter opcode
+    static constexpr uint16_t HAS_DEBUG = 1;
+
+    ProgramImage() = default;
+    ~ProgramImage();
+    ProgramImage(const ProgramImage &) = delete;
+    ProgramImage &operator=(const ProgramImage &) = delete;
+
+    static std::vector<char> serialize(const Program &program, bool includeDebug = true);
+    static bool writeFile(const Program &program, const std::string &filename, bool includeDebug = true);
+    static bool isImageFile(const std::string &filename);
+
+    bool load(const Program &program);
+    bool loadFile(const std::string &filename);
+
+    [[nodiscard]] const Instruction *code() const { return instructions; }
+    // Hash of the code and strings as loaded, before any quickening; tells snapshots which program they belong to
+    [[nodiscard]] uint64_t fingerprint() const { return fingerprintValue; }
+    [[nodiscard]] size_t size() const { return instructionCount; }
+
+    // Use instead of instruction.opcode wherever another thread may be quickening
+    static Opcode opcode(const Instruction &instruction) {
+        return std::atomic_ref(const_cast<Opcode &>(instruction.opcode)).load(std::memory_order_relaxed);
+    }
+    void quicken(size_t pc, Opcode quickened);
+    void deoptimize(size_t pc, Opcode generic);
+    [[nodiscard]] std::string_view string(int index) const {
+        return {stringData + strings[index].offset, strings[index].length};
+    }
+
+    [[nodiscard]] size_t labelTableSize() const { return labelCount; }
+    [[nodiscard]] std::string_view labelName(size_t index) const {
+        return {stringData + labels[index].name.offset, labels[index].name.length};
+    }
+    [[nodiscard]] int labelTarget(size_t index) const { return labels[index].target; }
+    [[nodiscard]] bool labelIsFunction(size_t index) const { return labels[index].kind == ImageLabel::FUNCTION; }
+
+    // Source line of an instruction, 0 when the image carries no debug section
+    [[nodiscard]] int sourceLine(size_t pc) const { return lines ? lines[pc] : 0; }
+
+    [[nodiscard]] std::string disassemble(size_t pc) const;
+};
+
+#endif //PROGRAMIMAGE_HPP
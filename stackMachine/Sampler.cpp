@@ -0,0 +1,120 @@
+#include "Sampler.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <sys/time.h>
+
+namespace {
+    // SIGPROF lands on whichever thread used the CPU; only the sampling one records
+    thread_local Sampler *activeSampler = nullptr;
+
+    void profileSignalHandler(int) {
+        if(activeSampler) activeSampler->takeSample();
+    }
+
+    void setTimer(int intervalUs) {
+        itimerval timer{};
+        timer.it_interval.tv_usec = intervalUs;
+        timer.it_value.tv_usec = intervalUs;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+}
+
+Sampler::Sampler(std::string outputFile) : outputFile(std::move(outputFile)) {}
+
+Sampler::~Sampler() {
+    finish();
+}
+
+void Sampler::start(const ProgramImage &image) {
+    program = &image;
+    // Left uninitialised so only the pages samples land in are ever touched
+    buffer.reset(new int32_t[BUFFER_WORDS]);
+    used = 0;
+    dropped = 0;
+    depth = 0;
+    activeSampler = this;
+
+    struct sigaction action{};
+    action.sa_handler = profileSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    running = true;
+    setTimer(INTERVAL_US);
+}
+
+void Sampler::takeSample() {
+    const int frames = std::min<int>(static_cast<int>(depth), MAX_DEPTH) + 1;
+    if(used + frames + 1 > BUFFER_WORDS) {
+        dropped = dropped + 1;
+        return;
+    }
+
+    int32_t *sample = buffer.get() + used;
+    sample[0] = frames;
+    for(int i = 0; i < frames - 1; i++) sample[i + 1] = callSites[i];
+    sample[frames] = currentPc;
+    used = used + frames + 1;
+}
+
+void Sampler::finish() {
+    if(!running) return;
+    running = false;
+    setTimer(0);
+    if(activeSampler == this) activeSampler = nullptr;
+
+    std::ofstream out(outputFile);
+    if(!out.is_open()) {
+        std::cerr << "Unable to open file " << outputFile << std::endl;
+        return;
+    }
+    writeFoldedStacks(out);
+}
+
+void Sampler::writeFoldedStacks(std::ostream &out) const {
+    // Frames are named after the enclosing .function, or the enclosing label
+    // for hand-written programs without any
+    std::vector<std::pair<int, std::string>> scopes;
+    bool haveFunctions = false;
+    for(size_t i = 0; i < program->labelTableSize(); i++) {
+        haveFunctions = haveFunctions || program->labelIsFunction(i);
+    }
+    for(size_t i = 0; i < program->labelTableSize(); i++) {
+        if(program->labelIsFunction(i) != haveFunctions) continue;
+        scopes.emplace_back(program->labelTarget(i), std::string(program->labelName(i)));
+    }
+    std::sort(scopes.begin(), scopes.end());
+
+    auto frameName = [&](int pc) {
+        auto it = std::upper_bound(scopes.begin(), scopes.end(), pc, [](int value, const auto &scope) { return value < scope.first; });
+        std::string name = it == scopes.begin() ? "(entry)" : std::prev(it)->second;
+        const int line = program->sourceLine(pc);
+        if(line > 0) name.append(":").append(std::to_string(line));
+        return name;
+    };
+
+    std::map<std::string, uint64_t> stacks;
+    for(size_t position = 0; position < used;) {
+        const int frames = buffer[position];
+        std::string stack;
+        for(int i = 1; i <= frames; i++) {
+            if(i > 1) stack += ";";
+            stack += frameName(buffer[position + i]);
+        }
+        stacks[stack]++;
+        position += frames + 1;
+    }
+
+    for(const auto &[stack, count] : stacks) {
+        out << stack << " " << count << "\n";
+    }
+    if(dropped) {
+        std::cerr << "Warning: sample buffer full, " << dropped << " samples dropped" << std::endl;
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+#include "ProgramImage.hpp"
+
+// Source-level sampling profiler for --sample. A SIGPROF timer snapshots the
+// current pc and a shadow stack of call sites; after the run every sample is mapped
+// through the image's function and line tables and written as folded stacks
+// ("main:12;fact:5;fact:7 42"), the input format of flamegraph tools.
+class Sampler {
+public:
+    static constexpr int MAX_DEPTH = 64;          // Deeper calls keep counting but are not recorded
+    static constexpr int INTERVAL_US = 1000;      // CPU time between samples
+    static constexpr size_t BUFFER_WORDS = 1 << 22;
+
+private:
+    std::string outputFile;
+    const ProgramImage *program = nullptr;
+
+    // Written by the VM loop, read by the signal handler on the same thread
+    volatile sig_atomic_t currentPc = 0;
+    volatile sig_atomic_t depth = 0;
+    int32_t callSites[MAX_DEPTH] = {};
+
+    // Samples as [frame count, frames...], appended only by the handler
+    std::unique_ptr<int32_t[]> buffer;
+    volatile size_t used = 0;
+    volatile size_t dropped = 0;
+    bool running = false;
+
+    void writeFoldedStacks(std::ostream &out) const;
+
+public:
+    explicit Sampler(std::string outputFile);
+    ~Sampler();
+    Sampler(const Sampler &) = delete;
+    Sampler &operator=(const Sampler &) = delete;
+
+    void start(const ProgramImage &image);
+    // Disarms the timer and writes the report; runs after each run or on destruction
+    void finish();
+
+    void setPc(int pc) { currentPc = pc; }
+    void pushCall(int callSite) {
+        if(depth < MAX_DEPTH) callSites[depth] = callSite;
+        depth = depth + 1;
+    }
+    void popCall() {
+        if(depth > 0) depth = depth - 1;
+    }
+
+    void takeSample(); // Signal handler only
+};
+
+#endif //SAMPLER_HPP
@@ -0,0 +1,190 @@
+#include "Snapshot.hpp"
+#include "StackMachine.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    size_t roundToPage(size_t bytes) {
+        const auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return (bytes + pageSize - 1) / pageSize * pageSize;
+    }
+
+    bool invalid(const std::string &reason) {
+        std::cerr << "Error: invalid snapshot: " << reason << std::endl;
+        return false;
+    }
+}
+
+void StackMachine::suspendAtNextRead() {
+    suspendBeforeRead = true;
+    output.hold(true);
+}
+
+// Slots above the top are only live as locals of the current frame, so the
+// stack is saved up to the highest local the program can reach from bp
+bool StackMachine::saveSnapshot(const std::string &filename) const {
+    if(!program || (runResult.status != RunStatus::YIELDED && runResult.status != RunStatus::BLOCKED)) {
+        std::cerr << "Error: only a suspended run can be snapshotted" << std::endl;
+        return false;
+    }
+
+    int highestLocal = -1;
+    for(size_t pc = 0; pc < program->size(); pc++) {
+        const Instruction &instruction = code[pc];
+        const Opcode opcode = ProgramImage::opcode(instruction);
+        if(opcode == Opcode::LOAD_LOCAL || opcode == Opcode::STORE_LOCAL) {
+            highestLocal = std::max(highestLocal, instruction.operand);
+        }
+    }
+    const size_t liveSlots = std::min<size_t>(stackRegion.size(), std::max(stackTop, basePointer + highestLocal + 1));
+    const std::string pendingOutput = output.pending();
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, Snapshot::MAGIC, sizeof(header.magic));
+    header.version = Snapshot::VERSION;
+    header.status = static_cast<uint16_t>(runResult.status);
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.programFingerprint = program->fingerprint();
+    header.instructionsExecuted = instructionsExecuted;
+    header.generalPurposeRegister = std::bit_cast<uint64_t>(generalPurposeRegister);
+    header.instructionCounter = instructionCounter;
+    header.blockStart = blockStart;
+    header.stackTop = stackTop;
+    header.basePointer = basePointer;
+    header.frameSize = frameSize;
+    header.callDepth = callDepth;
+    header.stackSlots = liveSlots;
+    header.stackOffset = roundToPage(sizeof(header));
+    header.callOffset = header.stackOffset + roundToPage(liveSlots * sizeof(Value));
+    header.outputSize = pendingOutput.size();
+    header.outputOffset = header.callOffset + callDepth * sizeof(CallFrame);
+    header.fileSize = header.outputOffset + header.outputSize;
+
+    std::ofstream snapshotFile(filename, std::ios::binary | std::ios::trunc);
+    if(!snapshotFile.is_open()) {
+        std::cerr << "Unable to open file " << filename << std::endl;
+        return false;
+    }
+
+    // Padding is written out so the mapped stack pages never reach past the end of the file
+    const std::vector<char> padding(header.stackOffset, '\0');
+    const size_t stackBytes = liveSlots * sizeof(Value);
+    snapshotFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    snapshotFile.write(padding.data(), static_cast<std::streamsize>(header.stackOffset - sizeof(header)));
+    snapshotFile.write(reinterpret_cast<const char *>(memoryStack), static_cast<std::streamsize>(stackBytes));
+    snapshotFile.write(padding.data(), static_cast<std::streamsize>(header.callOffset - header.stackOffset - stackBytes));
+    snapshotFile.write(reinterpret_cast<const char *>(callStack.get()), static_cast<std::streamsize>(callDepth * sizeof(CallFrame)));
+    snapshotFile.write(pendingOutput.data(), static_cast<std::streamsize>(pendingOutput.size()));
+    return static_cast<bool>(snapshotFile);
+}
+
+bool StackMachine::restoreSnapshot(const std::string &filename) {
+    if(!program) {
+        std::cerr << "Error: no program loaded" << std::endl;
+        return false;
+    }
+
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        std::cerr << "Unable to open file " << filename << std::endl;
+        return false;
+    }
+
+    struct stat status{};
+    SnapshotHeader header{};
+    if(fstat(fd, &status) != 0 || pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))) {
+        close(fd);
+        return invalid("truncated header");
+    }
+
+    auto check = [&]() {
+        if(std::memcmp(header.magic, Snapshot::MAGIC, sizeof(Snapshot::MAGIC)) != 0) return invalid("bad magic");
+        if(header.version != Snapshot::VERSION) return invalid("unsupported version " + std::to_string(header.version));
+        if(header.byteOrder != BYTE_ORDER_MARK) return invalid("written on a machine with a different byte order");
+        if(header.fileSize != static_cast<uint64_t>(status.st_size)) return invalid("size does not match the header");
+        if(header.programFingerprint != program->fingerprint()) return invalid("taken from a different program");
+        if(header.status != static_cast<uint16_t>(RunStatus::YIELDED) && header.status != static_cast<uint16_t>(RunStatus::BLOCKED)) {
+            return invalid("not a suspended run");
+        }
+
+        const auto programSize = static_cast<int32_t>(program->size());
+        if(header.instructionCounter < 0 || header.instructionCounter >= programSize ||
+           header.blockStart < 0 || header.blockStart > header.instructionCounter) {
+            return invalid("pc out of range");
+        }
+        if(header.stackSlots > stackRegion.size() || header.stackTop < 0 || static_cast<uint64_t>(header.stackTop) > header.stackSlots ||
+           header.basePointer < 0 || static_cast<size_t>(header.basePointer) >= stackRegion.size()) {
+            return invalid("stack does not fit in this VM");
+        }
+        if(header.frameSize < 0 || header.frameSize > MAX_FRAME_SIZE || header.callDepth < 0 || header.callDepth > MAX_CALL_DEPTH) {
+            return invalid("frame stack does not fit in this VM");
+        }
+        if(header.stackOffset != roundToPage(header.stackOffset) ||
+           header.callOffset < header.stackOffset + roundToPage(header.stackSlots * sizeof(Value)) ||
+           header.outputOffset != header.callOffset + header.callDepth * sizeof(CallFrame) ||
+           header.outputOffset + header.outputSize != header.fileSize) {
+            return invalid("section out of bounds");
+        }
+        return true;
+    };
+    if(!check()) {
+        close(fd);
+        return false;
+    }
+
+    std::string pendingOutput(header.outputSize, '\0');
+    if(pread(fd, pendingOutput.data(), pendingOutput.size(), static_cast<off_t>(header.outputOffset)) != static_cast<ssize_t>(pendingOutput.size())) {
+        close(fd);
+        return invalid("truncated output");
+    }
+
+    std::vector<CallFrame> callers(header.callDepth);
+    const auto callBytes = static_cast<ssize_t>(callers.size() * sizeof(CallFrame));
+    if(pread(fd, callers.data(), callBytes, static_cast<off_t>(header.callOffset)) != callBytes) {
+        close(fd);
+        return invalid("truncated frame stack");
+    }
+    for(const CallFrame &caller : callers) {
+        if(caller.returnAddress < 0 || caller.returnAddress >= static_cast<int32_t>(program->size()) ||
+           caller.basePointer < 0 || static_cast<size_t>(caller.basePointer) >= stackRegion.size() ||
+           caller.frameSize < 0 || caller.frameSize > MAX_FRAME_SIZE) {
+            close(fd);
+            return invalid("frame stack out of range");
+        }
+    }
+
+    stackRegion.reset();
+    const bool mapped = stackRegion.mapFile(fd, header.stackOffset, header.stackSlots * sizeof(Value));
+    close(fd);
+    if(!mapped) {
+        std::cerr << "Unable to map file " << filename << std::endl;
+        return false;
+    }
+
+    generalPurposeRegister = std::bit_cast<Value>(header.generalPurposeRegister);
+    instructionCounter = header.instructionCounter;
+    blockStart = header.blockStart;
+    instructionsExecuted = header.instructionsExecuted;
+    stackTop = header.stackTop;
+    basePointer = header.basePointer;
+    frameSize = header.frameSize;
+    callDepth = header.callDepth;
+    std::copy(callers.begin(), callers.end(), callStack.get());
+    runResult = {static_cast<RunStatus>(header.status), 0, instructionsExecuted + (instructionCounter - blockStart)};
+
+    output.write(pendingOutput);
+    if(profiler) profiler->attach(*program);
+    if(sampler) sampler->start(*program);
+    return true;
+}
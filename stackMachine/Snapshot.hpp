@@ -0,0 +1,37 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <cstdint>
+
+// Binary .vsms layout: the complete state of a suspended run of one program.
+// The stack section starts on a page boundary and is padded to a whole page,
+// so restoring maps it straight over the VM stack instead of reading it.
+//
+//   SnapshotHeader
+//   Value[stackSlots]      slots 0 up to the highest live one (page-aligned)
+//   CallFrame[callDepth]   callers of the suspended function, outermost first
+//   char[outputSize]       output printed before the snapshot and not yet written
+struct SnapshotHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t status;              // RunStatus the run was suspended with
+    uint32_t byteOrder;
+    uint32_t reserved;
+    uint64_t programFingerprint;  // ProgramImage::fingerprint() of the program it ran
+    uint64_t instructionsExecuted;
+    uint64_t generalPurposeRegister; // Value bits
+    int32_t instructionCounter, blockStart;
+    int32_t stackTop, basePointer;
+    int32_t frameSize, callDepth;
+    uint64_t stackSlots, stackOffset;
+    uint64_t callOffset;
+    uint64_t outputSize, outputOffset;
+    uint64_t fileSize;
+};
+
+namespace Snapshot {
+    constexpr char MAGIC[4] = {'V', 'S', 'M', 'S'};
+    constexpr uint16_t VERSION = 2; // 2: frame stack
+}
+
+#endif //SNAPSHOT_HPP
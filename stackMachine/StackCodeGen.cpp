@@ -0,0 +1,58 @@
+#include "StackCodeGen.hpp"
+
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+    std::string functionLabel(const std::string &name) {
+        return "_" + name + ":";
+    }
+}
+
+StackCodeGen::StackCodeGen(std::string scope) : labelScope(scope.empty() ? scope : scope + ".") {}
+
+void StackCodeGen::beginFunction(const std::string &name, int paramCount, int localCount) {
+    if(localCount > MAX_FRAME_SIZE) {
+        throw std::runtime_error("Function " + name + " has more than " + std::to_string(MAX_FRAME_SIZE) + " locals");
+    }
+
+    paramCounts[name] = paramCount;
+    assembler.markFunction(name);
+    assembler.defineLabel(functionLabel(name));
+    emit(Opcode::ENTER, enterOperand(paramCount, localCount));
+}
+
+void StackCodeGen::endFunction() {
+    // Falling off the end of a function returns 0
+    emit(Opcode::PUSH_INT, 0);
+    emit(Opcode::RETV);
+}
+
+std::string StackCodeGen::newLabel(const std::string &kind) {
+    return labelScope + kind + "_" + std::to_string(nextLabel++) + ":";
+}
+
+void StackCodeGen::emitCall(const std::string &name, int argCount) {
+    calls.emplace_back(name, argCount);
+    emitBranch(Opcode::CALL, functionLabel(name));
+}
+
+void StackCodeGen::append(StackCodeGen &&other) {
+    assembler.append(std::move(other.assembler));
+    paramCounts.merge(other.paramCounts);
+    calls.insert(calls.end(), other.calls.begin(), other.calls.end());
+}
+
+bool StackCodeGen::finish(Program &result) {
+    // ENTER pops exactly paramCount arguments, so any other count would leave the caller's stack unbalanced
+    bool matched = true;
+    for(const auto &[name, argCount] : calls) {
+        auto it = paramCounts.find(name);
+        if(it != paramCounts.end() && it->second != argCount) {
+            std::cerr << "Error: '" << name << "' expects " << it->second << " arguments, but got " << argCount << std::endl;
+            matched = false;
+        }
+    }
+    return assembler.finish(result) && matched;
+}
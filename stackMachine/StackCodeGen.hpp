@@ -0,0 +1,47 @@
+#ifndef STACKCODEGEN_HPP
+#define STACKCODEGEN_HPP
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Bytecode.hpp"
+
+// Builds stack machine code from the AST. A generator owns its code and its
+// label numbering, so every function can be generated by its own generator
+// on its own thread; append() then links them in source order. Labels are
+// prefixed with the generator's function, keeping them unique after linking.
+// Calls are checked against the callee's parameter count once everything is
+// linked, as the register backend does.
+class StackCodeGen {
+private:
+    Assembler assembler;
+    std::string labelScope;
+    int nextLabel = 0;
+    std::unordered_map<std::string, int> paramCounts;
+    std::vector<std::pair<std::string, int>> calls;             // callee -> argument count
+
+public:
+    explicit StackCodeGen(std::string scope = "");
+
+    void beginFunction(const std::string &name, int paramCount, int localCount);
+    void endFunction();
+
+    // Unique within this generator, e.g. "fact.else_0:"
+    std::string newLabel(const std::string &kind);
+    void placeLabel(const std::string &label) { assembler.defineLabel(label); }
+    void setSourceLine(int line) { assembler.setSourceLine(line); }
+
+    void emit(Opcode opcode, int operand = 0) { assembler.emit(opcode, operand); }
+    void emitFloat(Opcode opcode, float operand) { assembler.emitFloat(opcode, operand); }
+    void emitBranch(Opcode opcode, const std::string &label) { assembler.emitBranch(opcode, label); }
+    void emitCall(const std::string &name, int argCount);
+    void emitString(Opcode opcode, const std::string &text) { assembler.emitString(opcode, text); }
+
+    // Moves other's code to the end of this generator's
+    void append(StackCodeGen &&other);
+    bool finish(Program &result);
+};
+
+#endif //STACKCODEGEN_HPP
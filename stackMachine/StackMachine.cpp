@@ -1,14 +1,34 @@
 #include "StackMachine.hpp"
+#include "Jit.hpp"
 
+#include <algorithm>
 #include <iostream>
-#include <sstream>
-#include <fstream>
+#include <functional>
+#include <limits>
 
+namespace {
+    // siglongjmp value of halt(); guard page faults arrive with StackRegion's fault values
+    constexpr int HALT_JUMP = -1;
+
+    // Stack cells used as addresses, counters or exit codes must be ints
+    int toInt(const Value &value, const char *context) {
+        if(value.isInt()) return value.asInt();
+
+        std::cerr << "Warning: float " << value.asFloat() << " converted to int " << context << "\n";
+        return static_cast<int>(value.asFloat());
+    }
+}
+
+StackMachine::StackMachine(size_t stackSlots) : stackRegion(stackSlots), memoryStack(stackRegion.data()),
+                                                callStack(new CallFrame[MAX_CALL_DEPTH]) {
+    input.tie(&output);
+}
+
+StackMachine::~StackMachine() = default;
+
+// Only computed addresses are checked; pushes and pops rely on the guard pages
 int StackMachine::validAddress(const int addr) {
-    /* This being >= might cause issues
-     * I think 668cd4727245eb838d3ba6fa47b3b4f44acce330 fixes it
-     * though due to the stack having no max size. */
-    if (addr >= memoryStack.size()) {
+    if (addr >= static_cast<long>(stackRegion.size())) {
         std::cerr << "Stack overflow" << std::endl;
         return 0;
     } if (addr < 0) {
@@ -18,350 +38,325 @@ int StackMachine::validAddress(const int addr) {
     return 1;
 }
 
-StackMachine::StackMachine() {
-    // Memory state function initializations
-    instructionImplementationMap["push"] = [this](const std::string &arg) {push(arg);};
-    instructionImplementationMap["pop"] = [this](const std::string &arg) {pop(arg);};
-    instructionImplementationMap["pop"] = [this]() {pop();};
-    instructionImplementationMap["dup"] = [this]() {dup();};
-    instructionImplementationMap["load"] = [this](const std::string &arg) {load(arg);};
-    instructionImplementationMap["save"] = [this](const std::string &arg) {save(arg);};
-    instructionImplementationMap["store"] = [this](const std::string &arg) {store(arg);};
-
-    // Control of execution function initializations
-    instructionImplementationMap["call"] = [this](const std::string &arg) {call(arg);};
-    instructionImplementationMap["ret"] = [this]() {ret();};
-    instructionImplementationMap["retv"] = [this]() {retv();};
-    instructionImplementationMap["brt"] = [this](const std::string &arg) {brt(arg);};
-    instructionImplementationMap["brz"] = [this](const std::string &arg) {brz(arg);};
-    instructionImplementationMap["jump"] = [this](const std::string &arg) {jump(arg);};
-
-    // Arithmetic function initializations
-    instructionImplementationMap["neg"] = [this]() {neg();};
-    instructionImplementationMap["add"] = [this]() {add();};
-    instructionImplementationMap["sub"] = [this]() {sub();};
-    instructionImplementationMap["mul"] = [this]() {mul();};
-    instructionImplementationMap["div"] = [this]() {div();};
-    instructionImplementationMap["mod"] = [this]() {mod();};
-
-    // Relational function initializations
-    instructionImplementationMap["eq"] = [this]() {eq();};
-    instructionImplementationMap["neq"] = [this]() {neq();};
-    instructionImplementationMap["lt"] = [this]() {lt();};
-    instructionImplementationMap["lte"] = [this]() {lte();};
-    instructionImplementationMap["gt"] = [this]() {gt();};
-    instructionImplementationMap["gte"] = [this]() {gte();};
-
-    // // Special function initializations
-    instructionImplementationMap["print"] = [this](const std::string &arg) {print(arg);};
-    instructionImplementationMap["read"] = [this]() {read();};
-    instructionImplementationMap["end"] = [this](const std::string &arg) {end(arg);};
+// Keeps bp inside the region so bp-relative local accesses can stay unchecked
+void StackMachine::setBasePointer(int value) {
+    if (value < 0 || value >= static_cast<long>(stackRegion.size())) {
+        std::cerr << "Error: base pointer " << value << " is outside the stack" << std::endl;
+        halt(RunStatus::ERROR, 1);
+    }
+    basePointer = value;
 }
 
 // Memory state functions
+// Parses textual input; everything else pushes typed values directly
 void StackMachine::push(const std::string &arg) {
     if (arg.empty()) {
         std::cerr << "Error: push requires an argument" << std::endl;
         return;
     }
 
-    if(arg == "bp") {
-        if (!validAddress(basePointer)) return;
-        memoryStack.push_back(memoryStack[basePointer]);
-    } else if(arg == "top") {
-        memoryStack.push_back(memoryStack[stackTop - 1]);
-    } else {
-        // ToDo: Fix this mess
-        try {
-            if(arg.find('.') != std::string::npos) {
-                memoryStack.emplace_back(std::stof(arg));
-            } else{
-                memoryStack.emplace_back(std::stoi(arg));
-            }
-        } catch(const std::invalid_argument &e) {
-            std::cerr << "Invalid push argument: " << arg << std::endl;
-            return;
+    try {
+        if(arg.find('.') != std::string::npos) {
+            push(Value(std::stof(arg)));
+        } else{
+            push(Value(std::stoi(arg)));
         }
+    } catch(const std::invalid_argument &e) {
+        std::cerr << "Invalid push argument: " << arg << std::endl;
     }
+}
+
+void StackMachine::push(const Value &value) {
+    memoryStack[stackTop++] = value;
 
     if(DEBUG) {
-        std::visit([](auto v) {
-            std::cout << "Pushed " << v << " onto the stack" << std::endl;
-        }, generalPurposeRegister);
+        std::cout << "Pushed " << value << " onto the stack" << std::endl;
     }
 
-    generalPurposeRegister = memoryStack.back();
-    stackTop++;
+    generalPurposeRegister = value;
+}
+
+void StackMachine::pushBasePointerSlot() {
+    if (!validAddress(basePointer)) return;
+    push(memoryStack[basePointer]);
+}
+
+void StackMachine::pushTop() {
+    push(memoryStack[stackTop - 1]);
 }
 
-void StackMachine::pop(const std::string &arg) {
-    if(arg == "top") {
-        stackTop = std::visit([](auto v) -> int {
-            if constexpr (std::is_same_v<decltype(v), float>) {
-                std::cerr << "Warning: float value " << v << " converted to int for stackTop\n";
-                return static_cast<int>(v); // convert float to int
-            }
-            return v;
-        }, memoryStack.back());
+void StackMachine::pop(AddressMode mode) {
+    const Value top = memoryStack[--stackTop];
+
+    if(mode == AddressMode::TOP) {
+        // The popped value replaces top outright, so it must land inside the region
+        const int newTop = toInt(top, "for stackTop");
+        if(newTop < 0 || newTop > static_cast<long>(stackRegion.size())) {
+            std::cerr << "Error: stack top " << newTop << " is outside the stack" << std::endl;
+            halt(RunStatus::ERROR, 1);
+        }
+        stackTop = newTop;
         if(DEBUG) std::cout << "Popped " << stackTop << " from the stack" << std::endl;
-    } else if(arg == "bp") {
-        basePointer = std::visit([](auto v) -> int {
-            if constexpr (std::is_same_v<decltype(v), float>) {
-                std::cerr << "Warning: float value " << v << " converted to int for basePointer\n";
-                return static_cast<int>(v); // convert float to int
-            }
-            return v;
-        }, memoryStack.back());
+    } else if(mode == AddressMode::BP) {
+        setBasePointer(toInt(top, "for basePointer"));
         if(DEBUG) std::cout << "Popped " << basePointer << " from the stack" << std::endl;
     } else {
-        generalPurposeRegister = memoryStack.back();
+        generalPurposeRegister = top;
         if(DEBUG) {
-            std::visit([](auto v) {
-                std::cout << "Popped " << v << " from the stack" << std::endl;
-            }, generalPurposeRegister);
+            std::cout << "Popped " << generalPurposeRegister << " from the stack" << std::endl;
         }
     }
-
-    memoryStack.pop_back();
-    stackTop--;
 }
 
 void StackMachine::pop() {
-    generalPurposeRegister = memoryStack.back();
+    generalPurposeRegister = memoryStack[--stackTop];
     if(DEBUG) {
-        std::visit([](auto v) {
-            std::cout << "Popped " << v << " from the stack" << std::endl;
-        }, generalPurposeRegister);
+        std::cout << "Popped " << generalPurposeRegister << " from the stack" << std::endl;
     }
-    memoryStack.pop_back();
-    stackTop--;
+}
+
+Value StackMachine::popValue() {
+    pop();
+    return generalPurposeRegister;
 }
 
 void StackMachine::dup() {
-    memoryStack.push_back(memoryStack.back());
-    generalPurposeRegister = memoryStack.back();
-    stackTop++;
+    generalPurposeRegister = memoryStack[stackTop - 1];
+    memoryStack[stackTop++] = generalPurposeRegister;
     if(DEBUG) {
-        std::visit([](auto v) {
-            std::cout << "Duplicated " << v << " onto the stack" << std::endl;
-        }, generalPurposeRegister);
+        std::cout << "Duplicated " << generalPurposeRegister << " onto the stack" << std::endl;
     }
 }
 
-void StackMachine::load(const std::string &arg) {
+void StackMachine::load(AddressMode mode) {
     pop();
-    int addr = std::visit([](auto v) -> int {
-        if constexpr (std::is_same_v<decltype(v), float>) {
-            std::cerr << "Warning: float " << v << " converted to int for memory access in load()\n";
-            return static_cast<int>(v);
-        }
-        return v;
-    }, generalPurposeRegister);
+    int addr = toInt(generalPurposeRegister, "for memory access in load()");
 
-    if (arg == "bp") {
+    if (mode == AddressMode::BP) {
         addr += basePointer;
-    } else if (arg == "top") {
+    } else if (mode == AddressMode::TOP) {
         addr += stackTop - 1;
     }
 
     if (!validAddress(addr)) return;
-    push(std::visit([](auto v) { return std::to_string(v); }, memoryStack[addr]));
+    push(memoryStack[addr]);
 }
 
-void StackMachine::save(const std::string &arg) {
+void StackMachine::save(AddressMode mode) {
     pop();
-    int addr = std::visit([](auto v) -> int {
-        if constexpr (std::is_same_v<decltype(v), float>) {
-            std::cerr << "Warning: float " << v << " converted to int for memory access in save()\n";
-            return static_cast<int>(v);
-        }
-        return v;
-    }, generalPurposeRegister);
+    int addr = toInt(generalPurposeRegister, "for memory access in save()");
 
-    if (arg == "bp") {
+    if (mode == AddressMode::BP) {
         addr += basePointer;
-    } else if (arg == "top") {
+    } else if (mode == AddressMode::TOP) {
         addr += stackTop - 1;
     }
 
     if (!validAddress(addr)) return;
-    memoryStack[addr] = generalPurposeRegister = memoryStack.back();
+    memoryStack[addr] = generalPurposeRegister = memoryStack[stackTop - 1];
 }
 
-void StackMachine::store(const std::string &arg) {
+void StackMachine::store(AddressMode mode) {
     pop();
-    int addr = std::visit([](auto v) -> int {
-        if constexpr (std::is_same_v<decltype(v), float>) {
-            std::cerr << "Warning: float " << v << " converted to int for memory access in store()\n";
-            return static_cast<int>(v);
-        }
-        return v;
-    }, generalPurposeRegister);
+    int addr = toInt(generalPurposeRegister, "for memory access in store()");
 
-    if (arg == "bp") {
+    if (mode == AddressMode::BP) {
         addr += basePointer;
-    } else if (arg == "top") {
+    } else if (mode == AddressMode::TOP) {
         addr += stackTop - 1;
     }
 
     if (!validAddress(addr)) return;
-    memoryStack[addr] = generalPurposeRegister = memoryStack.back();
+    memoryStack[addr] = generalPurposeRegister = memoryStack[stackTop - 1];
+}
+
+// Superinstructions for the frame accesses the code generator emits
+// bp is kept inside the region and offsets are checked at load time, so
+// bp + offset is at worst a guard page access
+void StackMachine::loadLocal(int offset) {
+    push(memoryStack[basePointer + offset]);
+}
+
+void StackMachine::storeLocal(int offset) {
+    memoryStack[basePointer + offset] = generalPurposeRegister = memoryStack[stackTop - 1];
 }
 
 // Control flow functions
-void StackMachine::call(const std::string &arg) {
-    if (arg.empty()) {
-        std::cerr << "Error: call requires a function label as argument" << std::endl;
-        return;
+void StackMachine::call(int target) {
+    if(callDepth == MAX_CALL_DEPTH) {
+        std::cerr << "Error: Call stack overflow" << std::endl;
+        halt(RunStatus::STACK_OVERFLOW, 1);
     }
 
-    if (stackTop <= 0) {
-        std::cerr << "Error: Stack is empty. Cannot read argument count." << std::endl;
-        return;
-    }
+    callStack[callDepth++] = {instructionCounter, basePointer, frameSize};
 
-    pop();
-    int argNum = std::visit([](auto v) {
-        if constexpr (std::is_same_v<decltype(v), float>) {
-            std::cerr << "Warning: float " << v << " converted to int in call()\n";
-            return static_cast<int>(v);
-        }
-        return static_cast<int>(v);
-    }, generalPurposeRegister);
+    // A callee without enter gets an empty frame at the top, so its ret leaves the caller intact
+    basePointer = stackTop;
+    frameSize = 0;
+    transferTo(target);
+}
 
-    if(argNum < 0 || stackTop < argNum) {
-        std::cerr << "Error: Invalid argument count or stack underflow." << std::endl;
-        return;
+void StackMachine::enter(int operand) {
+    const int params = enterParams(operand);
+    const int size = enterFrameSize(operand);
+    if(stackTop < params) {
+        std::cerr << "Error: enter expects " << params << " arguments but the stack holds " << stackTop << std::endl;
+        halt(RunStatus::STACK_UNDERFLOW, 1);
     }
 
-    push(std::to_string(basePointer)); // Old base pointer
-    push(std::to_string(instructionCounter + 1)); // Return address
-
-    basePointer = stackTop - argNum - 1;
-
-    if(DEBUG) {
-        std::cerr << "CALL: argNum = " << argNum << std::endl;
-        std::cerr << "CALL: New base pointer = " << basePointer << std::endl;
+    const int base = stackTop - params;
+    if(base + std::max(size, 1) > static_cast<long>(stackRegion.size())) {
+        std::cerr << "Stack overflow" << std::endl;
+        halt(RunStatus::STACK_OVERFLOW, 1);
     }
 
-    jump(arg);
+    // Locals start out as 0 rather than whatever an earlier frame left there
+    std::fill(memoryStack + stackTop, memoryStack + base + size, Value(0));
+    basePointer = base;
+    stackTop = base + size;
+    frameSize = size;
 }
 
 void StackMachine::ret() {
-    if(basePointer == 0) {
-        std::visit([](auto v) {
-            if constexpr (std::is_same_v<decltype(v), float>) {
-                std::cerr << "Warning: float " << v << " converted to int in ret()\n";
-                exit(static_cast<int>(v));
-            }
-            exit(v);
-        }, generalPurposeRegister);
-    }
-
-    instructionCounter = std::visit([](auto v) -> int {
-        if constexpr (std::is_same_v<decltype(v), float>) {
-            std::cerr << "Warning: float " << v << " converted to int for instructionCounter in ret()\n";
-            return static_cast<int>(v);
-        }
-        return v;
-    }, memoryStack[basePointer]);
+    if(callDepth == 0) {
+        halt(RunStatus::HALTED, toInt(generalPurposeRegister, "in ret()"));
+    }
 
-    basePointer = std::visit([](auto v) -> int {
-        if constexpr (std::is_same_v<decltype(v), float>) {
-            std::cerr << "Warning: float " << v << " converted to int for basePointer in ret()\n";
-            return static_cast<int>(v);
-        }
-        return v;
-    }, memoryStack[basePointer - 1]);
+    // Control moves last, so a yield in transferTo leaves a finished instruction behind
+    const CallFrame &caller = callStack[--callDepth];
+    stackTop = basePointer;
+    basePointer = caller.basePointer;
+    frameSize = caller.frameSize;
+    transferTo(caller.returnAddress);
 }
 
 void StackMachine::retv() {
     pop();
-    if(basePointer == 0) {
-        push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
-        std::visit([](auto v) {
-            if constexpr (std::is_same_v<decltype(v), float>) {
-                std::cerr << "Warning: float " << v << " converted to int in retv()\n";
-                exit(static_cast<int>(v));
-            }
-            exit(v);
-        }, generalPurposeRegister);
-    }
-
-    instructionCounter = std::visit([](auto v) -> int {
-        if constexpr (std::is_same_v<decltype(v), float>) {
-            std::cerr << "Warning: float " << v << " converted to int for instructionCounter in retv()\n";
-            return static_cast<int>(v);
-        }
-        return v;
-    }, memoryStack[basePointer]);
-
-    basePointer = std::visit([](auto v) -> int {
-        if constexpr (std::is_same_v<decltype(v), float>) {
-            std::cerr << "Warning: float " << v << " converted to int for basePointer in retv()\n";
-            return static_cast<int>(v);
-        }
-        return v;
-    }, memoryStack[basePointer - 1]);
+    if(callDepth == 0) {
+        push(generalPurposeRegister);
+        halt(RunStatus::HALTED, toInt(generalPurposeRegister, "in retv()"));
+    }
 
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    const CallFrame &caller = callStack[--callDepth];
+    stackTop = basePointer;
+    basePointer = caller.basePointer;
+    frameSize = caller.frameSize;
+    push(generalPurposeRegister);
+    transferTo(caller.returnAddress);
 }
 
-void StackMachine::brt(const std::string &arg) {
-    if (arg.empty()) {
-        std::cerr << "Error: brt requires an argument" << std::endl;
-        return;
-    }
-
+void StackMachine::brt(int target) {
     pop();
 
-    int val = std::visit([](auto v) -> int {
-        if constexpr (std::is_same_v<decltype(v), float>) {
-            std::cerr << "Warning: float " << v << " converted to int in brt()\n";
-            return static_cast<int>(v);
-        }
-        return v;
-    }, generalPurposeRegister);
+    int val = toInt(generalPurposeRegister, "in brt()");
 
     if(val == 1) {
-        jump(arg);
+        jump(target);
     }
 }
 
-void StackMachine::brz(const std::string &arg) {
-    if (arg.empty()) {
-        std::cerr << "Error: brz requires an argument" << std::endl;
-        return;
-    }
-
+void StackMachine::brz(int target) {
     pop();
-    int val = std::visit([](auto v) -> int {
-        if constexpr (std::is_same_v<decltype(v), float>) {
-            std::cerr << "Warning: float " << v << " converted to int in brt()\n";
-            return static_cast<int>(v);
-        }
-        return v;
-    }, generalPurposeRegister);
+    int val = toInt(generalPurposeRegister, "in brt()");
 
     if(val == 0) {
-        jump(arg);
+        jump(target);
     }
 }
 
-void StackMachine::jump(const std::string &arg) {
-    if (arg.empty()) {
-        std::cerr << "Error: jump requires an argument" << std::endl;
+void StackMachine::jump(int target) {
+    transferTo(target);
+
+    if(DEBUG) std::cout << "Jump to " << target << std::endl;
+}
+
+// Instructions are counted a straight-line run at a time when control leaves
+// the run, which keeps the count and the fuel check off the per-instruction
+// dispatch path. Every loop goes through here, so no program outruns its fuel
+// or its time slice.
+void StackMachine::transferTo(int target) {
+    instructionsExecuted += instructionCounter - blockStart;
+    instructionCounter = blockStart = target;
+    if(instructionsExecuted > checkpoint) checkpointReached();
+}
+
+template<typename Operation>
+void StackMachine::quickBinaryOperation(Operation operation, Opcode generic, void (StackMachine::*fallback)()) {
+    Value &lhs = memoryStack[stackTop - 2];
+    const Value rhs = memoryStack[stackTop - 1];
+
+    if(!Value::bothInt(lhs, rhs)) {
+        program->deoptimize(instructionCounter - 1, generic);
+        (this->*fallback)();
         return;
     }
 
-    auto it = labelMap.find(arg);
-    if(it != labelMap.end()) {
-        instructionCounter = it->second;
+    lhs = static_cast<int>(operation(lhs.asInt(), rhs.asInt()));
+    generalPurposeRegister = lhs;
+    stackTop--;
+}
+
+template<typename Comparison>
+void StackMachine::quickCompareAndBranch(Comparison comparison, int target, Opcode generic, void (StackMachine::*fallback)(int)) {
+    const Value lhs = memoryStack[stackTop - 2];
+    const Value rhs = memoryStack[stackTop - 1];
+
+    if(!Value::bothInt(lhs, rhs)) {
+        program->deoptimize(instructionCounter - 1, generic);
+        (this->*fallback)(target);
+        return;
+    }
+
+    stackTop -= 2;
+
+    const int flag = static_cast<int>(comparison(lhs.asInt(), rhs.asInt()));
+    generalPurposeRegister = flag;
+    if(flag == 0) {
+        jump(target);
+    }
+}
+
+// Fused comparison and brz, skipping the push and pop of the flag
+template<typename Comparison>
+void StackMachine::compareAndBranch(Comparison comparison, int target, Opcode quickened) {
+    const Value rhs = popValue();
+    const Value lhs = popValue();
+    int flag;
+    if(Value::bothInt(lhs, rhs)) {
+        program->quicken(instructionCounter - 1, quickened);
+        flag = comparison(lhs.asInt(), rhs.asInt());
     } else {
-        std::cerr << "Error: label '" << arg << "' not found" << std::endl;
+        flag = comparison(lhs.toFloat(), rhs.toFloat());
     }
 
-    if(DEBUG) std::cout << "Jump to " << arg << std::endl;
+    generalPurposeRegister = flag;
+    if(flag == 0) {
+        jump(target);
+    }
+}
+
+void StackMachine::eqBrz(int target) {
+    compareAndBranch([](auto a, auto b) { return static_cast<int>(a == b); }, target, Opcode::EQ_BRZ_II);
+}
+
+void StackMachine::neqBrz(int target) {
+    compareAndBranch([](auto a, auto b) { return static_cast<int>(a != b); }, target, Opcode::NEQ_BRZ_II);
+}
+
+void StackMachine::ltBrz(int target) {
+    compareAndBranch([](auto a, auto b) { return static_cast<int>(a < b); }, target, Opcode::LT_BRZ_II);
+}
+
+void StackMachine::lteBrz(int target) {
+    compareAndBranch([](auto a, auto b) { return static_cast<int>(a <= b); }, target, Opcode::LTE_BRZ_II);
+}
+
+void StackMachine::gtBrz(int target) {
+    compareAndBranch([](auto a, auto b) { return static_cast<int>(a > b); }, target, Opcode::GT_BRZ_II);
+}
+
+void StackMachine::gteBrz(int target) {
+    compareAndBranch([](auto a, auto b) { return static_cast<int>(a >= b); }, target, Opcode::GTE_BRZ_II);
 }
 
 // Arithmetic functions
@@ -370,302 +365,559 @@ void StackMachine::neg() {
         std::cerr << "Error: Stack underflow in neg()\n";
         return;
     }
-    auto &top = memoryStack.back();
-    std::visit([](auto &v) { v = -v; }, top);
+    Value &top = memoryStack[stackTop - 1];
+    top = top.isInt() ? Value(-top.asInt()) : Value(-top.asFloat());
 }
 
-void StackMachine::add() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
-
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
-        return a + b;
-    }, generalPurposeRegister, temp);
+template<typename Operation>
+void StackMachine::binaryOperation(Operation operation, Opcode quickened) {
+    const Value rhs = popValue();
+    const Value lhs = popValue();
+    if(quickened != Opcode::OPCODE_COUNT && Value::bothInt(lhs, rhs)) {
+        program->quicken(instructionCounter - 1, quickened);
+    }
+    push(Value::apply(operation, lhs, rhs));
+}
 
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+void StackMachine::add() {
+    binaryOperation([](auto a, auto b) -> Value { return a + b; }, Opcode::ADD_II);
 }
 
 void StackMachine::sub() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
-
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
-        return a - b;
-    }, generalPurposeRegister, temp);
-
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    binaryOperation([](auto a, auto b) -> Value { return a - b; }, Opcode::SUB_II);
 }
 
 void StackMachine::mul() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
+    binaryOperation([](auto a, auto b) -> Value { return a * b; }, Opcode::MUL_II);
+}
 
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
-        return a * b;
-    }, generalPurposeRegister, temp);
+// An int divide by zero, or INT_MIN / -1, would trap the host process; the program stops with an error instead
+void StackMachine::checkIntDivision() {
+    const Value lhs = memoryStack[stackTop - 2];
+    const Value rhs = memoryStack[stackTop - 1];
+    if(!Value::bothInt(lhs, rhs)) return;
 
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    if(rhs.asInt() == 0) {
+        std::cerr << "Error: division by zero" << std::endl;
+        halt(RunStatus::ERROR, 1);
+    }
+    if(rhs.asInt() == -1 && lhs.asInt() == std::numeric_limits<int>::min()) {
+        std::cerr << "Error: integer overflow in division" << std::endl;
+        halt(RunStatus::ERROR, 1);
+    }
 }
 
 void StackMachine::div() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
-
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
-        return a / b;
-    }, generalPurposeRegister, temp);
-
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    checkIntDivision();
+    binaryOperation([](auto a, auto b) -> Value { return a / b; }, Opcode::DIV_II);
 }
 
 void StackMachine::mod() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
-
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
+    checkIntDivision();
+    binaryOperation([](auto a, auto b) -> Value {
         if constexpr (std::is_same_v<decltype(a), int> && std::is_same_v<decltype(b), int>) {
             return a % b;
         } else {
             std::cerr << "Error: cannot perform modulus on a float" << std::endl;
             return 0;
         }
-    }, generalPurposeRegister, temp);
-
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    }, Opcode::OPCODE_COUNT);
 }
 
 // Relational operator functions
 void StackMachine::eq() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
-        return static_cast<int>(a == b);
-    }, generalPurposeRegister, temp);
-
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    binaryOperation([](auto a, auto b) -> Value { return static_cast<int>(a == b); }, Opcode::EQ_II);
 }
 
 void StackMachine::neq() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
-        return static_cast<int>(a != b);
-    }, generalPurposeRegister, temp);
-
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    binaryOperation([](auto a, auto b) -> Value { return static_cast<int>(a != b); }, Opcode::NEQ_II);
 }
 
 void StackMachine::lt() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
-        return static_cast<int>(a < b);
-    }, generalPurposeRegister, temp);
-
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    binaryOperation([](auto a, auto b) -> Value { return static_cast<int>(a < b); }, Opcode::LT_II);
 }
 
 void StackMachine::lte() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
-        return static_cast<int>(a <= b);
-    }, generalPurposeRegister, temp);
-
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    binaryOperation([](auto a, auto b) -> Value { return static_cast<int>(a <= b); }, Opcode::LTE_II);
 }
 
 void StackMachine::gt() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
-        return static_cast<int>(a > b);
-    }, generalPurposeRegister, temp);
-
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    binaryOperation([](auto a, auto b) -> Value { return static_cast<int>(a > b); }, Opcode::GT_II);
 }
 
 void StackMachine::gte() {
-    pop();
-    const Value temp = generalPurposeRegister;
-    pop();
-    generalPurposeRegister = std::visit([](auto a, auto b) -> Value {
-        return static_cast<int>(a >= b);
-    }, generalPurposeRegister, temp);
-
-    push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
+    binaryOperation([](auto a, auto b) -> Value { return static_cast<int>(a >= b); }, Opcode::GTE_II);
 }
 
 // Special functions
-void StackMachine::print(const std::string &arg) {
-    if (arg.empty()) {
-        if (stackTop <= 0) {
-            std::cerr << "Error: Stack is empty. Nothing to print." << std::endl;
-            return;
-        }
+void StackMachine::print() {
+    if (stackTop <= 0) {
+        std::cerr << "Error: Stack is empty. Nothing to print." << std::endl;
+        return;
+    }
 
-        std::visit([](auto v) {
-            std::cout << v << std::endl;
-        }, memoryStack.back());
+    output.writeLine(memoryStack[stackTop - 1]);
+}
 
-    } else {
-        std::string formattedArg;
-        for (size_t i = 0; i < arg.length(); ++i) {
-            if (arg[i] == '\\' && i + 1 < arg.length()) {
-                if (arg[i + 1] == 'n') {
-                    formattedArg += '\n';
-                    ++i; // Skip next character
-                } else if (arg[i + 1] == 't') {
-                    formattedArg += '\t';
-                    ++i; // Skip next character
-                } else {
-                    formattedArg += arg[i];
-                }
-            } else {
-                formattedArg += arg[i];
-            }
-        }
-        std::cout << formattedArg << std::endl;
-    }
+// Escapes were decoded by the assembler, so the pool text is printed as is
+void StackMachine::print(std::string_view arg) {
+    output.writeLine(arg);
 }
 
 void StackMachine::read() {
-    std::string input;
-    std::cin >> input;
+    if(suspendBeforeRead) {
+        suspendBeforeRead = false;
+        instructionCounter--;
+        halt(RunStatus::BLOCKED, 0);
+    }
 
-    try {
-        push(input);
-    } catch(...) {
-        std::cerr << "Error: Invalid input for read()\n";
-    }
-}
-
-void StackMachine::end(const std::string &arg) {
-    if(arg.empty()) {
-        push(std::visit([](auto v) { return std::to_string(v); }, generalPurposeRegister));
-        std::visit([](auto v) {
-            if constexpr (std::is_same_v<decltype(v), float>) {
-                std::cerr << "Warning: float " << v << " converted to int in end()\n";
-                exit(static_cast<int>(v));
-            }
-            exit(v);
-        }, generalPurposeRegister);
-    } else if(arg == "bp") {
-        push(std::to_string(basePointer));
-        exit(basePointer);
-    } else if(arg == "top") {
-        push(std::to_string(stackTop));
-        exit(stackTop);
-    } else {
-        push(arg);
-        std::visit([](auto v) {
-            if constexpr (std::is_same_v<decltype(v), float>) {
-                std::cerr << "Warning: float " << v << " converted to int in end()\n";
-                exit(static_cast<int>(v));
-            }
-            exit(v);
-        }, memoryStack.back());
+    Value value;
+    switch(input.readValue(value)) {
+        case InputReader::Result::VALUE:
+            push(value);
+            break;
+        case InputReader::Result::WOULD_BLOCK:
+            // Nothing was consumed; the run resumes by executing this read again
+            instructionCounter--;
+            halt(RunStatus::BLOCKED, 0);
+        case InputReader::Result::END_OF_INPUT:
+            std::cerr << "Error: no input left for read()" << std::endl;
+            break;
+        case InputReader::Result::INVALID:
+            std::cerr << "Error: Invalid input for read()" << std::endl;
+            break;
+    }
+}
+
+void StackMachine::end() {
+    push(generalPurposeRegister);
+    halt(RunStatus::HALTED, toInt(generalPurposeRegister, "in end()"));
+}
+
+void StackMachine::end(AddressMode mode) {
+    if(mode == AddressMode::BP) {
+        push(Value(basePointer));
+        halt(RunStatus::HALTED, basePointer);
+    } else if(mode == AddressMode::TOP) {
+        push(Value(stackTop));
+        halt(RunStatus::HALTED, stackTop);
     }
+    end();
+}
+
+void StackMachine::end(const Value &value) {
+    push(value);
+    halt(RunStatus::HALTED, toInt(value, "in end()"));
 }
 
 // Program execution functions
-bool StackMachine::runProgram() {
+
+// One handler per opcode, shared by the switch and threaded dispatch loops.
+// Handlers run with `instruction` pointing at the current instruction and the
+// pc already advanced past it.
+#define VM_HANDLERS(HANDLER) \
+    HANDLER(PUSH_INT, push(Value(instruction->operand))) \
+    HANDLER(PUSH_FLOAT, push(Value(instruction->floatOperand))) \
+    HANDLER(PUSH_BP, pushBasePointerSlot()) \
+    HANDLER(PUSH_TOP, pushTop()) \
+    HANDLER(POP, pop()) \
+    HANDLER(POP_BP, pop(AddressMode::BP)) \
+    HANDLER(POP_TOP, pop(AddressMode::TOP)) \
+    HANDLER(DUP, dup()) \
+    HANDLER(LOAD, load(AddressMode::ABSOLUTE)) \
+    HANDLER(LOAD_BP, load(AddressMode::BP)) \
+    HANDLER(LOAD_TOP, load(AddressMode::TOP)) \
+    HANDLER(SAVE, save(AddressMode::ABSOLUTE)) \
+    HANDLER(SAVE_BP, save(AddressMode::BP)) \
+    HANDLER(SAVE_TOP, save(AddressMode::TOP)) \
+    HANDLER(STORE, store(AddressMode::ABSOLUTE)) \
+    HANDLER(STORE_BP, store(AddressMode::BP)) \
+    HANDLER(STORE_TOP, store(AddressMode::TOP)) \
+    HANDLER(LOAD_LOCAL, loadLocal(instruction->operand)) \
+    HANDLER(STORE_LOCAL, storeLocal(instruction->operand)) \
+    HANDLER(CALL, call(instruction->operand)) \
+    HANDLER(ENTER, enter(instruction->operand)) \
+    HANDLER(RET, ret()) \
+    HANDLER(RETV, retv()) \
+    HANDLER(BRT, brt(instruction->operand)) \
+    HANDLER(BRZ, brz(instruction->operand)) \
+    HANDLER(JUMP, jump(instruction->operand)) \
+    HANDLER(EQ_BRZ, eqBrz(instruction->operand)) \
+    HANDLER(NEQ_BRZ, neqBrz(instruction->operand)) \
+    HANDLER(LT_BRZ, ltBrz(instruction->operand)) \
+    HANDLER(LTE_BRZ, lteBrz(instruction->operand)) \
+    HANDLER(GT_BRZ, gtBrz(instruction->operand)) \
+    HANDLER(GTE_BRZ, gteBrz(instruction->operand)) \
+    HANDLER(NEG, neg()) \
+    HANDLER(ADD, add()) \
+    HANDLER(SUB, sub()) \
+    HANDLER(MUL, mul()) \
+    HANDLER(DIV, div()) \
+    HANDLER(MOD, mod()) \
+    HANDLER(EQ, eq()) \
+    HANDLER(NEQ, neq()) \
+    HANDLER(LT, lt()) \
+    HANDLER(LTE, lte()) \
+    HANDLER(GT, gt()) \
+    HANDLER(GTE, gte()) \
+    HANDLER(PRINT, print()) \
+    HANDLER(PRINT_STR, print(program->string(instruction->operand))) \
+    HANDLER(READ, read()) \
+    HANDLER(END, end()) \
+    HANDLER(END_BP, end(AddressMode::BP)) \
+    HANDLER(END_TOP, end(AddressMode::TOP)) \
+    HANDLER(END_INT, end(Value(instruction->operand))) \
+    HANDLER(END_FLOAT, end(Value(instruction->floatOperand))) \
+    HANDLER(ADD_II, quickBinaryOperation(std::plus<int>(), Opcode::ADD, &StackMachine::add)) \
+    HANDLER(SUB_II, quickBinaryOperation(std::minus<int>(), Opcode::SUB, &StackMachine::sub)) \
+    HANDLER(MUL_II, quickBinaryOperation(std::multiplies<int>(), Opcode::MUL, &StackMachine::mul)) \
+    HANDLER(DIV_II, checkIntDivision(); quickBinaryOperation(std::divides<int>(), Opcode::DIV, &StackMachine::div)) \
+    HANDLER(EQ_II, quickBinaryOperation(std::equal_to<int>(), Opcode::EQ, &StackMachine::eq)) \
+    HANDLER(NEQ_II, quickBinaryOperation(std::not_equal_to<int>(), Opcode::NEQ, &StackMachine::neq)) \
+    HANDLER(LT_II, quickBinaryOperation(std::less<int>(), Opcode::LT, &StackMachine::lt)) \
+    HANDLER(LTE_II, quickBinaryOperation(std::less_equal<int>(), Opcode::LTE, &StackMachine::lte)) \
+    HANDLER(GT_II, quickBinaryOperation(std::greater<int>(), Opcode::GT, &StackMachine::gt)) \
+    HANDLER(GTE_II, quickBinaryOperation(std::greater_equal<int>(), Opcode::GTE, &StackMachine::gte)) \
+    HANDLER(EQ_BRZ_II, quickCompareAndBranch(std::equal_to<int>(), instruction->operand, Opcode::EQ_BRZ, &StackMachine::eqBrz)) \
+    HANDLER(NEQ_BRZ_II, quickCompareAndBranch(std::not_equal_to<int>(), instruction->operand, Opcode::NEQ_BRZ, &StackMachine::neqBrz)) \
+    HANDLER(LT_BRZ_II, quickCompareAndBranch(std::less<int>(), instruction->operand, Opcode::LT_BRZ, &StackMachine::ltBrz)) \
+    HANDLER(LTE_BRZ_II, quickCompareAndBranch(std::less_equal<int>(), instruction->operand, Opcode::LTE_BRZ, &StackMachine::lteBrz)) \
+    HANDLER(GT_BRZ_II, quickCompareAndBranch(std::greater<int>(), instruction->operand, Opcode::GT_BRZ, &StackMachine::gtBrz)) \
+    HANDLER(GTE_BRZ_II, quickCompareAndBranch(std::greater_equal<int>(), instruction->operand, Opcode::GTE_BRZ, &StackMachine::gteBrz))
+
+// Unwinds every dispatch loop, including native JIT frames, back to runProgram.
+// Nothing between here and there owns resources, so skipping those frames is safe.
+void StackMachine::halt(RunStatus status, int exitValue) {
+    runResult.status = status;
+    runResult.exitValue = exitValue;
+    siglongjmp(haltPoint, HALT_JUMP);
+}
+
+void StackMachine::checkpointReached() {
+    if(instructionsExecuted > fuelLimit) outOfFuel();
+    halt(RunStatus::YIELDED, 0);
+}
+
+void StackMachine::outOfFuel() {
+    std::cerr << "Error: out of fuel after " << instructionsExecuted << " instructions" << std::endl;
+    halt(RunStatus::OUT_OF_FUEL, 1);
+}
+
+RunResult StackMachine::runProgram(DispatchMode mode) {
+    if(!program) {
+        std::cerr << "Error: no program loaded" << std::endl;
+        return {RunStatus::ERROR, 1, 0};
+    }
+
+    stackRegion.reset();
+    stackTop = basePointer = frameSize = callDepth = instructionCounter = blockStart = 0;
+    generalPurposeRegister = 0;
+    instructionsExecuted = 0;
+    if(profiler) profiler->attach(*program);
+    if(sampler) sampler->start(*program);
+    return execute(mode);
+}
+
+RunResult StackMachine::resume(DispatchMode mode) {
+    if(!program || (runResult.status != RunStatus::YIELDED && runResult.status != RunStatus::BLOCKED)) {
+        std::cerr << "Error: no suspended run to resume" << std::endl;
+        return {RunStatus::ERROR, 1, 0};
+    }
+    output.hold(false);
+    return execute(mode);
+}
+
+uint64_t StackMachine::instructionCount() const {
+    return instructionsExecuted + (instructionCounter - blockStart);
+}
+
+// Runs from the current state until the program stops or suspends. Every
+// register lives in the VM between calls, so any loop can pick the run up.
+RunResult StackMachine::execute(DispatchMode mode) {
+    // print writes below std::cout, so anything the host printed goes out first
+    std::cout.flush();
+    stackRegion.activate(&haltPoint);
+    runResult = RunResult{};
+    // A suspended run never has more than fuelLimit instructions behind it
+    checkpoint = fuelLimit;
+    if(timeSlice != 0 && timeSlice < fuelLimit - instructionCount()) {
+        checkpoint = instructionCount() + timeSlice;
+    }
+
+    // Guard page faults land here too, with the fault kind as the jump value
+    const int jumped = sigsetjmp(haltPoint, 1);
+    if(jumped == 0) {
+        if(sampler) runProgramSampled();
+        if(profiler) runProgramProfiled();
+        if(mode == DispatchMode::THREADED) runProgramThreaded();
+        if(mode == DispatchMode::JIT) runProgramJit();
+        runProgramSwitch();
+    }
+
+    if(jumped == StackRegion::UNDERFLOW_FAULT || jumped == StackRegion::OVERFLOW_FAULT) {
+        const bool underflow = jumped == StackRegion::UNDERFLOW_FAULT;
+        std::cerr << "Error: Stack " << (underflow ? "underflow" : "overflow") << std::endl;
+        runResult.status = underflow ? RunStatus::STACK_UNDERFLOW : RunStatus::STACK_OVERFLOW;
+        runResult.exitValue = 1;
+    }
+    stackRegion.activate(nullptr);
+    runResult.instructionCount = instructionCount();
+    if(runResult.status == RunStatus::YIELDED || runResult.status == RunStatus::BLOCKED) return runResult;
+
+    output.hold(false);
+    output.flush();
+    if(sampler) sampler->finish();
+    if(profiler) profiler->report(std::cerr);
+    return runResult;
+}
+
+void StackMachine::runProgramSwitch() {
     while(true) {
-        std::string key = instructionQueue[instructionCounter][0];
-        std::string value = instructionQueue[instructionCounter][1];
-
-        // Try and call the correct variant
-        if(instructionImplementationMap.contains(key)) {
-            auto& funcVariant = instructionImplementationMap[key];
-
-            if(std::holds_alternative<std::function<void(std::string)>>(funcVariant)) {
-                std::get<std::function<void(std::string)>>(funcVariant)(value);
-            } else if(std::holds_alternative<std::function<void()>>(funcVariant)) {
-                std::get<std::function<void()>>(funcVariant)();
-            }
-        } else {
-            auto it = labelMap.find(key);
-            if(it != labelMap.end()) {
-                instructionCounter++;
-                continue;
-            }
-            std::cerr << "Error: Instruction " << key << " not found!" <<std::endl;
+        // Pre-increment so branches and calls see the fall-through pc
+        const Instruction *instruction = &code[instructionCounter++];
+
+        switch(ProgramImage::opcode(*instruction)) {
+#define SWITCH_CASE(op, handler) case Opcode::op: handler; break;
+            VM_HANDLERS(SWITCH_CASE)
+#undef SWITCH_CASE
+
+            default:
+                std::cerr << "Error: Instruction " << static_cast<int>(instruction->opcode) << " not found!" << std::endl;
+                break;
         }
+    }
+}
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic" // Labels as values are a GNU extension
+void StackMachine::runProgramThreaded() {
+    // Every handler ends in its own indirect jump, giving the branch predictor
+    // one history slot per opcode instead of a single shared switch jump.
+    void *dispatchTable[static_cast<int>(Opcode::OPCODE_COUNT)];
+#define TABLE_ENTRY(op, handler) dispatchTable[static_cast<int>(Opcode::op)] = &&handle_##op;
+    VM_HANDLERS(TABLE_ENTRY)
+#undef TABLE_ENTRY
+
+    const Instruction *instruction;
+#define DISPATCH() \
+    do { \
+        instruction = &code[instructionCounter++]; \
+        goto *dispatchTable[static_cast<int>(ProgramImage::opcode(*instruction))]; \
+    } while(0)
+
+    DISPATCH();
+
+#define THREADED_CASE(op, handler) handle_##op: handler; DISPATCH();
+    VM_HANDLERS(THREADED_CASE)
+#undef THREADED_CASE
+#undef DISPATCH
+
+    __builtin_unreachable(); // Every handler dispatches onward, halt() leaves the loop
+}
+#pragma GCC diagnostic pop
+#else
+void StackMachine::runProgramThreaded() {
+    // Computed goto is unavailable, fall back to the portable switch loop
+    runProgramSwitch();
+}
+#endif
+
+// Same loop as SWITCH with each instruction timed; the opcode is read before
+// the handler so a quickening rewrite is charged to the generic form that ran
+void StackMachine::runProgramProfiled() {
+    while(true) {
+        const int pc = instructionCounter++;
+        const Instruction *instruction = &code[pc];
+        const Opcode opcode = ProgramImage::opcode(*instruction);
 
-        if(key == "end") {
-            exit(stackTop - 1);
+        profiler->enter(pc, opcode);
+        const uint64_t start = Profiler::readCycleCounter();
+
+        switch(opcode) {
+#define SWITCH_CASE(op, handler) case Opcode::op: handler; break;
+            VM_HANDLERS(SWITCH_CASE)
+#undef SWITCH_CASE
+
+            default:
+                std::cerr << "Error: Instruction " << static_cast<int>(opcode) << " not found!" << std::endl;
+                break;
         }
 
-        instructionCounter++;
+        profiler->leave(opcode, Profiler::readCycleCounter() - start);
     }
 }
 
-bool StackMachine::loadProgramFromFile(const std::string &filename) {
-    std::ifstream programFile(filename);
-    if(!programFile.is_open()) {
-        std::cerr << "Unable to open file " << filename << std::endl;
-        return false;
+// Publishes the pc and the guest call stack for the SIGPROF handler before
+// each instruction; the handlers themselves run unchanged through step()
+void StackMachine::runProgramSampled() {
+    while(true) {
+        const int pc = instructionCounter;
+        const Opcode opcode = ProgramImage::opcode(code[pc]);
+        sampler->setPc(pc);
+
+        if(opcode == Opcode::CALL) sampler->pushCall(pc);
+        else if(opcode == Opcode::RET || opcode == Opcode::RETV) sampler->popCall();
+
+        step();
     }
+}
 
-    int index = 0;
-    std::string instruction;
+// Executes the single instruction at instructionCounter
+void StackMachine::step() {
+    const Instruction *instruction = &code[instructionCounter++];
 
-    while(std::getline(programFile, instruction)) {
-        if(instruction.empty()) continue;
+    switch(ProgramImage::opcode(*instruction)) {
+#define SWITCH_CASE(op, handler) case Opcode::op: handler; break;
+        VM_HANDLERS(SWITCH_CASE)
+#undef SWITCH_CASE
 
-        // Remove ; -->
-        if(const size_t pos = instruction.find(';'); pos != std::string::npos) {
-            instruction.erase(pos);
+        default:
+            std::cerr << "Error: Instruction " << static_cast<int>(instruction->opcode) << " not found!" << std::endl;
+            break;
+    }
+}
+
+#undef VM_HANDLERS
+
+// Native code hands over every instruction it does not translate itself
+int64_t StackMachine::jitStep(JitFrame *frame, int32_t pc) {
+    StackMachine &vm = *frame->vm;
+    vm.stackTop = static_cast<int>(frame->sp - vm.memoryStack);
+    vm.basePointer = static_cast<int>(frame->bp - vm.memoryStack);
+    vm.generalPurposeRegister = frame->gpr;
+    vm.instructionCounter = vm.blockStart = pc;
+    vm.instructionsExecuted = frame->executed;
+    vm.callDepth = static_cast<int>(frame->callTop - frame->callBottom);
+    vm.frameSize = frame->frameSize;
+    if(vm.instructionsExecuted > vm.checkpoint) vm.checkpointReached(); // Native loop headers come here once it is passed
+
+    vm.step();
+
+    frame->sp = vm.memoryStack + vm.stackTop;
+    frame->bp = vm.memoryStack + vm.basePointer;
+    frame->gpr = vm.generalPurposeRegister;
+    frame->callTop = frame->callBottom + vm.callDepth;
+    frame->frameSize = vm.frameSize;
+    frame->executed = vm.instructionsExecuted + (vm.instructionCounter - vm.blockStart);
+    return vm.instructionCounter;
+}
+
+// Native code counts its own instructions; a guard page fault inside it
+// reports the count as of the last call into the VM
+void StackMachine::runProgramJit() {
+    if(!jit) {
+        jit = std::make_unique<Jit>();
+        if(!jit->compile(*program, &StackMachine::jitStep)) {
+            std::cerr << "Warning: JIT unavailable on this platform, interpreting instead" << std::endl;
+            jit.reset();
+            runProgramSwitch();
         }
+    }
 
-        std::istringstream instructionStream(instruction);
-        std::string token;
-        if(!(instructionStream >> token)) continue;
+    JitFrame frame{this, memoryStack + stackTop, memoryStack + basePointer, generalPurposeRegister, nullptr, instructionCount(), checkpoint,
+                   memoryStack, memoryStack + stackRegion.size(),
+                   callStack.get() + callDepth, callStack.get(), callStack.get() + MAX_CALL_DEPTH, frameSize};
+    jit->run(frame, instructionCounter);
 
-        // Add labels to the label map as they are found
-        if(!instructionImplementationMap.contains(token)) {
-            labelMap[token] = index;
-        }
+    // jitStep never asks native code to stop; halt() is the only way out
+    std::cerr << "Error: JIT code returned without halting" << std::endl;
+    halt(RunStatus::ERROR, 1);
+}
 
-        std::string argument;
-        if (instructionStream >> std::ws && instructionStream.peek() == '"') {  // Handle quoted string argument
-            instructionStream.get(); // Remove the opening quote
-            std::getline(instructionStream, argument, '"'); // Read until closing quote
-        } else if(!(instructionStream >> argument)) {
-            argument.clear();
-        }
+// Binary images run in place; text is assembled and then loaded the same way
+std::shared_ptr<ProgramImage> StackMachine::loadImage(const std::string &filename) {
+    if(!ProgramImage::isImageFile(filename)) {
+        Program assembled;
+        if(!assembleFile(filename, assembled)) return nullptr;
+        return loadImage(assembled);
+    }
+
+    auto image = std::make_shared<ProgramImage>();
+    if(!image->loadFile(filename)) return nullptr;
+    return checkFrameAccesses(*image) ? image : nullptr;
+}
 
-        instructionQueue.push_back({token, argument});
-        index++;
+std::shared_ptr<ProgramImage> StackMachine::loadImage(const Program &assembled) {
+    auto image = std::make_shared<ProgramImage>();
+    if(!image->load(assembled)) return nullptr;
+    return checkFrameAccesses(*image) ? image : nullptr;
+}
+
+// Local accesses are unchecked, so an offset must not reach past the guard page
+bool StackMachine::checkFrameAccesses(const ProgramImage &image) {
+    for (size_t pc = 0; pc < image.size(); pc++) {
+        const Instruction &instruction = image.code()[pc];
+        if ((instruction.opcode == Opcode::LOAD_LOCAL || instruction.opcode == Opcode::STORE_LOCAL) &&
+            (instruction.operand < 0 || instruction.operand >= static_cast<int>(StackRegion::GUARD_SLOTS))) {
+            std::cerr << "Error: local offset " << instruction.operand << " is out of range" << std::endl;
+            return false;
+        }
+        if (instruction.opcode == Opcode::ENTER &&
+            (enterParams(instruction.operand) > enterFrameSize(instruction.operand) || enterFrameSize(instruction.operand) > MAX_FRAME_SIZE)) {
+            std::cerr << "Error: enter at " << pc << " has an invalid frame" << std::endl;
+            return false;
+        }
     }
+    return true;
+}
 
-//    if (index >= MAX_INSTRUCTION_COUNT) {
-//        std::cerr << "Warning: Program truncated to fit instruction memory" << std::endl;
-//    }
+// Keeps the compiled JIT code when the same image is set again
+void StackMachine::setProgram(std::shared_ptr<ProgramImage> image) {
+    if(image == program) return;
+    program = std::move(image);
+    code = program ? program->code() : nullptr;
+    jit.reset();
+}
 
+bool StackMachine::loadProgramFromFile(const std::string &filename) {
+    std::shared_ptr<ProgramImage> image = loadImage(filename);
+    if(!image) return false;
+    setProgram(std::move(image));
     return true;
 }
 
+void StackMachine::setInput(std::istream &stream) {
+    input.setStream(stream);
+}
+
+void StackMachine::setInput(int fd) {
+    input.setFileDescriptor(fd);
+}
+
+void StackMachine::setOutput(std::ostream &stream) {
+    output.setStream(stream);
+}
+
+void StackMachine::setFuelLimit(uint64_t limit) {
+    fuelLimit = limit;
+}
+
+void StackMachine::setTimeSlice(uint64_t instructions) {
+    timeSlice = instructions;
+}
+
+void StackMachine::setLineBuffered(bool enabled) {
+    output.setLineBuffered(enabled);
+}
+
+void StackMachine::enableProfiling() {
+    profiler = std::make_unique<Profiler>();
+}
+
+void StackMachine::enableSampling(const std::string &outputFile) {
+    sampler = std::make_unique<Sampler>(outputFile);
+}
+
 void StackMachine::printInstructionQueue() const {
-    int index = 0;
-    for (auto &instruction : instructionQueue) {
-        if(instruction[0].empty() && instruction[1].empty()) continue;
-        std::cout << "Instruction " << index++ << ": " << instruction[0] << " " << instruction[1] << "\n";
+    for (size_t pc = 0; pc < program->size(); pc++) {
+        std::cout << "Instruction " << pc << ": " << program->disassemble(pc) << "\n";
     }
 }
 
 void StackMachine::printLabelMap() const {
-    for (const auto& entry : labelMap) {
-        std::cout << "Location: " << entry.second << ", Label: " << entry.first << std::endl;
+    for (size_t i = 0; i < program->labelTableSize(); i++) {
+        if (program->labelIsFunction(i)) continue;
+        std::cout << "Location: " << program->labelTarget(i) << ", Label: " << program->labelName(i) << std::endl;
     }
 }
@@ -3,49 +3,145 @@
 
 #define DEBUG 0
 
-#include <unordered_map>
-#include <variant>
+#include <csetjmp>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
 #include <vector>
-#include <array>
-#include <functional>
 #include <string>
 
-using Value = std::variant<int, float>;
+#include "BufferedIo.hpp"
+#include "Bytecode.hpp"
+#include "ProgramImage.hpp"
+#include "Profiler.hpp"
+#include "Sampler.hpp"
+#include "StackRegion.hpp"
+#include "Value.hpp"
 
+enum class AddressMode { ABSOLUTE, BP, TOP };
+
+// SWITCH runs a portable switch loop, THREADED uses direct-threaded dispatch
+// through computed goto where the compiler supports it, JIT compiles the
+// program to native code first (x86-64 Linux, otherwise SWITCH).
+enum class DispatchMode { SWITCH, THREADED, JIT };
+
+// YIELDED (time slice used up) and BLOCKED (read() found no input ready on a
+// non-blocking source) suspend the run; resume() continues it where it stopped.
+enum class RunStatus { HALTED, ERROR, STACK_OVERFLOW, STACK_UNDERFLOW, OUT_OF_FUEL, YIELDED, BLOCKED };
+
+// Outcome of one runProgram or resume call. exitValue is the value the program
+// ended or returned from main with, 0 while suspended, and 1 for any other status.
+struct RunResult {
+    RunStatus status = RunStatus::HALTED;
+    int exitValue = 0;
+    uint64_t instructionCount = 0;
+};
+
+class Jit;
+struct JitFrame;
+
+// Execution context for a ProgramImage: stack, registers and pc. Contexts are
+// cheap next to the image they share, so a thread runs its own StackMachine.
 class StackMachine {
+public:
+    static constexpr int MAX_CALL_DEPTH = 1 << 20;
+
 private:
-    std::unordered_map<std::string, std::variant<std::function<void(std::string)>, std::function<void()>>> instructionImplementationMap;
     Value generalPurposeRegister = 0; // General Purpose Register
 
     // Instruction model
-    std::vector<std::array<std::string, 2>> instructionQueue;
-    std::unordered_map<std::string, int> labelMap;
+    std::shared_ptr<ProgramImage> program; // Shared with every other VM running it
+    const Instruction *code = nullptr; // program->code(), cached for the dispatch loops
     int instructionCounter = 0; // (pc) Next instruction to execute
+    std::unique_ptr<Profiler> profiler;
+    std::unique_ptr<Sampler> sampler;
+    std::unique_ptr<Jit> jit; // Compiled on this VM's first JIT run of the program
+
+    // Run state; every way a program stops jumps back to haltPoint in runProgram
+    sigjmp_buf haltPoint;
+    RunResult runResult;
+    uint64_t instructionsExecuted = 0; // Up to blockStart
+    int blockStart = 0; // pc the current straight-line run started at
+    uint64_t fuelLimit = UINT64_MAX; // Instruction budget of a run
+    uint64_t timeSlice = 0; // Instructions between yields, 0 to never yield
+    uint64_t checkpoint = UINT64_MAX; // Count at which the next control transfer stops for fuel or a yield
+    bool suspendBeforeRead = false;
 
     // Stack model
-    std::vector<Value> memoryStack;
+    StackRegion stackRegion;
+    Value *memoryStack; // Base of stackRegion; pushes and pops run unchecked into its guard pages
     int stackTop = 0; // (top) Next open slot in memory stack
     int basePointer = 0; // (bp) Base frame of current function
-    std::vector<int> returnAddressStack;
+    int frameSize = 0; // Slots from bp the current function's enter reserved
+
+    // Callers of the running function, innermost last; see CallFrame
+    std::unique_ptr<CallFrame[]> callStack;
+    int callDepth = 0;
+
+    // Program I/O, stdin and stdout unless redirected
+    InputReader input;
+    OutputBuffer output;
 
     int validAddress(const int addr);
+    void setBasePointer(int value);
+    void transferTo(int target);
+    void checkIntDivision();
+    [[noreturn]] void halt(RunStatus status, int exitValue);
+    [[noreturn]] void checkpointReached();
+    [[noreturn]] void outOfFuel();
+    RunResult execute(DispatchMode mode);
+    uint64_t instructionCount() const;
+    [[noreturn]] void runProgramSwitch();
+    [[noreturn]] void runProgramThreaded();
+    [[noreturn]] void runProgramJit();
+    [[noreturn]] void runProgramProfiled();
+    [[noreturn]] void runProgramSampled();
+    void step();
+    static bool checkFrameAccesses(const ProgramImage &image);
+    static int64_t jitStep(JitFrame *frame, int32_t pc);
+
+    template<typename Operation>
+    void binaryOperation(Operation operation, Opcode quickened);
+    template<typename Comparison>
+    void compareAndBranch(Comparison comparison, int target, Opcode quickened);
+    template<typename Operation>
+    void quickBinaryOperation(Operation operation, Opcode generic, void (StackMachine::*fallback)());
+    template<typename Comparison>
+    void quickCompareAndBranch(Comparison comparison, int target, Opcode generic, void (StackMachine::*fallback)(int));
 
 public:
-    StackMachine();
+    explicit StackMachine(size_t stackSlots = StackRegion::DEFAULT_SLOTS);
+    ~StackMachine();
+    StackMachine(const StackMachine &) = delete;
+    StackMachine &operator=(const StackMachine &) = delete;
 
     void push(const std::string &arg);
-    void pop(const std::string &arg);
+    void push(const Value &value);
+    void pushBasePointerSlot();
+    void pushTop();
+    void pop(AddressMode mode);
     void pop();
+    Value popValue();
     void dup();
-    void load(const std::string &arg);
-    void save(const std::string &arg);
-    void store(const std::string &arg);
-    void call(const std::string &arg);
+    void load(AddressMode mode);
+    void save(AddressMode mode);
+    void store(AddressMode mode);
+    void loadLocal(int offset);
+    void storeLocal(int offset);
+    void call(int target);
+    void enter(int operand);
     void ret();
     void retv();
-    void brt(const std::string &arg);
-    void brz(const std::string &arg);
-    void jump(const std::string &arg);
+    void brt(int target);
+    void brz(int target);
+    void jump(int target);
+    void eqBrz(int target);
+    void neqBrz(int target);
+    void ltBrz(int target);
+    void lteBrz(int target);
+    void gtBrz(int target);
+    void gteBrz(int target);
 
     void neg();
     void add();
@@ -61,11 +157,49 @@ public:
     void gt();
     void gte();
 
-    void print(const std::string &arg);
+    void print();
+    void print(std::string_view arg);
     void read();
-    void end(const std::string &arg);
-    bool runProgram();
+    void end();
+    void end(AddressMode mode);
+    void end(const Value &value);
+    // Runs the loaded program from the start on a fresh stack. Can be called
+    // again, on the same program or after loading another one.
+    RunResult runProgram(DispatchMode mode = DispatchMode::SWITCH);
+    // Continues a YIELDED or BLOCKED run, in any dispatch mode. The program must not be changed in between.
+    RunResult resume(DispatchMode mode = DispatchMode::SWITCH);
+    // Makes the run stop as BLOCKED when it next reaches read(), before taking
+    // any input, with its output held back so a snapshot can carry it
+    void suspendAtNextRead();
+    // Writes a suspended run to a .vsms file: registers, live stack and pending output.
+    // Input is not part of it; a restored run reads from whatever input it is given.
+    bool saveSnapshot(const std::string &filename) const;
+    // Puts the loaded program into the state saved by saveSnapshot; resume() continues it
+    bool restoreSnapshot(const std::string &filename);
+    // Loads and validates a program once; the image can then be given to any
+    // number of StackMachines, which may run it concurrently on their own threads
+    static std::shared_ptr<ProgramImage> loadImage(const std::string &filename);
+    static std::shared_ptr<ProgramImage> loadImage(const Program &assembled);
+    void setProgram(std::shared_ptr<ProgramImage> image);
     bool loadProgramFromFile(const std::string &filename);
+    // Where read takes its input and print writes; the streams must outlive the runs using them
+    void setInput(std::istream &stream);
+    // Reads from fd; if it is non-blocking, read() with nothing to read suspends the run as BLOCKED
+    void setInput(int fd);
+    void setOutput(std::ostream &stream);
+    // Stops runs with OUT_OF_FUEL once they have executed more than limit instructions.
+    // The budget is checked on jumps, calls and returns, so a run overshoots it by
+    // at most one straight-line stretch of code.
+    void setFuelLimit(uint64_t limit);
+    // Suspends runs as YIELDED after about every instructions instructions, at the
+    // same control transfers the fuel budget is checked at. 0 never yields.
+    void setTimeSlice(uint64_t instructions);
+    // Writes output after every line instead of when the buffer fills or the run ends
+    void setLineBuffered(bool enabled);
+    // Runs the interpreter with per-opcode counters and reports after each run, whatever the dispatch mode
+    void enableProfiling();
+    // Samples the guest call stack on a CPU timer and writes folded stacks to outputFile after each run
+    void enableSampling(const std::string &outputFile);
     void printInstructionQueue() const;
     void printLabelMap() const;
 };
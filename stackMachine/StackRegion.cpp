@@ -0,0 +1,121 @@
+#include "StackRegion.hpp"
+
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+    struct GuardBounds {
+        const char *lowGuard = nullptr;  // [lowGuard, stackBase) faults on underflow
+        const char *stackBase = nullptr;
+        const char *stackEnd = nullptr;  // [stackEnd, highGuard) faults on overflow
+        const char *highGuard = nullptr;
+        sigjmp_buf *onFault = nullptr;
+    };
+
+    thread_local GuardBounds activeBounds;
+
+    void leaveFault(const GuardBounds &bounds, int fault, const char *message) {
+        if(bounds.onFault) siglongjmp(*bounds.onFault, fault);
+
+        // Only async-signal-safe calls from here on
+        ssize_t ignored = write(STDERR_FILENO, message, strlen(message));
+        (void)ignored;
+        _exit(1);
+    }
+
+    void guardFaultHandler(int signal, siginfo_t *info, void *) {
+        const auto *address = static_cast<const char *>(info->si_addr);
+        const GuardBounds &bounds = activeBounds;
+
+        if(address >= bounds.lowGuard && address < bounds.stackBase) {
+            leaveFault(bounds, StackRegion::UNDERFLOW_FAULT, "Error: Stack underflow\n");
+        }
+        if(address >= bounds.stackEnd && address < bounds.highGuard) {
+            leaveFault(bounds, StackRegion::OVERFLOW_FAULT, "Error: Stack overflow\n");
+        }
+
+        // Not a VM stack fault; let the fault happen again with the default action
+        std::signal(signal, SIG_DFL);
+    }
+
+    void installFaultHandler() {
+        static std::once_flag installed;
+        std::call_once(installed, [] {
+            struct sigaction action{};
+            action.sa_sigaction = guardFaultHandler;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGSEGV, &action, nullptr);
+        });
+    }
+
+    size_t roundToPage(size_t bytes) {
+        const auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return (bytes + pageSize - 1) / pageSize * pageSize;
+    }
+}
+
+StackRegion::StackRegion(size_t slots) {
+    const size_t guardBytes = roundToPage(GUARD_BYTES);
+    const size_t stackBytes = roundToPage(slots * sizeof(Value));
+    mappingBytes = guardBytes + stackBytes + guardBytes;
+
+    // Reserve everything inaccessible, then open up the middle. Pages are only
+    // committed when first touched, so a large capacity costs address space only.
+    mapping = mmap(nullptr, mappingBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mapping == MAP_FAILED) {
+        mapping = nullptr;
+        throw std::bad_alloc();
+    }
+
+    char *stackStart = static_cast<char *>(mapping) + guardBytes;
+    if(mprotect(stackStart, stackBytes, PROT_READ | PROT_WRITE) != 0) {
+        munmap(mapping, mappingBytes);
+        mapping = nullptr;
+        throw std::bad_alloc();
+    }
+
+    // Zeroed anonymous memory already reads as Value(0). The capacity is rounded
+    // up to whole pages so the first slot past the end is always a guard page.
+    base = reinterpret_cast<Value *>(stackStart);
+    capacity = stackBytes / sizeof(Value);
+
+    installFaultHandler();
+}
+
+StackRegion::~StackRegion() {
+    if(activeBounds.stackBase == reinterpret_cast<const char *>(base)) {
+        activeBounds = GuardBounds{};
+    }
+    if(mapping) munmap(mapping, mappingBytes);
+}
+
+void StackRegion::activate(sigjmp_buf *onFault) const {
+    const auto *start = static_cast<const char *>(mapping);
+    activeBounds = {start, reinterpret_cast<const char *>(base), reinterpret_cast<const char *>(base + capacity), start + mappingBytes, onFault};
+}
+
+void StackRegion::reset() {
+    // Dropping file-backed pages would bring the file back, so those are replaced outright
+    if(fileBytes != 0) {
+        mmap(base, fileBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        fileBytes = 0;
+    }
+    madvise(base, capacity * sizeof(Value), MADV_DONTNEED);
+}
+
+bool StackRegion::mapFile(int fd, size_t offset, size_t bytes) {
+    bytes = roundToPage(bytes);
+    if(bytes > capacity * sizeof(Value) || offset != roundToPage(offset)) return false;
+    if(bytes == 0) return true;
+
+    void *mapped = mmap(base, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, static_cast<off_t>(offset));
+    if(mapped == MAP_FAILED) return false;
+    fileBytes = bytes;
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef STACKREGION_HPP
+#define STACKREGION_HPP
+
+#include <csetjmp>
+#include <cstddef>
+
+#include "Value.hpp"
+
+// Fixed-capacity VM stack reserved once with mmap. A PROT_NONE guard region
+// sits on each side, so running off either end faults instead of needing a
+// bounds check on every push and pop. The SIGSEGV handler installed with the
+// first region turns the fault into a jump back to the running VM.
+class StackRegion {
+private:
+    void *mapping = nullptr;
+    size_t mappingBytes = 0;
+    Value *base = nullptr;
+    size_t capacity = 0;
+    size_t fileBytes = 0; // Bottom of the stack currently mapped from a snapshot file
+
+public:
+    static constexpr size_t DEFAULT_SLOTS = 16 * 1024 * 1024;
+    static constexpr size_t GUARD_BYTES = 64 * 1024;
+    static constexpr size_t GUARD_SLOTS = GUARD_BYTES / sizeof(Value);
+
+    // Values the fault handler passes to siglongjmp
+    static constexpr int UNDERFLOW_FAULT = 1;
+    static constexpr int OVERFLOW_FAULT = 2;
+
+    explicit StackRegion(size_t slots = DEFAULT_SLOTS);
+    ~StackRegion();
+
+    StackRegion(const StackRegion &) = delete;
+    StackRegion &operator=(const StackRegion &) = delete;
+
+    [[nodiscard]] Value *data() const { return base; }
+    [[nodiscard]] size_t size() const { return capacity; }
+
+    // Makes this the region the fault handler watches on this thread; a guard
+    // page hit jumps to onFault, or reports and exits when it is null
+    void activate(sigjmp_buf *onFault) const;
+    // Drops every touched page so the next run starts from zeroed memory again
+    void reset();
+    // Maps bytes of fd from offset (page-aligned) over the bottom of the stack,
+    // copy-on-write, so restoring a snapshot only reads the pages a run touches
+    bool mapFile(int fd, size_t offset, size_t bytes);
+};
+
+#endif //STACKREGION_HPP
@@ -0,0 +1,59 @@
+#ifndef VALUE_HPP
+#define VALUE_HPP
+
+#include <cstdint>
+#include <ostream>
+#include <type_traits>
+
+// Tagged int/float cell used for the stack, frame slots and registers.
+// Eight bytes and trivially copyable, so copies are plain register moves and
+// a type check is a single compare of the tag word.
+class Value {
+public:
+    enum class Type : uint32_t { INT = 0, FLOAT = 1 };
+
+private:
+    Type type;
+    union {
+        int32_t intValue;
+        float floatValue;
+    };
+
+public:
+    constexpr Value() : type(Type::INT), intValue(0) {}
+    constexpr Value(int value) : type(Type::INT), intValue(value) {} // NOLINT(google-explicit-constructor)
+    constexpr Value(float value) : type(Type::FLOAT), floatValue(value) {} // NOLINT(google-explicit-constructor)
+
+    [[nodiscard]] constexpr Type getType() const { return type; }
+    [[nodiscard]] constexpr bool isInt() const { return type == Type::INT; }
+    [[nodiscard]] constexpr bool isFloat() const { return type == Type::FLOAT; }
+
+    // Unchecked accessors, only valid for the matching tag
+    [[nodiscard]] constexpr int asInt() const { return intValue; }
+    [[nodiscard]] constexpr float asFloat() const { return floatValue; }
+
+    // Promotes ints the same way C++ arithmetic would
+    [[nodiscard]] constexpr float toFloat() const { return isInt() ? static_cast<float>(intValue) : floatValue; }
+
+    // One branch for the common int/int case: INT is tag 0
+    [[nodiscard]] static constexpr bool bothInt(const Value &a, const Value &b) {
+        return (static_cast<uint32_t>(a.type) | static_cast<uint32_t>(b.type)) == 0;
+    }
+
+    // Applies a generic operation with int/float promotion, e.g. int + float -> float
+    template<typename Operation>
+    static constexpr Value apply(Operation operation, const Value &a, const Value &b) {
+        if(bothInt(a, b)) return operation(a.intValue, b.intValue);
+        return operation(a.toFloat(), b.toFloat());
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Value &value) {
+        if(value.isInt()) return os << value.intValue;
+        return os << value.floatValue;
+    }
+};
+
+static_assert(sizeof(Value) == 8, "Value should stay one machine word");
+static_assert(std::is_trivially_copyable_v<Value>, "Value must be trivially copyable");
+
+#endif //VALUE_HPP
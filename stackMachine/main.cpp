@@ -3,17 +3,86 @@
 #include "StackMachine.hpp"
 
 int main(int argc, char* argv[]) {
-    if(argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <program_file>" << std::endl;
+    std::string programFile;
+    DispatchMode dispatchMode = DispatchMode::SWITCH;
+    size_t stackSlots = StackRegion::DEFAULT_SLOTS;
+    uint64_t fuelLimit = UINT64_MAX;
+    bool profile = false;
+    bool lineBuffered = false;
+    std::string sampleFile;
+    std::string imageFile;
+    std::string snapshotFile;
+    std::string restoreFile;
+    bool includeDebug = true;
+
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--dispatch=switch") {
+            dispatchMode = DispatchMode::SWITCH;
+        } else if(arg == "--dispatch=threaded") {
+            dispatchMode = DispatchMode::THREADED;
+        } else if(arg == "--jit") {
+            dispatchMode = DispatchMode::JIT;
+        } else if(arg == "--profile") {
+            profile = true;
+        } else if(arg == "--line-buffered") {
+            lineBuffered = true;
+        } else if(arg.starts_with("--sample=")) {
+            sampleFile = arg.substr(std::string("--sample=").size());
+        } else if(arg.starts_with("--fuel=")) {
+            try {
+                fuelLimit = std::stoull(arg.substr(std::string("--fuel=").size()));
+            } catch(const std::exception &) {
+                fuelLimit = 0;
+            }
+            if(fuelLimit == 0) {
+                std::cerr << "Invalid fuel limit: " << arg << std::endl;
+                return 1;
+            }
+        } else if(arg.starts_with("--stack-size=")) {
+            try {
+                stackSlots = std::stoul(arg.substr(std::string("--stack-size=").size()));
+            } catch(const std::exception &) {
+                stackSlots = 0;
+            }
+            if(stackSlots == 0) {
+                std::cerr << "Invalid stack size: " << arg << std::endl;
+                return 1;
+            }
+        } else if(arg.starts_with("--output=")) {
+            imageFile = arg.substr(std::string("--output=").size());
+        } else if(arg.starts_with("--snapshot=")) {
+            snapshotFile = arg.substr(std::string("--snapshot=").size());
+        } else if(arg.starts_with("--restore=")) {
+            restoreFile = arg.substr(std::string("--restore=").size());
+        } else if(arg == "--strip-debug") {
+            includeDebug = false;
+        } else if(arg.starts_with("--")) {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        } else {
+            programFile = arg;
+        }
+    }
+
+    if(programFile.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--dispatch=switch|threaded] [--jit] [--profile] [--sample=file] [--line-buffered] [--stack-size=slots] [--fuel=instructions] [--output=image [--strip-debug]] [--snapshot=file | --restore=file] <program_file>" << std::endl;
         return 1;
     }
 
-    std::cout << "C++ based Stack Machine evaluating " << argv[1] << "\n" << std::endl;
+    // Assemble a .vsm file into a binary image instead of running it
+    if(!imageFile.empty()) {
+        Program program;
+        if(!assembleFile(programFile, program)) return 1;
+        return ProgramImage::writeFile(program, imageFile, includeDebug) ? 0 : 1;
+    }
+
+    std::cout << "C++ based Stack Machine evaluating " << programFile << "\n" << std::endl;
 
-    StackMachine stackMachine;
+    StackMachine stackMachine(stackSlots);
 
-    if(!stackMachine.loadProgramFromFile(argv[1])) {
-        std::cerr << "Error: " << argv[1] << " does not exist" << std::endl;
+    if(!stackMachine.loadProgramFromFile(programFile)) {
+        std::cerr << "Error: unable to load " << programFile << std::endl;
         return 1;
     }
 
@@ -22,7 +91,28 @@ int main(int argc, char* argv[]) {
     stackMachine.printLabelMap();
     std::cout << std::endl;
 
-    stackMachine.runProgram();
+    stackMachine.setFuelLimit(fuelLimit);
+    if(lineBuffered) stackMachine.setLineBuffered(true);
+    if(profile) stackMachine.enableProfiling();
+    if(!sampleFile.empty()) stackMachine.enableSampling(sampleFile);
+
+    // Runs the start-up work once and saves the state at the first read
+    if(!snapshotFile.empty()) {
+        stackMachine.suspendAtNextRead();
+        const RunResult result = stackMachine.runProgram(dispatchMode);
+        if(result.status != RunStatus::BLOCKED) {
+            std::cerr << "Warning: " << programFile << " stopped before reaching read(), no snapshot written" << std::endl;
+            return result.exitValue;
+        }
+        return stackMachine.saveSnapshot(snapshotFile) ? 0 : 1;
+    }
+
+    // Picks up from a snapshot of this program instead of starting over
+    if(!restoreFile.empty()) {
+        if(!stackMachine.restoreSnapshot(restoreFile)) return 1;
+        return stackMachine.resume(dispatchMode).exitValue;
+    }
 
-    return 0;
+    const RunResult result = stackMachine.runProgram(dispatchMode);
+    return result.exitValue;
 }
@@ -0,0 +1,62 @@
+#include "GreenScheduler.hpp"
+
+#include <cerrno>
+#include <utility>
+
+#include <poll.h>
+
+GreenScheduler::GreenScheduler(DispatchMode dispatchMode, uint64_t timeSlice) : dispatchMode(dispatchMode), timeSlice(timeSlice) {}
+
+size_t GreenScheduler::add(StackMachine &vm, int inputFd) {
+    vm.setTimeSlice(timeSlice);
+    sessions.push_back({&vm, inputFd});
+    ready.push_back(sessions.size() - 1);
+    return sessions.size() - 1;
+}
+
+// Moves every blocked session whose input became readable (or hung up) to the ready queue
+void GreenScheduler::wakeReadable(int timeoutMs) {
+    std::vector<pollfd> descriptors;
+    for(size_t session : blocked) {
+        descriptors.push_back({sessions[session].inputFd, POLLIN, 0});
+    }
+
+    int readable;
+    do {
+        readable = poll(descriptors.data(), descriptors.size(), timeoutMs);
+    } while(readable < 0 && errno == EINTR);
+    if(readable <= 0) return;
+
+    std::vector<size_t> stillBlocked;
+    for(size_t i = 0; i < blocked.size(); i++) {
+        if(descriptors[i].revents != 0) ready.push_back(blocked[i]);
+        else stillBlocked.push_back(blocked[i]);
+    }
+    blocked = std::move(stillBlocked);
+}
+
+void GreenScheduler::run(const FinishFunction &onFinish) {
+    while(!ready.empty() || !blocked.empty()) {
+        // Sleep only when nobody can run; otherwise just check for input in passing
+        if(!blocked.empty()) wakeReadable(ready.empty() ? -1 : 0);
+        if(ready.empty()) continue;
+
+        const size_t current = ready.front();
+        ready.pop_front();
+        Session &session = sessions[current];
+
+        const RunResult result = session.started ? session.vm->resume(dispatchMode) : session.vm->runProgram(dispatchMode);
+        session.started = true;
+
+        if(result.status == RunStatus::YIELDED) {
+            ready.push_back(current);
+        } else if(result.status == RunStatus::BLOCKED && session.inputFd >= 0) {
+            blocked.push_back(current);
+        } else if(result.status == RunStatus::BLOCKED) {
+            // No descriptor to wait on; try again after everyone else has had a turn
+            ready.push_back(current);
+        } else {
+            onFinish(current, result);
+        }
+    }
+}
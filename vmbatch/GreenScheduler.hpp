@@ -0,0 +1,48 @@
+#ifndef GREENSCHEDULER_HPP
+#define GREENSCHEDULER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include "../stackMachine/StackMachine.hpp"
+
+// Multiplexes many StackMachines on the calling thread. Each VM runs for one
+// time slice and yields at its next jump, call or return; VMs whose read()
+// finds a non-blocking input empty are parked until poll(2) reports their
+// descriptor readable. Every VM keeps its own stack and registers, so a
+// session costs a StackMachine rather than an OS thread.
+class GreenScheduler {
+public:
+    // Called on the scheduler's thread as each session stops for good
+    using FinishFunction = std::function<void(size_t session, const RunResult &result)>;
+
+private:
+    struct Session {
+        StackMachine *vm;
+        int inputFd;
+        bool started = false;
+    };
+
+    DispatchMode dispatchMode;
+    uint64_t timeSlice;
+    std::vector<Session> sessions;
+    std::deque<size_t> ready;
+    std::vector<size_t> blocked;
+
+    void wakeReadable(int timeoutMs);
+
+public:
+    GreenScheduler(DispatchMode dispatchMode, uint64_t timeSlice);
+
+    // vm must have its program and I/O set and outlive run(). inputFd is the
+    // descriptor to wait on when the session blocks on input, -1 if it never does.
+    size_t add(StackMachine &vm, int inputFd = -1);
+
+    // Round-robins the sessions until every one of them has stopped
+    void run(const FinishFunction &onFinish);
+};
+
+#endif //GREENSCHEDULER_HPP
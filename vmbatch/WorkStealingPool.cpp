@@ -0,0 +1,62 @@
+#include "WorkStealingPool.hpp"
+
+#include <algorithm>
+#include <thread>
+
+WorkStealingPool::WorkStealingPool(size_t workerCount) : workerCount(std::max<size_t>(workerCount, 1)) {
+    for(size_t i = 0; i < this->workerCount; i++) {
+        queues.push_back(std::make_unique<WorkerQueue>());
+    }
+}
+
+bool WorkStealingPool::takeOwn(size_t worker, size_t &index) {
+    WorkerQueue &queue = *queues[worker];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if(queue.tasks.empty()) return false;
+
+    index = queue.tasks.back();
+    queue.tasks.pop_back();
+    return true;
+}
+
+// Victims are tried in order starting after the thief, spreading thieves out
+bool WorkStealingPool::steal(size_t thief, size_t &index) {
+    for(size_t offset = 1; offset < workerCount; offset++) {
+        WorkerQueue &victim = *queues[(thief + offset) % workerCount];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if(victim.tasks.empty()) continue;
+
+        index = victim.tasks.front();
+        victim.tasks.pop_front();
+        return true;
+    }
+    return false;
+}
+
+// Tasks never schedule more tasks, so once every queue is empty the batch is drained
+void WorkStealingPool::work(size_t worker, const Task &task) {
+    size_t index;
+    while(takeOwn(worker, index) || steal(worker, index)) {
+        task(worker, index);
+    }
+}
+
+void WorkStealingPool::run(size_t taskCount, const Task &task) {
+    // Contiguous blocks, reversed so each worker runs its block front to back
+    const size_t blockSize = (taskCount + workerCount - 1) / workerCount;
+    for(size_t worker = 0; worker < workerCount; worker++) {
+        const size_t begin = std::min(taskCount, worker * blockSize);
+        const size_t end = std::min(taskCount, begin + blockSize);
+        for(size_t index = end; index > begin; index--) {
+            queues[worker]->tasks.push_back(index - 1);
+        }
+    }
+
+    std::vector<std::thread> threads;
+    for(size_t worker = 1; worker < workerCount; worker++) {
+        threads.emplace_back(&WorkStealingPool::work, this, worker, std::cref(task));
+    }
+    work(0, task);
+
+    for(auto &thread : threads) thread.join();
+}
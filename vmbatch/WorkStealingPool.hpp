@@ -0,0 +1,42 @@
+#ifndef WORKSTEALINGPOOL_HPP
+#define WORKSTEALINGPOOL_HPP
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Runs a fixed batch of tasks on a set of worker threads. Each worker starts
+// with a contiguous block of task indices in its own deque and takes work from
+// the back of it; a worker that runs dry steals from the front of the others',
+// so a few long jobs never leave the rest of the pool idle.
+class WorkStealingPool {
+public:
+    // Called with the index of the worker running the task and the task index
+    using Task = std::function<void(size_t worker, size_t index)>;
+
+private:
+    struct alignas(64) WorkerQueue {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    size_t workerCount;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+
+    bool takeOwn(size_t worker, size_t &index);
+    bool steal(size_t thief, size_t &index);
+    void work(size_t worker, const Task &task);
+
+public:
+    explicit WorkStealingPool(size_t workerCount);
+
+    [[nodiscard]] size_t size() const { return workerCount; }
+
+    // Runs task for every index in [0, taskCount) and returns once all have finished
+    void run(size_t taskCount, const Task &task);
+};
+
+#endif //WORKSTEALINGPOOL_HPP
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../stackMachine/StackMachine.hpp"
+#include "GreenScheduler.hpp"
+#include "WorkStealingPool.hpp"
+
+// Runs every (program, stdin file) pair of a manifest inside this process on a
+// work-stealing pool. Programs are loaded once and shared by all jobs using
+// them; each worker thread reuses one VM for all the jobs it runs. With
+// --green every job gets its own VM instead, and each worker interleaves its
+// share of them as green threads, so jobs reading from pipes or FIFOs wait for
+// input without holding a thread.
+namespace {
+    struct Job {
+        std::string programFile;
+        std::string inputFile; // Empty runs the job with no input
+        std::shared_ptr<ProgramImage> image;
+
+        std::string output;
+        RunResult result{RunStatus::ERROR, 1, 0};
+        std::chrono::nanoseconds latency{0};
+    };
+
+    // One job per line: "<program> [stdin file]". Blank lines and lines starting with # are skipped.
+    bool readManifest(const std::string &filename, std::vector<Job> &jobs) {
+        std::ifstream manifest(filename);
+        if(!manifest.is_open()) {
+            std::cerr << "Unable to open file " << filename << std::endl;
+            return false;
+        }
+
+        std::string line;
+        int lineNumber = 0;
+        while(std::getline(manifest, line)) {
+            lineNumber++;
+            std::istringstream fields(line);
+            Job job;
+            if(!(fields >> job.programFile) || job.programFile[0] == '#') continue;
+            fields >> job.inputFile;
+
+            std::string extra;
+            if(fields >> extra) {
+                std::cerr << "Error: " << filename << ":" << lineNumber << ": expected <program> [stdin file]" << std::endl;
+                return false;
+            }
+            jobs.push_back(std::move(job));
+        }
+        return true;
+    }
+
+    const char *statusName(RunStatus status) {
+        switch(status) {
+            case RunStatus::HALTED: return "halted";
+            case RunStatus::ERROR: return "error";
+            case RunStatus::STACK_OVERFLOW: return "stack overflow";
+            case RunStatus::STACK_UNDERFLOW: return "stack underflow";
+            case RunStatus::OUT_OF_FUEL: return "out of fuel";
+            case RunStatus::YIELDED: return "yielded";
+            case RunStatus::BLOCKED: return "blocked";
+        }
+        return "unknown";
+    }
+
+    double milliseconds(std::chrono::nanoseconds duration) {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    // Nearest-rank percentile of sorted latencies
+    std::chrono::nanoseconds percentile(const std::vector<std::chrono::nanoseconds> &sorted, double p) {
+        const auto rank = static_cast<size_t>(p / 100.0 * static_cast<double>(sorted.size()) + 0.5);
+        return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+    }
+
+    void runJob(StackMachine &vm, Job &job, DispatchMode dispatchMode) {
+        std::string inputText;
+        if(!job.inputFile.empty()) {
+            std::ifstream inputFile(job.inputFile, std::ios::binary);
+            if(!inputFile.is_open()) {
+                std::cerr << "Unable to open file " << job.inputFile << std::endl;
+                return;
+            }
+            inputText.assign(std::istreambuf_iterator<char>(inputFile), std::istreambuf_iterator<char>());
+        }
+
+        std::istringstream input(inputText);
+        std::ostringstream output;
+        vm.setInput(input);
+        vm.setOutput(output);
+        vm.setProgram(job.image);
+
+        const auto start = std::chrono::steady_clock::now();
+        job.result = vm.runProgram(dispatchMode);
+        job.latency = std::chrono::steady_clock::now() - start;
+        job.output = std::move(output).str();
+    }
+
+    // Runs a group of jobs as green threads on the calling thread. Inputs are
+    // opened non-blocking, and latency is measured from the start of the batch.
+    // Holding a FIFO's write end means its input never ends: a job that reads
+    // more than its writer sends waits for it instead of failing.
+    void runGreen(std::vector<Job> &jobs, const std::vector<size_t> &group, DispatchMode dispatchMode,
+                  uint64_t timeSlice, size_t stackSlots, uint64_t fuelLimit, std::chrono::steady_clock::time_point start) {
+        struct Session {
+            size_t job;
+            std::unique_ptr<StackMachine> vm;
+            std::istringstream noInput;
+            std::ostringstream output;
+            int inputFd = -1;
+        };
+
+        GreenScheduler scheduler(dispatchMode, timeSlice);
+        std::vector<std::unique_ptr<Session>> sessions;
+        for(size_t index : group) {
+            Job &job = jobs[index];
+            if(!job.image) continue;
+
+            auto session = std::make_unique<Session>();
+            session->job = index;
+            session->vm = std::make_unique<StackMachine>(stackSlots);
+            if(!job.inputFile.empty()) {
+                // A FIFO opened read-only reads as end of input until a writer shows up, so it is
+                // opened read-write instead: an empty FIFO then reports would-block and the session waits
+                struct stat info{};
+                const bool fifo = stat(job.inputFile.c_str(), &info) == 0 && S_ISFIFO(info.st_mode);
+                session->inputFd = open(job.inputFile.c_str(), (fifo ? O_RDWR : O_RDONLY) | O_NONBLOCK);
+                if(session->inputFd < 0) {
+                    std::cerr << "Unable to open file " << job.inputFile << std::endl;
+                    continue;
+                }
+                session->vm->setInput(session->inputFd);
+            } else {
+                session->vm->setInput(session->noInput);
+            }
+            session->vm->setOutput(session->output);
+            session->vm->setFuelLimit(fuelLimit);
+            session->vm->setProgram(job.image);
+
+            scheduler.add(*session->vm, session->inputFd);
+            sessions.push_back(std::move(session));
+        }
+
+        // A finished session's VM and descriptor are released right away
+        scheduler.run([&](size_t id, const RunResult &result) {
+            Session &session = *sessions[id];
+            Job &job = jobs[session.job];
+            job.result = result;
+            job.latency = std::chrono::steady_clock::now() - start;
+            job.output = std::move(session.output).str();
+            session.vm.reset();
+            if(session.inputFd >= 0) close(session.inputFd);
+        });
+    }
+
+    void report(const std::vector<Job> &jobs, size_t workers, std::chrono::nanoseconds wallTime) {
+        std::vector<std::chrono::nanoseconds> latencies;
+        uint64_t instructions = 0;
+        size_t failed = 0;
+        for(const Job &job : jobs) {
+            latencies.push_back(job.latency);
+            instructions += job.result.instructionCount;
+            if(job.result.status != RunStatus::HALTED) failed++;
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        const double seconds = std::chrono::duration<double>(wallTime).count();
+        std::cerr << std::fixed << std::setprecision(3)
+                  << "\nJobs: " << jobs.size() << " (" << failed << " failed) on " << workers << " workers in " << seconds << " s\n"
+                  << "Throughput: " << std::setprecision(1) << static_cast<double>(jobs.size()) / seconds << " jobs/s, "
+                  << static_cast<double>(instructions) / seconds / 1e6 << " M instructions/s\n";
+        if(latencies.empty()) return;
+
+        std::cerr << std::setprecision(3) << "Latency (ms): p50 " << milliseconds(percentile(latencies, 50))
+                  << "  p90 " << milliseconds(percentile(latencies, 90))
+                  << "  p99 " << milliseconds(percentile(latencies, 99))
+                  << "  max " << milliseconds(latencies.back()) << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string manifestFile;
+    std::string outputDirectory;
+    DispatchMode dispatchMode = DispatchMode::SWITCH;
+    size_t stackSlots = StackRegion::DEFAULT_SLOTS;
+    uint64_t fuelLimit = UINT64_MAX;
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    bool green = false;
+    uint64_t timeSlice = 100000;
+
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--dispatch=switch") {
+            dispatchMode = DispatchMode::SWITCH;
+        } else if(arg == "--dispatch=threaded") {
+            dispatchMode = DispatchMode::THREADED;
+        } else if(arg == "--jit") {
+            dispatchMode = DispatchMode::JIT;
+        } else if(arg == "--green") {
+            green = true;
+        } else if(arg.starts_with("--time-slice=")) {
+            try {
+                timeSlice = std::stoull(arg.substr(std::string("--time-slice=").size()));
+            } catch(const std::exception &) {
+                timeSlice = 0;
+            }
+            if(timeSlice == 0) {
+                std::cerr << "Invalid time slice: " << arg << std::endl;
+                return 1;
+            }
+        } else if(arg.starts_with("--jobs=")) {
+            try {
+                workers = std::stoul(arg.substr(std::string("--jobs=").size()));
+            } catch(const std::exception &) {
+                workers = 0;
+            }
+            if(workers == 0) {
+                std::cerr << "Invalid job count: " << arg << std::endl;
+                return 1;
+            }
+        } else if(arg.starts_with("--fuel=")) {
+            try {
+                fuelLimit = std::stoull(arg.substr(std::string("--fuel=").size()));
+            } catch(const std::exception &) {
+                fuelLimit = 0;
+            }
+            if(fuelLimit == 0) {
+                std::cerr << "Invalid fuel limit: " << arg << std::endl;
+                return 1;
+            }
+        } else if(arg.starts_with("--stack-size=")) {
+            try {
+                stackSlots = std::stoul(arg.substr(std::string("--stack-size=").size()));
+            } catch(const std::exception &) {
+                stackSlots = 0;
+            }
+            if(stackSlots == 0) {
+                std::cerr << "Invalid stack size: " << arg << std::endl;
+                return 1;
+            }
+        } else if(arg.starts_with("--output-dir=")) {
+            outputDirectory = arg.substr(std::string("--output-dir=").size());
+        } else if(arg.starts_with("--")) {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        } else {
+            manifestFile = arg;
+        }
+    }
+
+    if(manifestFile.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--jobs=N] [--green [--time-slice=instructions]] [--dispatch=switch|threaded] [--jit] [--stack-size=slots] [--fuel=instructions] [--output-dir=dir] <manifest>" << std::endl;
+        return 1;
+    }
+
+    std::vector<Job> jobs;
+    if(!readManifest(manifestFile, jobs)) return 1;
+
+    // Each distinct program is assembled or mapped once, then shared by its jobs
+    std::map<std::string, std::shared_ptr<ProgramImage>> images;
+    for(Job &job : jobs) {
+        auto [entry, inserted] = images.try_emplace(job.programFile);
+        if(inserted) {
+            entry->second = StackMachine::loadImage(job.programFile);
+            if(!entry->second) std::cerr << "Error: unable to load " << job.programFile << std::endl;
+        }
+        job.image = entry->second;
+    }
+
+    WorkStealingPool pool(std::min(workers, std::max<size_t>(jobs.size(), 1)));
+    std::vector<std::unique_ptr<StackMachine>> contexts(pool.size());
+
+    const auto start = std::chrono::steady_clock::now();
+    if(green) {
+        // Jobs are dealt out round-robin, one group of green threads per worker
+        std::vector<std::vector<size_t>> groups(pool.size());
+        for(size_t i = 0; i < jobs.size(); i++) groups[i % groups.size()].push_back(i);
+
+        pool.run(groups.size(), [&](size_t, size_t group) {
+            runGreen(jobs, groups[group], dispatchMode, timeSlice, stackSlots, fuelLimit, start);
+        });
+    } else {
+        pool.run(jobs.size(), [&](size_t worker, size_t index) {
+            Job &job = jobs[index];
+            if(!job.image) return;
+            if(!contexts[worker]) {
+                contexts[worker] = std::make_unique<StackMachine>(stackSlots);
+                contexts[worker]->setFuelLimit(fuelLimit);
+            }
+            runJob(*contexts[worker], job, dispatchMode);
+        });
+    }
+    const auto wallTime = std::chrono::steady_clock::now() - start;
+
+    // Outputs are written in manifest order once everything has run: inline
+    // after a header per job, or to <dir>/job<N>.out with only the header printed
+    if(!outputDirectory.empty()) std::filesystem::create_directories(outputDirectory);
+    for(size_t i = 0; i < jobs.size(); i++) {
+        const Job &job = jobs[i];
+        std::cout << "== job " << i << ": " << job.programFile << " (" << statusName(job.result.status)
+                  << ", exit " << job.result.exitValue << ", " << job.result.instructionCount << " instructions) ==\n";
+        if(outputDirectory.empty()) {
+            std::cout << job.output;
+            continue;
+        }
+
+        const std::string outputFile = outputDirectory + "/job" + std::to_string(i) + ".out";
+        std::ofstream file(outputFile, std::ios::binary);
+        if(!file.is_open()) {
+            std::cerr << "Unable to open file " << outputFile << std::endl;
+            return 1;
+        }
+        file << job.output;
+    }
+    std::cout.flush();
+
+    report(jobs, pool.size(), wallTime);
+
+    const bool allHalted = std::all_of(jobs.begin(), jobs.end(), [](const Job &job) { return job.result.status == RunStatus::HALTED; });
+    return allHalted ? 0 : 1;
+}